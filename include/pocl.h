@@ -66,6 +66,10 @@ typedef struct
   void *data;
   char *tmp_dir; 
   pocl_workgroup wg;
+  /* The compiled variant of the kernel being launched. */
+  struct pocl_wg_variant *wg_variant;
+  /* The launch measures the local size for POCL_LOCAL_SIZE_TUNING. */
+  int tuning_local_size;
   cl_kernel kernel;
   /* A list of argument buffers to free after the command has 
      been executed. */
@@ -25,10 +25,12 @@
 #include "pocl_cl.h"
 #include "install-paths.h"
 #include <assert.h>
+#include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include "pocl_llvm.h"
+#include "pocl_compiler_pool.h"
 
 /* supported compiler parameters which should pass to the frontend directly
    by using -Xclang */
@@ -54,6 +56,166 @@ static char cl_parameters_not_yet_supported_by_clang[] =
 #define MEM_ASSERT(x, err_jmp) do{ if (x){errcode = CL_OUT_OF_HOST_MEMORY;goto err_jmp;}} while(0)
 #define COMMAND_LENGTH 4096
 
+typedef struct program_build program_build;
+
+/* The build of the program for one of the devices, run as a compiler
+   thread task. */
+typedef struct device_build
+{
+  program_build *build;
+  int device_i;
+} device_build;
+
+/* A build of a program from the source for a set of devices. */
+struct program_build
+{
+  cl_program program;
+  cl_device_id *devices;
+  unsigned num_devices;
+  device_build *device_builds;
+  char *user_options;
+  char source_file_name[POCL_FILENAME_LENGTH];
+  void (CL_CALLBACK *pfn_notify) (cl_program program, void *user_data);
+  void *user_data;
+  /* Used to wait for the device builds in the synchronous builds. */
+  pocl_compiler_task_set tasks;
+  pocl_lock_t lock;
+  unsigned pending;
+  cl_int errcode;
+};
+
+/* Frees the build data and sets the final build status of the program. 
+   In the asynchronous builds also notifies the user and releases the 
+   program retained for the duration of the build. */
+static cl_int
+finish_program_build (program_build *build)
+{
+  cl_program program = build->program;
+  cl_int errcode = build->errcode;
+  int i;
+
+  if (errcode != CL_SUCCESS)
+    {
+      /* Set pointers to NULL so that clProgramRelease won't 
+         cause a double free. */
+      for (i = 0; i < build->num_devices; i++)
+        {
+          free (program->binaries[i]);
+          program->binaries[i] = NULL;
+        }
+      free (program->binaries);
+      program->binaries = NULL;
+      free (program->binary_sizes);
+      program->binary_sizes = NULL;
+    }
+
+  POCL_LOCK_OBJ (program);
+  program->build_status = 
+    errcode == CL_SUCCESS ? CL_BUILD_SUCCESS : CL_BUILD_ERROR;
+  POCL_UNLOCK_OBJ (program);
+
+  if (build->pfn_notify != NULL)
+    {
+      build->pfn_notify (program, build->user_data);
+      POname(clReleaseProgram) (program);
+    }
+
+  pocl_compiler_task_set_destroy (&build->tasks);
+  pthread_mutex_destroy (&build->lock);
+  free (build->user_options);
+  free (build->device_builds);
+  free (build->devices);
+  free (build);
+  return errcode;
+}
+
+/* Builds the fully linked non-parallel bitcode for one device. */
+static void
+build_program_for_device (void *data)
+{
+  device_build *db = (device_build*) data;
+  program_build *build = db->build;
+  cl_program program = build->program;
+  int device_i = db->device_i;
+  cl_device_id device = build->devices[device_i];
+  char device_tmpdir[POCL_FILENAME_LENGTH];
+  char binary_file_name[POCL_FILENAME_LENGTH];
+  FILE *binary_file;
+  unsigned char *binary;
+  size_t n;
+  int error;
+  int errcode = CL_SUCCESS;
+  int last;
+
+  program->binaries[device_i] = NULL;
+  snprintf (device_tmpdir, POCL_FILENAME_LENGTH, "%s/%s", 
+            program->temp_dir, device->short_name);
+  mkdir (device_tmpdir, S_IRWXU);
+
+  snprintf 
+    (binary_file_name, POCL_FILENAME_LENGTH, "%s/%s", 
+     device_tmpdir, POCL_PROGRAM_BC_FILENAME);
+
+  error = call_pocl_build(program, device, device_i, 
+                          build->source_file_name,
+                          binary_file_name, device_tmpdir,
+                          build->user_options);     
+
+  if (error != 0)
+    {
+      errcode = CL_BUILD_PROGRAM_FAILURE;
+      goto FINISH;
+    }
+
+  /* In case we cached the llvm::Module, we might not have
+     dumped the bitcode yet. FIXME: always assume this and
+     fix this in the binary query API. */
+  if (program->llvm_irs[device->dev_id] == NULL)
+    {
+      binary_file = fopen(binary_file_name, "r");
+      if (binary_file == NULL)
+        {
+          errcode = CL_OUT_OF_HOST_MEMORY;
+          goto FINISH;
+        }
+
+      fseek(binary_file, 0, SEEK_END);
+      
+      program->binary_sizes[device_i] = ftell(binary_file);
+      fseek(binary_file, 0, SEEK_SET);
+
+      binary = (unsigned char *) malloc(program->binary_sizes[device_i]);
+      if (binary == NULL)
+        {
+          fclose (binary_file);
+          errcode = CL_OUT_OF_HOST_MEMORY;
+          goto FINISH;
+        }
+
+      n = fread(binary, 1, program->binary_sizes[device_i], binary_file);
+      fclose (binary_file);
+      if (n < program->binary_sizes[device_i])
+        {
+          free (binary);
+          errcode = CL_OUT_OF_HOST_MEMORY;
+          goto FINISH;
+        }
+      program->binaries[device_i] = binary;
+    }
+
+FINISH:
+  POCL_LOCK (build->lock);
+  if (errcode != CL_SUCCESS)
+    build->errcode = errcode;
+  last = --build->pending == 0;
+  POCL_UNLOCK (build->lock);
+
+  /* In the asynchronous case the device build finishing last finishes
+     the whole build. Otherwise the clBuildProgram caller does it. */
+  if (last && build->pfn_notify != NULL)
+    finish_program_build (build);
+}
+
 CL_API_ENTRY cl_int CL_API_CALL
 POname(clBuildProgram)(cl_program program,
                        cl_uint num_devices,
@@ -66,13 +228,13 @@ CL_API_SUFFIX__VERSION_1_0
 {
   char tmpdir[POCL_FILENAME_LENGTH];
   char device_tmpdir[POCL_FILENAME_LENGTH];
-  char source_file_name[POCL_FILENAME_LENGTH], binary_file_name[POCL_FILENAME_LENGTH];
+  char binary_file_name[POCL_FILENAME_LENGTH];
   FILE *source_file, *binary_file;
   size_t n;
   int errcode;
   int i;
   int error;
-  unsigned char *binary;
+  program_build *build;
   unsigned real_num_devices;
   const cl_device_id *real_device_list;
   /* The default build script for .cl files. */
@@ -95,7 +257,7 @@ CL_API_SUFFIX__VERSION_1_0
     goto ERROR;
   }
 
-  if (program->kernels)
+  if (program->kernels || program->build_status == CL_BUILD_IN_PROGRESS)
   {
     errcode = CL_INVALID_OPERATION;
     goto ERROR;
@@ -206,15 +368,46 @@ CL_API_SUFFIX__VERSION_1_0
         goto ERROR_CLEAN_BINARIES;
       }
 
+      build = (program_build*) calloc (1, sizeof (program_build));
+      MEM_ASSERT(build == NULL, ERROR_CLEAN_PROGRAM);
+      build->program = program;
+      build->num_devices = real_num_devices;
+      build->devices = 
+        (cl_device_id*) malloc (sizeof (cl_device_id) * real_num_devices);
+      build->device_builds = 
+        (device_build*) malloc (sizeof (device_build) * real_num_devices);
+      build->user_options = strdup (user_options);
+      if (build->devices == NULL || build->device_builds == NULL ||
+          build->user_options == NULL)
+        {
+          free (build->devices);
+          free (build->device_builds);
+          free (build->user_options);
+          free (build);
+          errcode = CL_OUT_OF_HOST_MEMORY;
+          goto ERROR_CLEAN_PROGRAM;
+        }
+      memcpy (build->devices, real_device_list, 
+              sizeof (cl_device_id) * real_num_devices);
+      build->pfn_notify = pfn_notify;
+      build->user_data = user_data;
+      POCL_INIT_LOCK (build->lock);
+      pocl_compiler_task_set_init (&build->tasks);
+      build->pending = real_num_devices;
+      build->errcode = CL_SUCCESS;
+
       snprintf 
-        (source_file_name, POCL_FILENAME_LENGTH, "%s/%s", tmpdir, 
+        (build->source_file_name, POCL_FILENAME_LENGTH, "%s/%s", tmpdir, 
          POCL_PROGRAM_CL_FILENAME);
 
-      source_file = fopen(source_file_name, "w+");
+      source_file = fopen(build->source_file_name, "w+");
       if (source_file == NULL)
       {
+        build->errcode = CL_OUT_OF_HOST_MEMORY;
+        build->pfn_notify = NULL;
+        finish_program_build (build);
         errcode = CL_OUT_OF_HOST_MEMORY;
-        goto ERROR_CLEAN_BINARIES;
+        goto ERROR_CLEAN_OPTIONS;
       }
 
       n = fwrite (program->source, 1,
@@ -223,68 +416,49 @@ CL_API_SUFFIX__VERSION_1_0
 
       if (n < strlen(program->source))
       {
+        build->pfn_notify = NULL;
+        build->errcode = CL_OUT_OF_HOST_MEMORY;
+        finish_program_build (build);
         errcode = CL_OUT_OF_HOST_MEMORY;
-        goto ERROR_CLEAN_BINARIES;
+        goto ERROR_CLEAN_OPTIONS;
       }
 
-      /* Build the fully linked non-parallel bitcode for all
-         devices. */
       for (device_i = 0; device_i < real_num_devices; ++device_i)
         {
-          program->binaries[device_i] = NULL;
-          cl_device_id device = real_device_list[device_i];
-          snprintf (device_tmpdir, POCL_FILENAME_LENGTH, "%s/%s", 
-                    program->temp_dir, device->short_name);
-          mkdir (device_tmpdir, S_IRWXU);
-
-          snprintf 
-            (binary_file_name, POCL_FILENAME_LENGTH, "%s/%s", 
-             device_tmpdir, POCL_PROGRAM_BC_FILENAME);
-
-          error = call_pocl_build(program, device, device_i, source_file_name,
-                                  binary_file_name, device_tmpdir,
-                                  user_options);     
-
-          if (error != 0)
-          {
-            errcode = CL_BUILD_PROGRAM_FAILURE;
-            goto ERROR_CLEAN_BINARIES;
-          }
-
-          /* In case we cached the llvm::Module, we might not have
-             dumped the bitcode yet. FIXME: always assume this and
-             fix this in the binary query API. */
-          if (program->llvm_irs[device->dev_id] == NULL)
-            {
-              binary_file = fopen(binary_file_name, "r");
-              if (binary_file == NULL)
-                {
-                  errcode = CL_OUT_OF_HOST_MEMORY;
-                  goto ERROR_CLEAN_BINARIES;
-                }
+          build->device_builds[device_i].build = build;
+          build->device_builds[device_i].device_i = device_i;
+        }
 
-              fseek(binary_file, 0, SEEK_END);
-              
-              program->binary_sizes[device_i] = ftell(binary_file);
-              fseek(binary_file, 0, SEEK_SET);
+      POCL_LOCK_OBJ (program);
+      program->build_status = CL_BUILD_IN_PROGRESS;
+      POCL_UNLOCK_OBJ (program);
 
-              binary = (unsigned char *) malloc(program->binary_sizes[device_i]);
-              if (binary == NULL)
-                {
-                  errcode = CL_OUT_OF_HOST_MEMORY;
-                  goto ERROR_CLEAN_BINARIES;
-                }
+      /* Build the fully linked non-parallel bitcode for all devices
+         in parallel in the compiler threads. With a callback the build 
+         is finished asynchronously. */
+      if (pfn_notify != NULL)
+        {
+          POCL_RETAIN_OBJECT (program);
+          for (device_i = 0; device_i < real_num_devices; ++device_i)
+            pocl_compiler_submit (NULL, build_program_for_device, 
+                                  &build->device_builds[device_i]);
+          free (modded_options);
+          return CL_SUCCESS;
+        }
 
-              n = fread(binary, 1, program->binary_sizes[device_i], binary_file);
-              if (n < program->binary_sizes[device_i])
-                {
-                  errcode = CL_OUT_OF_HOST_MEMORY;
-                  goto ERROR_CLEAN_BINARIES;
-                }
-              program->binaries[device_i] = binary;
-            }
+      if (real_num_devices == 1)
+        build_program_for_device (&build->device_builds[0]);
+      else
+        {
+          for (device_i = 0; device_i < real_num_devices; ++device_i)
+            pocl_compiler_submit (&build->tasks, build_program_for_device,
+                                  &build->device_builds[device_i]);
+          pocl_compiler_task_set_wait (&build->tasks);
         }
-        
+
+      errcode = finish_program_build (build);
+      if (errcode != CL_SUCCESS)
+        goto ERROR_CLEAN_OPTIONS;
     }
   else
     {
@@ -297,8 +471,10 @@ CL_API_SUFFIX__VERSION_1_0
                     program->temp_dir, real_device_list[device_i]->short_name);
           MEM_ASSERT(count >= POCL_FILENAME_LENGTH, ERROR_CLEAN_PROGRAM);
 
+          /* The dir exists already in case the binary contained
+             compiled work-group functions. */
           error = mkdir (device_tmpdir, S_IRWXU);
-          MEM_ASSERT(error, ERROR_CLEAN_PROGRAM);
+          MEM_ASSERT(error && errno != EEXIST, ERROR_CLEAN_PROGRAM);
 
           count = snprintf 
             (binary_file_name, POCL_FILENAME_LENGTH, "%s/%s", 
@@ -313,8 +489,12 @@ CL_API_SUFFIX__VERSION_1_0
 
           fclose (binary_file);
         }      
+      program->build_status = CL_BUILD_SUCCESS;
+      if (pfn_notify != NULL)
+        pfn_notify (program, user_data);
     }
 
+  free (modded_options);
   return CL_SUCCESS;
 
   /* Set pointers to NULL during cleanup so that clProgramRelease won't
@@ -24,6 +24,7 @@
 
 #include "pocl_cl.h"
 #include "pocl_llvm.h"
+#include "pocl_wg_variants.h"
 #include "install-paths.h"
 #include <string.h>
 #include <unistd.h>
@@ -51,7 +52,8 @@ POname(clCreateKernel)(cl_program program,
     goto ERROR;
   }
 
-  if (program->binaries == NULL || program->binary_sizes == NULL)
+  if (program->binaries == NULL || program->binary_sizes == NULL ||
+      program->build_status == CL_BUILD_IN_PROGRESS)
   {
     errcode = CL_INVALID_PROGRAM_EXECUTABLE;
     goto ERROR;
@@ -65,6 +67,12 @@ POname(clCreateKernel)(cl_program program,
   }
 
   POCL_INIT_OBJECT (kernel);
+  POCL_INIT_LOCK (kernel->wg_variant_lock);
+  memset (kernel->wg_variants, 0, sizeof (kernel->wg_variants));
+  kernel->spec_arguments = NULL;
+  kernel->spec_launches = 0;
+  kernel->num_specialized_variants = 0;
+  kernel->auto_local_device = NULL;
 
   for (device_i = 0; device_i < program->num_devices; ++device_i)
     {
@@ -146,12 +154,17 @@ POname(clCreateKernel)(cl_program program,
   kernel->program = program;
   kernel->next = NULL;
 
+  /* The list is read by clGetProgramInfo with the lock held. */
+  POCL_LOCK_OBJ (program);
   cl_kernel k = program->kernels;
   program->kernels = kernel;
   kernel->next = k;
+  POCL_UNLOCK_OBJ (program);
 
   POCL_RETAIN_OBJECT(program);
 
+  pocl_compile_wg_variants_eagerly (kernel);
+
   if (errcode_ret != NULL)
     *errcode_ret = CL_SUCCESS;
   return kernel;
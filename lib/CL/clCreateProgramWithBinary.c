@@ -23,6 +23,7 @@
 
 #include "pocl_cl.h"
 #include "pocl_util.h"
+#include "pocl_binary.h"
 #include "devices.h"
 #include <string.h>
 
@@ -39,6 +40,9 @@ POname(clCreateProgramWithBinary)(cl_context                     context,
   cl_program program;
   unsigned total_binary_size;
   unsigned char *pos;
+  const unsigned char *bitcode;
+  size_t bitcode_size;
+  char device_tmpdir[POCL_FILENAME_LENGTH];
   int i;
   int j;
   int errcode;
@@ -63,7 +67,22 @@ POname(clCreateProgramWithBinary)(cl_context                     context,
         errcode = CL_INVALID_VALUE;
         goto ERROR;
       }
-      total_binary_size += lengths[i];
+      /* Only the bitcode of a pocl binary is kept in memory, the
+         compiled files are unpacked to the temp dir below. */
+      if (pocl_binary_is_container (binaries[i], lengths[i]))
+        {
+          if (pocl_binary_deserialize (binaries[i], lengths[i], &bitcode,
+                                       &bitcode_size, NULL) != CL_SUCCESS)
+            {
+              if (binary_status != NULL)
+                binary_status[i] = CL_INVALID_BINARY;
+              errcode = CL_INVALID_BINARY;
+              goto ERROR;
+            }
+          total_binary_size += bitcode_size;
+        }
+      else
+        total_binary_size += lengths[i];
     }
 
   // check for invalid devices in device_list[].
@@ -106,6 +125,8 @@ POname(clCreateProgramWithBinary)(cl_context                     context,
   POCL_INIT_OBJECT(program);
   program->binary_sizes = NULL;
   program->binaries = NULL;
+  program->pocl_binary_sizes = NULL;
+  program->pocl_binaries = NULL;
   program->compiler_options = NULL;
   program->llvm_irs = NULL;
 
@@ -128,6 +149,7 @@ POname(clCreateProgramWithBinary)(cl_context                     context,
   program->devices = malloc (sizeof(cl_device_id) * num_devices);
   program->source = NULL;
   program->kernels = NULL;
+  program->build_status = CL_BUILD_NONE;
   /* Create the temporary directory where all kernel files and compilation
      (intermediate) results are stored. */
   program->temp_dir = pocl_create_temp_dir();
@@ -136,11 +158,23 @@ POname(clCreateProgramWithBinary)(cl_context                     context,
   for (i = 0; i < num_devices; ++i)
     {
       program->devices[i] = device_list[i];
-      program->binary_sizes[i] = lengths[i];
-      memcpy (pos, binaries[i], lengths[i]);
+      bitcode = binaries[i];
+      bitcode_size = lengths[i];
+      if (pocl_binary_is_container (binaries[i], lengths[i]))
+        {
+          snprintf (device_tmpdir, POCL_FILENAME_LENGTH, "%s/%s", 
+                    program->temp_dir, device_list[i]->short_name);
+          errcode = pocl_binary_deserialize (binaries[i], lengths[i], 
+                                             &bitcode, &bitcode_size, 
+                                             device_tmpdir);
+          if (errcode != CL_SUCCESS)
+            goto ERROR_CLEAN_PROGRAM_BINARIES_AND_DEVICES;
+        }
+      program->binary_sizes[i] = bitcode_size;
+      memcpy (pos, bitcode, bitcode_size);
       program->binaries[i] = pos;
-      pos += lengths[i];
-      if (binary_status != NULL) /* TODO: validate the binary */
+      pos += bitcode_size;
+      if (binary_status != NULL) /* TODO: validate the bitcode */
           binary_status[i] = CL_SUCCESS;
     }
   POCL_RETAIN_OBJECT(context);
@@ -149,10 +183,10 @@ POname(clCreateProgramWithBinary)(cl_context                     context,
     *errcode_ret = CL_SUCCESS;
   return program;
 
-#if 0
 ERROR_CLEAN_PROGRAM_BINARIES_AND_DEVICES:
+  remove_directory (program->temp_dir);
+  free (program->temp_dir);
   free(program->devices);
-#endif
 ERROR_CLEAN_PROGRAM_AND_BINARIES:
   free(program->binaries[0]);
   free(program->binaries);
@@ -107,7 +107,12 @@ POname(clCreateProgramWithSource)(cl_context context,
   program->devices = context->devices;
   program->binary_sizes = NULL;
   program->binaries = NULL;
+  program->pocl_binary_sizes = NULL;
+  program->pocl_binaries = NULL;
   program->kernels = NULL;
+  program->compiler_options = NULL;
+  program->llvm_irs = NULL;
+  program->build_status = CL_BUILD_NONE;
 
   /* Create the temporary directory where all kernel files and compilation
      (intermediate) results are stored. */
@@ -26,6 +26,7 @@
 #include "pocl_cl.h"
 #include "pocl_llvm.h"
 #include "pocl_util.h"
+#include "pocl_wg_variants.h"
 #include "utlist.h"
 #include "install-paths.h"
 #include <assert.h>
@@ -53,11 +54,8 @@ POname(clEnqueueNDRangeKernel)(cl_command_queue command_queue,
   size_t offset_x, offset_y, offset_z;
   size_t global_x, global_y, global_z;
   size_t local_x, local_y, local_z;
-  char tmpdir[POCL_FILENAME_LENGTH];
-  char kernel_filename[POCL_FILENAME_LENGTH];
-  FILE *kernel_file;
-  char parallel_filename[POCL_FILENAME_LENGTH];
-  size_t n;
+  pocl_wg_variant *variant;
+  int tuning_local_size = 0;
   int i, count;
   int error;
   struct pocl_context pc;
@@ -80,8 +78,8 @@ POname(clEnqueueNDRangeKernel)(cl_command_queue command_queue,
   if (global_work_offset != NULL)
     {
       offset_x = global_work_offset[0];
-      offset_y = work_dim > 1 ? global_work_offset[1] : 1;
-      offset_z = work_dim > 2 ? global_work_offset[2] : 1;
+      offset_y = work_dim > 1 ? global_work_offset[1] : 0;
+      offset_z = work_dim > 2 ? global_work_offset[2] : 0;
     }
   else
     {
@@ -104,33 +102,10 @@ POname(clEnqueueNDRangeKernel)(cl_command_queue command_queue,
       local_z = work_dim > 2 ? local_work_size[2] : 1;
     } 
   else 
-    {
-      size_t preferred_wg_multiple;
-      cl_int retval = 
-        POname(clGetKernelWorkGroupInfo)
-        (kernel, command_queue->device, 
-         CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, 
-         sizeof (size_t), &preferred_wg_multiple, NULL);
-
-      local_x = local_y = local_z = 1;
-      if (retval == CL_SUCCESS)
-        {
-          /* Find the largest multiple of the preferred wg multiple.
-             E.g. if the preferred is 8 it doesn't work with a
-             global size of 20. However, 4 is better than 1 in that
-             case because it still enables wi-parallelization. */
-          while (preferred_wg_multiple >= 1)
-            {
-              if (global_x % preferred_wg_multiple == 0 &&
-                  preferred_wg_multiple <= global_x)
-                {
-                  local_x = preferred_wg_multiple;
-                  break;
-                }
-              preferred_wg_multiple /= 2;
-            }
-        }
-    }
+    tuning_local_size = 
+      pocl_select_local_size (kernel, command_queue->device, 
+                              global_x, global_y, global_z,
+                              &local_x, &local_y, &local_z);
 
 #ifdef DEBUG_NDRANGE
   printf("### queueing kernel %s for dimensions %zu x %zu x %zu...", 
@@ -156,74 +131,11 @@ POname(clEnqueueNDRangeKernel)(cl_command_queue command_queue,
       (event_wait_list != NULL && num_events_in_wait_list == 0))
     return CL_INVALID_EVENT_WAIT_LIST;
 
-  snprintf (tmpdir, POCL_FILENAME_LENGTH, "%s/%s/%s/%zu-%zu-%zu.%zu-%zu-%zu", 
-            kernel->program->temp_dir, command_queue->device->short_name, 
-            kernel->name, 
-            local_x, local_y, local_z, offset_x, offset_y, offset_z);
-  mkdir (tmpdir, S_IRWXU);
-
-  
-  error = snprintf
-    (parallel_filename, POCL_FILENAME_LENGTH,
-     "%s/%s", tmpdir, POCL_PARALLEL_BC_FILENAME);
-  if (error < 0)
-    return CL_OUT_OF_HOST_MEMORY;
-
-  if (kernel->program->llvm_irs[0] == NULL)
-    {
-      error = snprintf
-        (kernel_filename, POCL_FILENAME_LENGTH,
-         "%s/%s/%s/kernel.bc", kernel->program->temp_dir, 
-         command_queue->device->short_name, kernel->name);
-
-      if (error < 0)
-        return CL_OUT_OF_HOST_MEMORY;
-
-      if (access (kernel_filename, F_OK) != 0) 
-        {
-          kernel_file = fopen(kernel_filename, "w+");
-          if (kernel_file == NULL)
-            return CL_OUT_OF_HOST_MEMORY;
-
-          n = fwrite(kernel->program->binaries[command_queue->device->dev_id], 1,
-                     kernel->program->binary_sizes[command_queue->device->dev_id], 
-                     kernel_file);
-          if (n < kernel->program->binary_sizes[command_queue->device->dev_id])
-            return CL_OUT_OF_HOST_MEMORY;
-  
-          fclose(kernel_file);
-
-#ifdef DEBUG_NDRANGE
-          printf("[kernel bc written] ");
-#endif
-        }
-      else
-        {
-#ifdef DEBUG_NDRANGE
-          printf("[kernel bc already written] ");
-#endif
-        }
-    }
-
-  if (access (parallel_filename, F_OK) != 0) 
-    {
-      error = call_pocl_workgroup(command_queue->device,
-                                  kernel, 
-                                  local_x, local_y, local_z,
-                                  parallel_filename, kernel_filename);
-      if (error) return error;
+  variant = pocl_select_wg_variant (kernel, command_queue->device, 
+                                    local_x, local_y, local_z, &error);
+  if (variant == NULL)
+    return error;
 
-#ifdef DEBUG_NDRANGE
-      printf("[parallel bc created]\n");
-#endif
-    }
-  else
-    {
-#ifdef DEBUG_NDRANGE
-      printf("[parallel bc already created]\n");
-#endif
-    }
-  
   error = pocl_create_command (&command_node, command_queue,
                                CL_COMMAND_NDRANGE_KERNEL,
                                event, num_events_in_wait_list,
@@ -238,10 +150,16 @@ POname(clEnqueueNDRangeKernel)(cl_command_queue command_queue,
   pc.global_offset[0] = offset_x;
   pc.global_offset[1] = offset_y;
   pc.global_offset[2] = offset_z;
+  pc.local_size[0] = local_x;
+  pc.local_size[1] = local_y;
+  pc.local_size[2] = local_z;
 
   command_node->type = CL_COMMAND_NDRANGE_KERNEL;
   command_node->command.run.data = command_queue->device->data;
-  command_node->command.run.tmp_dir = strdup(tmpdir);
+  command_node->command.run.tmp_dir = variant->tmp_dir;
+  command_node->command.run.wg_variant = variant;
+  command_node->command.run.tuning_local_size = tuning_local_size;
+  command_node->command.run.wg = pocl_wg_variant_workgroup (variant);
   command_node->command.run.kernel = kernel;
   command_node->command.run.pc = pc;
   command_node->command.run.local_x = local_x;
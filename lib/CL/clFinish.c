@@ -23,6 +23,7 @@
 
 #include "pocl_cl.h"
 #include "pocl_util.h"
+#include "pocl_wg_variants.h"
 #include "pocl_image_util.h"
 #include "utlist.h"
 #include "clEnqueueMapBuffer.h"
@@ -98,6 +99,8 @@ static void exec_commands (_cl_command_node *node_list)
   _cl_command_node *node;
   cl_command_queue command_queue = NULL;
   event_callback_item* cb_ptr;
+  cl_ulong device_start = 0, device_time;
+  int timed;
   
   LL_FOREACH (node_list, node)
     {
@@ -203,7 +206,28 @@ static void exec_commands (_cl_command_node *node_list)
         case CL_COMMAND_NDRANGE_KERNEL:
           assert (*event == node->event);
           POCL_UPDATE_EVENT_RUNNING(event, command_queue);
+          /* Measuring the work-group methods or the local sizes of the
+             kernel, both with the device timer. */
+          timed = pocl_wg_variant_is_timed (node->command.run.wg_variant) ||
+            node->command.run.tuning_local_size;
+          if (timed)
+            device_start = 
+              node->device->ops->get_timer_value (node->device->data);
           node->device->ops->run(node->command.run.data, node);
+          if (timed)
+            {
+              device_time = 
+                node->device->ops->get_timer_value (node->device->data) - 
+                device_start;
+              if (pocl_wg_variant_is_timed (node->command.run.wg_variant))
+                pocl_record_wg_variant_time
+                  (node->command.run.kernel, node->command.run.wg_variant,
+                   device_time);
+              if (node->command.run.tuning_local_size)
+                pocl_record_local_size_time
+                  (node->command.run.kernel, node->device, 
+                   &node->command.run.pc, device_time);
+            }
           POCL_UPDATE_EVENT_COMPLETE(event, command_queue);
           for (i = 0; i < node->command.run.arg_buffer_count; ++i)
             {
@@ -214,7 +238,6 @@ static void exec_commands (_cl_command_node *node_list)
               POname(clReleaseMemObject) (buf);
             }
           free (node->command.run.arg_buffers);
-          free (node->command.run.tmp_dir);
           for (i = 0; i < node->command.run.kernel->num_args + 
                  node->command.run.kernel->num_locals; ++i)
             {
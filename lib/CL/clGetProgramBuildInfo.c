@@ -22,6 +22,7 @@
 */
 
 #include "pocl_cl.h"
+#include "pocl_util.h"
 #include <string.h>
 
 CL_API_ENTRY cl_int CL_API_CALL
@@ -45,18 +46,7 @@ POname(clGetProgramBuildInfo)(cl_program            program,
 
   switch (param_name) {
   case CL_PROGRAM_BUILD_STATUS:
-    {
-      size_t const value_size = strlen(retval) + 1;
-      if (param_value)
-      {
-        if (param_value_size < value_size) return CL_INVALID_VALUE;
-        memcpy(param_value, retval, value_size);
-      }
-      if (param_value_size_ret)
-        *param_value_size_ret = value_size;
-
-      return CL_SUCCESS;
-    }
+    POCL_RETURN_GETINFO(cl_build_status, program->build_status);
     
   case CL_PROGRAM_BUILD_OPTIONS:
     {
@@ -24,8 +24,41 @@
 #include "pocl_cl.h"
 #include "pocl_llvm.h"
 #include "pocl_util.h"
+#include "pocl_binary.h"
 #include <string.h>
 
+/* Bundles the current bitcodes and compiled work-group functions of the
+   program to the binaries returned to the user. Called with the program
+   lock held. */
+static cl_int
+create_pocl_binaries (cl_program program)
+{
+  unsigned i;
+
+  pocl_free_binaries (program);
+  program->pocl_binary_sizes = 
+    (size_t*) calloc (program->num_devices, sizeof (size_t));
+  program->pocl_binaries = 
+    (unsigned char**) calloc (program->num_devices, sizeof (unsigned char*));
+  if (program->pocl_binary_sizes == NULL || program->pocl_binaries == NULL)
+    {
+      pocl_free_binaries (program);
+      return CL_OUT_OF_HOST_MEMORY;
+    }
+
+  for (i = 0; i < program->num_devices; ++i)
+    {
+      program->pocl_binaries[i] = 
+        pocl_binary_serialize (program, i, &program->pocl_binary_sizes[i]);
+      if (program->pocl_binaries[i] == NULL)
+        {
+          pocl_free_binaries (program);
+          return CL_OUT_OF_HOST_MEMORY;
+        }
+    }
+  return CL_SUCCESS;
+}
+
 CL_API_ENTRY cl_int CL_API_CALL
 POname(clGetProgramInfo)(cl_program program,
                  cl_program_info param_name,
@@ -65,9 +98,16 @@ POname(clGetProgramInfo)(cl_program program,
       size_t const value_size = sizeof(size_t) * program->num_devices;
       if (param_value)
       {
-        pocl_llvm_update_binaries (program);
+        cl_int errcode;
         if (param_value_size < value_size) return CL_INVALID_VALUE;
-        memcpy(param_value, program->binary_sizes, value_size);
+        POCL_LOCK_OBJ (program);
+        pocl_llvm_update_binaries (program);
+        errcode = create_pocl_binaries (program);
+        if (errcode == CL_SUCCESS)
+          memcpy(param_value, program->pocl_binary_sizes, value_size);
+        POCL_UNLOCK_OBJ (program);
+        if (errcode != CL_SUCCESS)
+          return errcode;
       }
       if (param_value_size_ret)
         *param_value_size_ret = value_size;
@@ -80,12 +120,26 @@ POname(clGetProgramInfo)(cl_program program,
       if (param_value)
       {
         if (param_value_size < value_size) return CL_INVALID_VALUE;
+        /* The sizes are normally queried first, use the same 
+           binaries the returned sizes are of. */
+        POCL_LOCK_OBJ (program);
+        if (program->pocl_binaries == NULL)
+          {
+            cl_int errcode = create_pocl_binaries (program);
+            if (errcode != CL_SUCCESS)
+              {
+                POCL_UNLOCK_OBJ (program);
+                return errcode;
+              }
+          }
         for (i = 0; i < program->num_devices; ++i)
           {
             unsigned char **target = (unsigned char**) param_value;
             if (target[i] == NULL) continue;
-            memcpy (target[i], program->binaries[i], program->binary_sizes[i]);
+            memcpy (target[i], program->pocl_binaries[i], 
+                    program->pocl_binary_sizes[i]);
           }
+        POCL_UNLOCK_OBJ (program);
       }
       if (param_value_size_ret)
         *param_value_size_ret = value_size;
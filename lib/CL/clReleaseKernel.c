@@ -22,6 +22,7 @@
 */
 
 #include "pocl_cl.h"
+#include "pocl_wg_variants.h"
 
 CL_API_ENTRY cl_int CL_API_CALL
 POname(clReleaseKernel)(cl_kernel kernel) CL_API_SUFFIX__VERSION_1_0
@@ -37,6 +38,7 @@ POname(clReleaseKernel)(cl_kernel kernel) CL_API_SUFFIX__VERSION_1_0
       if (kernel->program != NULL)
         {
           /* Find the kernel in the program's linked list of kernels */
+          POCL_LOCK_OBJ (kernel->program);
           for (pk=&kernel->program->kernels; *pk != NULL; pk = &(*pk)->next)
             {
               if (*pk == kernel) break;
@@ -45,15 +47,19 @@ POname(clReleaseKernel)(cl_kernel kernel) CL_API_SUFFIX__VERSION_1_0
             {
               /* The kernel is not on the kernel's program's linked list
                  of kernels -- something is wrong */
+              POCL_UNLOCK_OBJ (kernel->program);
               return CL_INVALID_VALUE;
             }
           
           /* Remove the kernel from the program's linked list of
-             kernels */
+             kernels. Its variants are freed only after this, as 
+             clGetProgramInfo reads them with the lock held. */
           *pk = (*pk)->next;
+          POCL_UNLOCK_OBJ (kernel->program);
           POname(clReleaseProgram) (kernel->program);
         }
       
+      pocl_free_wg_variants (kernel);
       free ((char*)kernel->function_name);
       free ((char*)kernel->name);
 #if defined(USE_LLVM_API) && USE_LLVM_API == 1
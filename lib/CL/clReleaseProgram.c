@@ -28,6 +28,7 @@
 #include "pocl_cl.h"
 #include "pocl_util.h"
 #include "pocl_runtime_config.h"
+#include "pocl_binary.h"
 
 CL_API_ENTRY cl_int CL_API_CALL
 POname(clReleaseProgram)(cl_program program) CL_API_SUFFIX__VERSION_1_0
@@ -58,6 +59,7 @@ POname(clReleaseProgram)(cl_program program) CL_API_SUFFIX__VERSION_1_0
           free (program->binaries);
         }
       free (program->binary_sizes);
+      pocl_free_binaries (program);
 
       if (!pocl_get_bool_option("POCL_LEAVE_TEMP_DIRS", 0))
         {
@@ -27,7 +27,8 @@
 #include "topology/pocl_topology.h"
 #include "install-paths.h"
 #include "common.h"
-#include "utlist.h"
+#include "pocl_util.h"
+#include "pocl_wg_variants.h"
 
 #include <assert.h>
 #include <string.h>
@@ -202,6 +203,7 @@ pocl_basic_init_device_ops(struct pocl_device_ops *ops)
   ops->fill_rect = pocl_basic_fill_rect;
   ops->map_mem = pocl_basic_map_mem;
   ops->compile_submitted_kernels = pocl_basic_compile_submitted_kernels;
+  ops->compile_kernel = pocl_basic_compile_kernel;
   ops->run = pocl_basic_run;
   ops->run_native = pocl_basic_run_native;
   ops->get_timer_value = pocl_basic_get_timer_value;
@@ -659,44 +661,34 @@ pocl_basic_get_supported_image_formats (cl_mem_flags flags,
     return CL_SUCCESS; 
 }
 
-typedef struct compiler_cache_item compiler_cache_item;
-struct compiler_cache_item
-{
-  char *tmp_dir;
-  char *function_name;
-  pocl_workgroup wg;
-  compiler_cache_item *next;
-};
-
-static compiler_cache_item *compiler_cache;
-static pocl_lock_t compiler_cache_lock;
+/* Serializes the code generation and loading of the work-group 
+   functions. Statically initialized as the kernels can be compiled 
+   ahead of their launches also from the background compiler threads. */
+static pocl_lock_t compiler_lock = POCL_LOCK_INITIALIZER;
 
-void check_compiler_cache (_cl_command_node *cmd)
+/* Returns the work-group function of the variant, generating and 
+   loading its binary at the first call. */
+static pocl_workgroup
+load_workgroup_function (cl_kernel kernel, pocl_wg_variant *variant)
 {
   char workgroup_string[WORKGROUP_STRING_LENGTH];
   lt_dlhandle dlhandle;
-  compiler_cache_item *ci = NULL;
-  
-  if (compiler_cache == NULL)
-    POCL_INIT_LOCK (compiler_cache_lock);
+  pocl_workgroup wg = pocl_wg_variant_workgroup (variant);
 
-  POCL_LOCK (compiler_cache_lock);
-  LL_FOREACH (compiler_cache, ci)
+  if (wg != NULL)
+    return wg;
+
+  POCL_LOCK (compiler_lock);
+  wg = pocl_wg_variant_workgroup (variant);
+  if (wg != NULL)
     {
-      if (strcmp (ci->tmp_dir, cmd->command.run.tmp_dir) == 0 &&
-          strcmp (ci->function_name, 
-                  cmd->command.run.kernel->function_name) == 0)
-        {
-          POCL_UNLOCK (compiler_cache_lock);
-          cmd->command.run.wg = ci->wg;
-          return;
-        }
+      POCL_UNLOCK (compiler_lock);
+      return wg;
     }
-  ci = malloc (sizeof (compiler_cache_item));
-  ci->next = NULL;
-  ci->tmp_dir = strdup(cmd->command.run.tmp_dir);
-  ci->function_name = strdup (cmd->command.run.kernel->function_name);
-  const char* module_fn = llvm_codegen (cmd->command.run.tmp_dir);
+
+  const char* module_fn = 
+    llvm_codegen (variant->tmp_dir, kernel->name,
+                  pocl_fp_math_flags (kernel->program->compiler_options));
   dlhandle = lt_dlopen (module_fn);     
   if (dlhandle == NULL)
     {
@@ -707,13 +699,27 @@ void check_compiler_cache (_cl_command_node *cmd)
       abort();
     }
   snprintf (workgroup_string, WORKGROUP_STRING_LENGTH,
-            "_%s_workgroup", cmd->command.run.kernel->function_name);
-  cmd->command.run.wg = ci->wg = 
-    (pocl_workgroup) lt_dlsym (dlhandle, workgroup_string);
+            "_%s_workgroup", kernel->function_name);
+  wg = (pocl_workgroup) lt_dlsym (dlhandle, workgroup_string);
+  pocl_wg_variant_set_workgroup (variant, wg);
 
-  LL_APPEND (compiler_cache, ci);
-  POCL_UNLOCK (compiler_cache_lock);
+  POCL_UNLOCK (compiler_lock);
+  return wg;
+}
+
+void check_compiler_cache (_cl_command_node *cmd)
+{
+  if (cmd->command.run.wg != NULL)
+    return;
+  cmd->command.run.wg = 
+    load_workgroup_function (cmd->command.run.kernel, 
+                             cmd->command.run.wg_variant);
+}
 
+void
+pocl_basic_compile_kernel (cl_kernel kernel, pocl_wg_variant *variant)
+{
+  load_workgroup_function (kernel, variant);
 }
 
 void
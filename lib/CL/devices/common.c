@@ -44,10 +44,13 @@
  * Uses an existing (cached) one, if available.
  *
  * @param tmpdir The directory of the work-group function bitcode.
+ * @param kernel_name The kernel, for the POCL_COMPILE_TIMING reports.
+ * @param fp_flags The POCL_FP_* relaxations allowed by the build options.
  * @param return the generated binary filename.
  */
 const char*
-llvm_codegen (const char* tmpdir) {
+llvm_codegen (const char* tmpdir, const char* kernel_name, 
+              unsigned fp_flags) {
 
   const char* pocl_verbose_ptr = 
     pocl_get_string_option("POCL_VERBOSE", (char*)NULL);
@@ -56,10 +59,12 @@ llvm_codegen (const char* tmpdir) {
   char command[COMMAND_LENGTH];
   char bytecode[POCL_FILENAME_LENGTH];
   char assembly[POCL_FILENAME_LENGTH];
+  char fp_options[128] = "";
 
   char* module = malloc(min(POCL_FILENAME_LENGTH, 
 	   strlen(tmpdir) + strlen("/parallel.so") + 1)); 
   int error;
+  uint64_t start = 0;
 
   error = snprintf 
     (module, POCL_FILENAME_LENGTH,
@@ -77,8 +82,18 @@ llvm_codegen (const char* tmpdir) {
 			tmpdir);
       assert (error >= 0);
       
+      /* The fused multiply-adds are formed only if the target CPU has
+         the instructions, otherwise the mul+add stay separated. */
+      if (fp_flags & POCL_FP_MAD_ENABLE)
+        strcat (fp_options, "-enable-fp-mad -fp-contract=fast ");
+      if (fp_flags & POCL_FP_UNSAFE_MATH)
+        strcat (fp_options, "-enable-unsafe-fp-math ");
+      if (fp_flags & POCL_FP_FINITE_MATH_ONLY)
+        strcat (fp_options, "-enable-no-infs-fp-math -enable-no-nans-fp-math ");
+
       error = snprintf (command, COMMAND_LENGTH,
-			LLC " " HOST_LLC_FLAGS " -o %s %s",
+			LLC " " HOST_LLC_FLAGS " %s-o %s %s",
+			fp_options,
 			assembly,
 			bytecode);
       assert (error >= 0);
@@ -87,8 +102,13 @@ llvm_codegen (const char* tmpdir) {
         fprintf(stderr, "[pocl] executing [%s]\n", command);
         fflush(stderr);
       }
+      if (pocl_compile_timing ())
+        start = pocl_wall_time_us ();
       error = system (command);
       assert (error == 0);
+      if (pocl_compile_timing ())
+        pocl_report_compile_time (kernel_name, tmpdir, "llc", 
+                                  pocl_wall_time_us () - start);
           
       // For the pthread device, use device type is always the same as
       // the host.
@@ -102,8 +122,13 @@ llvm_codegen (const char* tmpdir) {
         fprintf(stderr, "[pocl] executing [%s]\n", command);
         fflush(stderr);
       }
+      if (pocl_compile_timing ())
+        start = pocl_wall_time_us ();
       error = system (command);
       assert (error == 0);
+      if (pocl_compile_timing ())
+        pocl_report_compile_time (kernel_name, tmpdir, "assembler", 
+                                  pocl_wall_time_us () - start);
 
       // clang is used as the linker driver in LINK_CMD
       error = snprintf (command, COMMAND_LENGTH,
@@ -117,8 +142,13 @@ llvm_codegen (const char* tmpdir) {
         fprintf(stderr, "[pocl] executing [%s]\n", command);
         fflush(stderr);
       }
+      if (pocl_compile_timing ())
+        start = pocl_wall_time_us ();
       error = system (command);
       assert (error == 0);
+      if (pocl_compile_timing ())
+        pocl_report_compile_time (kernel_name, tmpdir, "linker", 
+                                  pocl_wall_time_us () - start);
     }
   return module;
 }
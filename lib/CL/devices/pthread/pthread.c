@@ -160,6 +160,7 @@ pocl_pthread_init_device_ops(struct pocl_device_ops *ops)
   ops->copy_rect = pocl_pthread_copy_rect;
   ops->run = pocl_pthread_run;
   ops->compile_submitted_kernels = pocl_basic_compile_submitted_kernels;
+  ops->compile_kernel = pocl_basic_compile_kernel;
 
 }
 
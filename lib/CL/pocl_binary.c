@@ -0,0 +1,405 @@
+/* pocl_binary.c: the program binary format of pocl
+
+   Copyright (c) 2014 pocl developers
+   
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pocl_binary.h"
+#include "pocl_util.h"
+#include "pocl_wg_variants.h"
+
+#define POCL_BINARY_MAGIC "POCLBIN"
+#define POCL_BINARY_MAGIC_LENGTH 8
+#define POCL_BINARY_VERSION 1
+
+/* The files of a kernel dir and of its work-group function variant dirs
+   that are bundled in the binary. The parallel.so only once the device
+   driver has loaded it, until then it might be still being written. */
+static const char *kernel_files[] = { "descriptor.so", NULL };
+static const char *variant_bc_files[] = { POCL_PARALLEL_BC_FILENAME, NULL };
+static const char *variant_files[] = 
+  { POCL_PARALLEL_BC_FILENAME, "parallel.so", NULL };
+
+typedef struct binary_buffer
+{
+  unsigned char *data;
+  size_t size;
+  size_t capacity;
+} binary_buffer;
+
+/* Reserves len bytes at the end of the buffer and returns a pointer
+   to them, NULL if out of memory. */
+static unsigned char *
+reserve_bytes (binary_buffer *buffer, size_t len)
+{
+  unsigned char *bytes;
+  if (buffer->size + len > buffer->capacity)
+    {
+      size_t capacity = buffer->capacity * 2;
+      unsigned char *data;
+      if (capacity < buffer->size + len)
+        capacity = buffer->size + len;
+      data = (unsigned char*) realloc (buffer->data, capacity);
+      if (data == NULL)
+        return NULL;
+      buffer->data = data;
+      buffer->capacity = capacity;
+    }
+  bytes = buffer->data + buffer->size;
+  buffer->size += len;
+  return bytes;
+}
+
+static int
+put_bytes (binary_buffer *buffer, const void *data, size_t len)
+{
+  unsigned char *bytes = reserve_bytes (buffer, len);
+  if (bytes == NULL)
+    return 0;
+  memcpy (bytes, data, len);
+  return 1;
+}
+
+/* Appends the file as a (path, data) entry. Returns 0 on failure. */
+static int
+put_file (binary_buffer *buffer, const char *path_name, 
+          const char *entry_name)
+{
+  uint32_t name_length = strlen (entry_name);
+  uint64_t file_size;
+  unsigned char *data;
+  struct stat st;
+  FILE *file;
+  size_t n;
+
+  if (stat (path_name, &st) != 0 || !S_ISREG (st.st_mode))
+    return 0;
+  file_size = st.st_size;
+
+  file = fopen (path_name, "r");
+  if (file == NULL)
+    return 0;
+
+  if (!put_bytes (buffer, &name_length, sizeof (name_length)) ||
+      !put_bytes (buffer, entry_name, name_length) ||
+      !put_bytes (buffer, &file_size, sizeof (file_size)) ||
+      (data = reserve_bytes (buffer, file_size)) == NULL)
+    {
+      fclose (file);
+      return 0;
+    }
+  n = fread (data, 1, file_size, file);
+  fclose (file);
+  return n == file_size;
+}
+
+/* The dirs bundled already. The kernel objects created for the same 
+   kernel share the dirs. */
+typedef struct bundled_dirs
+{
+  const char **names;
+  unsigned count;
+  unsigned capacity;
+} bundled_dirs;
+
+/* Adds the dir to the bundled ones. Returns 0 if it is there already,
+   -1 if out of memory. */
+static int
+add_bundled_dir (bundled_dirs *dirs, const char *dir_name)
+{
+  unsigned i;
+  for (i = 0; i < dirs->count; ++i)
+    {
+      if (strcmp (dirs->names[i], dir_name) == 0)
+        return 0;
+    }
+  if (dirs->count == dirs->capacity)
+    {
+      unsigned capacity = dirs->capacity * 2 + 16;
+      const char **names = (const char**) 
+        realloc (dirs->names, capacity * sizeof (const char*));
+      if (names == NULL)
+        return -1;
+      dirs->names = names;
+      dirs->capacity = capacity;
+    }
+  dirs->names[dirs->count++] = dir_name;
+  return 1;
+}
+
+/* Appends the existing files of the list found in dir_name/entry_dir. 
+   Returns the number of files added, -1 on failure. */
+static int
+put_files (binary_buffer *buffer, const char *dir_name, 
+           const char *entry_dir, const char **files)
+{
+  char path_name[POCL_FILENAME_LENGTH];
+  char entry_name[POCL_FILENAME_LENGTH];
+  int count = 0;
+
+  for (; *files != NULL; ++files)
+    {
+      snprintf (path_name, POCL_FILENAME_LENGTH, "%s/%s", dir_name, *files);
+      if (access (path_name, R_OK) != 0)
+        continue;
+      snprintf (entry_name, POCL_FILENAME_LENGTH, "%s/%s", entry_dir, 
+                *files);
+      if (!put_file (buffer, path_name, entry_name))
+        return -1;
+      ++count;
+    }
+  return count;
+}
+
+int
+pocl_binary_is_container (const unsigned char *binary, size_t size)
+{
+  return size >= POCL_BINARY_MAGIC_LENGTH && 
+    memcmp (binary, POCL_BINARY_MAGIC, POCL_BINARY_MAGIC_LENGTH) == 0;
+}
+
+/* Appends the files of the kernel dir and of the compiled variants of
+   the kernel for the device. Returns the number of files added, -1 on 
+   failure. */
+static int
+put_kernel (binary_buffer *buffer, cl_kernel kernel, cl_device_id device,
+            const char *device_dir, bundled_dirs *dirs)
+{
+  char kernel_dir[POCL_FILENAME_LENGTH];
+  const char *entry_dir;
+  size_t device_dir_length = strlen (device_dir);
+  pocl_wg_variant *variant;
+  unsigned bucket;
+  int added, count, num_files = 0;
+
+  snprintf (kernel_dir, POCL_FILENAME_LENGTH, "%s/%s", device_dir, 
+            kernel->name);
+  added = add_bundled_dir (dirs, kernel->name);
+  if (added < 0)
+    return -1;
+  if (added)
+    {
+      count = put_files (buffer, kernel_dir, kernel->name, kernel_files);
+      if (count < 0)
+        return -1;
+      num_files += count;
+    }
+
+  for (bucket = 0; bucket < POCL_WG_VARIANT_BUCKETS; ++bucket)
+    {
+      for (variant = __atomic_load_n (&kernel->wg_variants[bucket], 
+                                      __ATOMIC_ACQUIRE);
+           variant != NULL; variant = variant->next)
+        {
+          /* The variants being compiled in the background are left 
+             out. */
+          if (variant->device != device || 
+              !pocl_wg_variant_is_compiled (variant) ||
+              strncmp (variant->tmp_dir, device_dir, device_dir_length) ||
+              variant->tmp_dir[device_dir_length] != '/')
+            continue;
+          entry_dir = variant->tmp_dir + device_dir_length + 1;
+          added = add_bundled_dir (dirs, entry_dir);
+          if (added < 0)
+            return -1;
+          if (!added)
+            continue;
+          count = put_files (buffer, variant->tmp_dir, entry_dir,
+                             pocl_wg_variant_workgroup (variant) != NULL ?
+                             variant_files : variant_bc_files);
+          if (count < 0)
+            return -1;
+          num_files += count;
+        }
+    }
+  return num_files;
+}
+
+unsigned char *
+pocl_binary_serialize (cl_program program, unsigned device_i, size_t *size)
+{
+  binary_buffer buffer = { NULL, 0, 0 };
+  bundled_dirs dirs = { NULL, 0, 0 };
+  char device_dir[POCL_FILENAME_LENGTH];
+  uint32_t version = POCL_BINARY_VERSION;
+  uint32_t num_files = 0;
+  uint64_t bitcode_size = program->binary_sizes[device_i];
+  size_t num_files_pos;
+  cl_kernel kernel;
+  int count;
+
+  if (!put_bytes (&buffer, POCL_BINARY_MAGIC, POCL_BINARY_MAGIC_LENGTH) ||
+      !put_bytes (&buffer, &version, sizeof (version)))
+    goto ERROR;
+  num_files_pos = buffer.size;
+  if (!put_bytes (&buffer, &num_files, sizeof (num_files)) ||
+      !put_bytes (&buffer, &bitcode_size, sizeof (bitcode_size)) ||
+      !put_bytes (&buffer, program->binaries[device_i], bitcode_size))
+    goto ERROR;
+
+  /* Only the variants published in the kernels are bundled, the files
+     in the dirs might be still being written by the compiler threads. */
+  snprintf (device_dir, POCL_FILENAME_LENGTH, "%s/%s", program->temp_dir,
+            program->devices[device_i]->short_name);
+  for (kernel = program->kernels; kernel != NULL; kernel = kernel->next)
+    {
+      count = put_kernel (&buffer, kernel, program->devices[device_i], 
+                          device_dir, &dirs);
+      if (count < 0)
+        goto ERROR;
+      num_files += count;
+    }
+
+  free (dirs.names);
+  memcpy (buffer.data + num_files_pos, &num_files, sizeof (num_files));
+  *size = buffer.size;
+  return buffer.data;
+
+ERROR:
+  free (dirs.names);
+  free (buffer.data);
+  *size = 0;
+  return NULL;
+}
+
+void
+pocl_free_binaries (cl_program program)
+{
+  unsigned i;
+  if (program->pocl_binaries != NULL)
+    {
+      for (i = 0; i < program->num_devices; ++i)
+        free (program->pocl_binaries[i]);
+    }
+  free (program->pocl_binaries);
+  free (program->pocl_binary_sizes);
+  program->pocl_binaries = NULL;
+  program->pocl_binary_sizes = NULL;
+}
+
+/* Reads len bytes at *pos, returns NULL if the binary is too short. */
+static const unsigned char *
+get_bytes (const unsigned char *binary, size_t size, size_t *pos, 
+           uint64_t len)
+{
+  const unsigned char *bytes = binary + *pos;
+  if (len > size - *pos)
+    return NULL;
+  *pos += len;
+  return bytes;
+}
+
+/* The entry paths must stay below the device dir. */
+static int
+is_valid_entry_name (const char *entry_name)
+{
+  return entry_name[0] != '\0' && entry_name[0] != '/' &&
+    strstr (entry_name, "..") == NULL;
+}
+
+cl_int
+pocl_binary_deserialize (const unsigned char *binary, size_t size,
+                         const unsigned char **bitcode, 
+                         size_t *bitcode_size,
+                         const char *device_tmpdir)
+{
+  char entry_name[POCL_FILENAME_LENGTH];
+  char path_name[POCL_FILENAME_LENGTH];
+  const unsigned char *bytes;
+  uint32_t version, num_files, name_length;
+  uint64_t data_size;
+  size_t pos = POCL_BINARY_MAGIC_LENGTH;
+  unsigned i;
+  FILE *file;
+
+  if (!pocl_binary_is_container (binary, size))
+    return CL_INVALID_BINARY;
+
+  if ((bytes = get_bytes (binary, size, &pos, sizeof (version))) == NULL)
+    return CL_INVALID_BINARY;
+  memcpy (&version, bytes, sizeof (version));
+  if (version != POCL_BINARY_VERSION)
+    return CL_INVALID_BINARY;
+
+  if ((bytes = get_bytes (binary, size, &pos, sizeof (num_files))) == NULL)
+    return CL_INVALID_BINARY;
+  memcpy (&num_files, bytes, sizeof (num_files));
+
+  if ((bytes = get_bytes (binary, size, &pos, sizeof (data_size))) == NULL)
+    return CL_INVALID_BINARY;
+  memcpy (&data_size, bytes, sizeof (data_size));
+  if ((*bitcode = get_bytes (binary, size, &pos, data_size)) == NULL ||
+      data_size == 0)
+    return CL_INVALID_BINARY;
+  *bitcode_size = data_size;
+
+  for (i = 0; i < num_files; ++i)
+    {
+      if ((bytes = get_bytes (binary, size, &pos, sizeof (name_length))) 
+          == NULL)
+        return CL_INVALID_BINARY;
+      memcpy (&name_length, bytes, sizeof (name_length));
+      if (name_length >= POCL_FILENAME_LENGTH ||
+          (bytes = get_bytes (binary, size, &pos, name_length)) == NULL)
+        return CL_INVALID_BINARY;
+      memcpy (entry_name, bytes, name_length);
+      entry_name[name_length] = '\0';
+      if (!is_valid_entry_name (entry_name))
+        return CL_INVALID_BINARY;
+
+      if ((bytes = get_bytes (binary, size, &pos, sizeof (data_size))) 
+          == NULL)
+        return CL_INVALID_BINARY;
+      memcpy (&data_size, bytes, sizeof (data_size));
+      if ((bytes = get_bytes (binary, size, &pos, data_size)) == NULL)
+        return CL_INVALID_BINARY;
+
+      if (device_tmpdir == NULL)
+        continue;
+
+      snprintf (path_name, POCL_FILENAME_LENGTH, "%s/%s", device_tmpdir,
+                entry_name);
+      *strrchr (path_name, '/') = '\0';
+      if (pocl_mkdir_p (path_name) != 0)
+        return CL_OUT_OF_HOST_MEMORY;
+      path_name[strlen (path_name)] = '/';
+
+      file = fopen (path_name, "w");
+      if (file == NULL)
+        return CL_OUT_OF_HOST_MEMORY;
+      if (fwrite (bytes, 1, data_size, file) < data_size)
+        {
+          fclose (file);
+          return CL_OUT_OF_HOST_MEMORY;
+        }
+      fclose (file);
+    }
+
+  return CL_SUCCESS;
+}
@@ -0,0 +1,68 @@
+/* pocl_binary.h: the program binary format of pocl
+
+   Copyright (c) 2014 pocl developers
+   
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+
+#ifndef POCL_BINARY_H
+#define POCL_BINARY_H
+
+#include "pocl_cl.h"
+
+#pragma GCC visibility push(hidden)
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The program binaries returned by clGetProgramInfo bundle the program
+ * bitcode with the already compiled work-group functions of the kernels,
+ * so a program created from the binary can be launched without running
+ * the kernel compiler. See doc/binary_format.txt for the layout.
+ *
+ * Plain bitcode is still accepted by clCreateProgramWithBinary. */
+
+/* Returns 1 if the binary starts with the pocl binary magic. */
+int pocl_binary_is_container (const unsigned char *binary, size_t size);
+
+/* Creates the binary of the program for its device_i from the bitcode
+ * and the files of the compiled work-group function variants of its 
+ * kernels. Called with the program lock held. The caller owns the
+ * returned buffer. Returns NULL in case the files could not be read. */
+unsigned char *pocl_binary_serialize (cl_program program, 
+                                      unsigned device_i, size_t *size);
+
+/* Frees the binaries created for clGetProgramInfo. */
+void pocl_free_binaries (cl_program program);
+
+/* Validates a binary container. Returns the bitcode part of it and,
+ * if device_tmpdir is not NULL, unpacks the compiled files there.
+ * Returns CL_INVALID_BINARY for a malformed binary. */
+cl_int pocl_binary_deserialize (const unsigned char *binary, size_t size,
+                                const unsigned char **bitcode, 
+                                size_t *bitcode_size,
+                                const char *device_tmpdir);
+
+#ifdef __cplusplus
+}
+#endif
+#pragma GCC visibility pop
+
+#endif
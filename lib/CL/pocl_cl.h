@@ -195,6 +195,8 @@ struct pocl_argument {
   void *value;
 };
 
+struct pocl_wg_variant;
+
 struct pocl_device_ops {
   char *device_name;
   void (*init_device_infos) (struct _cl_device_id*);
@@ -249,6 +251,11 @@ void (*fill_rect) (void *data,
   void* (*unmap_mem) (void *data, void *host_ptr, void *device_start_ptr, size_t size);
   
   void (*compile_submitted_kernels) (_cl_command_node* cmd);
+  /* Optional: generates and loads the device binary for the work-group
+     function variant ahead of its first launch. Called from the 
+     background compiler threads. */
+  void (*compile_kernel) (cl_kernel kernel, 
+                          struct pocl_wg_variant *variant);
   void (*run) (void *data, _cl_command_node* cmd);
   void (*run_native) (void *data, _cl_command_node* cmd);
 
@@ -450,14 +457,24 @@ struct _cl_program {
      sequential bitcode produced from the kernel sources.*/
   size_t *binary_sizes; 
   unsigned char **binaries; 
+  /* The binaries returned by clGetProgramInfo, the bitcode bundled
+     with the compiled work-group functions (see pocl_binary.h). 
+     Recreated at each CL_PROGRAM_BINARY_SIZES query. */
+  size_t *pocl_binary_sizes;
+  unsigned char **pocl_binaries;
   /* Temp directory (relative to CWD) where the kernel files reside. */
   char *temp_dir;
   /* implementation */
   cl_kernel kernels;
   /* Used to store the llvm IR of the build to save disk I/O. */
   void **llvm_irs;
+  /* CL_BUILD_IN_PROGRESS while an asynchronous clBuildProgram is 
+     running in the compiler threads. */
+  cl_build_status build_status;
 };
 
+#define POCL_WG_VARIANT_BUCKETS 16
+
 struct _cl_kernel {
   POCL_ICD_OBJECT
   POCL_OBJECT;
@@ -475,6 +492,20 @@ struct _cl_kernel {
   cl_int *arg_is_sampler;
   cl_uint num_locals;
   int *reqd_wg_size;
+  /* The compiled work-group function variants, see pocl_wg_variants.h.
+     The lock guards adding them and their compilation status. */
+  struct pocl_wg_variant *wg_variants[POCL_WG_VARIANT_BUCKETS];
+  pocl_lock_t wg_variant_lock;
+  /* The scalar arguments of the latest launch and the number of launches
+     in a row with the same values, for POCL_SPECIALIZE_ARGUMENTS. */
+  struct pocl_argument *spec_arguments;
+  unsigned spec_launches;
+  unsigned num_specialized_variants;
+  /* The local size picked by pocl_select_local_size() for the last 
+     launch without one. Guarded by the kernel lock. */
+  cl_device_id auto_local_device;
+  size_t auto_global_size[3];
+  size_t auto_local_size[3];
   /* The kernel arguments that are set with clSetKernelArg().
      These are copied to the command queue command at enqueue. */
   struct pocl_argument *dyn_arguments;
@@ -0,0 +1,160 @@
+/* pocl_compiler_pool.c: a thread pool for running the kernel compiler
+   in the background
+
+   Copyright (c) 2014 pocl developers
+   
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pocl_compiler_pool.h"
+#include "pocl_runtime_config.h"
+#include "utlist.h"
+
+#define THREAD_COUNT_ENV "POCL_MAX_COMPILER_THREADS"
+#define FALLBACK_MAX_THREAD_COUNT 4
+
+typedef struct compiler_task_item compiler_task_item;
+struct compiler_task_item
+{
+  pocl_compiler_task task;
+  void *data;
+  pocl_compiler_task_set *set;
+  compiler_task_item *next;
+};
+
+/* The tasks waiting for a thread, in the submission order. */
+static compiler_task_item *task_queue = NULL;
+static unsigned queued_tasks = 0;
+static unsigned idle_threads = 0;
+static unsigned num_threads = 0;
+static pocl_lock_t pool_lock = POCL_LOCK_INITIALIZER;
+static pthread_cond_t task_available = PTHREAD_COND_INITIALIZER;
+
+void 
+pocl_compiler_task_set_init (pocl_compiler_task_set *set)
+{
+  POCL_INIT_LOCK (set->lock);
+  pthread_cond_init (&set->all_done, NULL);
+  set->pending = 0;
+}
+
+void 
+pocl_compiler_task_set_destroy (pocl_compiler_task_set *set)
+{
+  pthread_mutex_destroy (&set->lock);
+  pthread_cond_destroy (&set->all_done);
+}
+
+void 
+pocl_compiler_task_set_wait (pocl_compiler_task_set *set)
+{
+  POCL_LOCK (set->lock);
+  while (set->pending > 0)
+    pthread_cond_wait (&set->all_done, &set->lock);
+  POCL_UNLOCK (set->lock);
+}
+
+static unsigned
+max_thread_count (void)
+{
+  long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+  int count;
+  if (cpus < 1)
+    cpus = FALLBACK_MAX_THREAD_COUNT;
+  count = pocl_get_int_option (THREAD_COUNT_ENV, cpus);
+  /* The submitted tasks are run only by the pool threads. */
+  return count < 1 ? 1 : count;
+}
+
+static void*
+compiler_thread (void *arg)
+{
+  compiler_task_item *item;
+  while (1)
+    {
+      POCL_LOCK (pool_lock);
+      while (task_queue == NULL)
+        {
+          ++idle_threads;
+          pthread_cond_wait (&task_available, &pool_lock);
+          --idle_threads;
+        }
+      item = task_queue;
+      LL_DELETE (task_queue, item);
+      --queued_tasks;
+      POCL_UNLOCK (pool_lock);
+
+      item->task (item->data);
+
+      if (item->set != NULL)
+        {
+          POCL_LOCK (item->set->lock);
+          if (--item->set->pending == 0)
+            pthread_cond_broadcast (&item->set->all_done);
+          POCL_UNLOCK (item->set->lock);
+        }
+      free (item);
+    }
+  return NULL;
+}
+
+void 
+pocl_compiler_submit (pocl_compiler_task_set *set, 
+                      pocl_compiler_task task, void *data)
+{
+  pthread_t thread;
+  pthread_attr_t attr;
+  compiler_task_item *item = 
+    (compiler_task_item*) malloc (sizeof (compiler_task_item));
+  if (item == NULL)
+    POCL_ABORT ("Out of memory when submitting a kernel compiler task.\n");
+
+  item->task = task;
+  item->data = data;
+  item->set = set;
+  item->next = NULL;
+
+  if (set != NULL)
+    {
+      POCL_LOCK (set->lock);
+      ++set->pending;
+      POCL_UNLOCK (set->lock);
+    }
+
+  POCL_LOCK (pool_lock);
+  LL_APPEND (task_queue, item);
+  ++queued_tasks;
+  /* Start a new thread only if the idle ones cannot take all the 
+     queued tasks. */
+  if (queued_tasks > idle_threads && num_threads < max_thread_count ())
+    {
+      pthread_attr_init (&attr);
+      pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+      if (pthread_create (&thread, &attr, compiler_thread, NULL) == 0)
+        ++num_threads;
+      pthread_attr_destroy (&attr);
+    }
+  if (num_threads == 0)
+    POCL_ABORT ("Could not create a kernel compiler thread.\n");
+  pthread_cond_signal (&task_available);
+  POCL_UNLOCK (pool_lock);
+}
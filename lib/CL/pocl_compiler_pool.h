@@ -0,0 +1,64 @@
+/* pocl_compiler_pool.h: a thread pool for running the kernel compiler
+   in the background
+
+   Copyright (c) 2014 pocl developers
+   
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#ifndef POCL_COMPILER_POOL_H
+#define POCL_COMPILER_POOL_H
+
+#include "pocl_cl.h"
+
+#pragma GCC visibility push(hidden)
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A set of submitted tasks whose completion can be waited for. */
+typedef struct pocl_compiler_task_set
+{
+  pocl_lock_t lock;
+  pthread_cond_t all_done;
+  unsigned pending;
+} pocl_compiler_task_set;
+
+typedef void (*pocl_compiler_task) (void *data);
+
+void pocl_compiler_task_set_init (pocl_compiler_task_set *set);
+void pocl_compiler_task_set_destroy (pocl_compiler_task_set *set);
+
+/* Blocks until all the tasks submitted to the set have finished. */
+void pocl_compiler_task_set_wait (pocl_compiler_task_set *set);
+
+/* Runs task (data) in one of the compiler threads. 
+ *
+ * The threads are created on demand, at most POCL_MAX_COMPILER_THREADS
+ * of them (by default the number of the online CPUs). The set can be 
+ * NULL in case the submitter does not need to wait for the task. */
+void pocl_compiler_submit (pocl_compiler_task_set *set, 
+                           pocl_compiler_task task, void *data);
+
+#ifdef __cplusplus
+}
+#endif
+#pragma GCC visibility pop
+
+#endif
@@ -29,6 +29,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include "pocl_cl.h"
+#include "pocl_util.h"
 
 
 // TODO: copies...
@@ -87,7 +88,11 @@ int call_pocl_build(cl_program program,
     }
   else
     {
+      uint64_t start = pocl_compile_timing () ? pocl_wall_time_us () : 0;
       error = system(command);
+      if (pocl_compile_timing ())
+        pocl_report_compile_time (NULL, device_tmpdir, "pocl-build", 
+                                  pocl_wall_time_us () - start);
     }
 
   return error;
@@ -185,12 +190,19 @@ int call_pocl_kernel(cl_program program,
 
 int call_pocl_workgroup(cl_device_id device, cl_kernel kernel,
                     size_t local_x, size_t local_y, size_t local_z,
+                    unsigned variant_flags,
+                    const struct pocl_argument *arguments,
                     const char* parallel_filename,
                     const char* kernel_filename)
 {
   int error;
   char *pocl_wg_script;
   char command[COMMAND_LENGTH];
+  char variant_dir[POCL_FILENAME_LENGTH];
+  uint64_t start;
+
+      if (variant_flags != 0)
+        return CL_INVALID_OPERATION;
 
       if (getenv("POCL_BUILDING") != NULL)
         pocl_wg_script = BUILDDIR "/scripts/" POCL_WORKGROUP;
@@ -224,9 +236,19 @@ int call_pocl_workgroup(cl_device_id device, cl_kernel kernel,
       if (error < 0)
         return CL_OUT_OF_HOST_MEMORY;
 
+      start = pocl_compile_timing () ? pocl_wall_time_us () : 0;
       error = system (command);
       if (error != 0)
         return CL_OUT_OF_RESOURCES;
+      if (pocl_compile_timing ())
+        {
+          snprintf (variant_dir, POCL_FILENAME_LENGTH, "%s", 
+                    parallel_filename);
+          *strrchr (variant_dir, '/') = '\0';
+          pocl_report_compile_time (kernel->name, variant_dir, 
+                                    "pocl-workgroup", 
+                                    pocl_wall_time_us () - start);
+        }
 
       return 0;
 }
@@ -51,10 +51,16 @@ int call_pocl_kernel(cl_program program,
 
 /* Run the pocl passes on a kernel in LLVM IR, link it with kernel, 
  * and produce the 'paralellized' kernel file.
+ *
+ * The variant_flags are the POCL_WG_VARIANT_* specializations of the
+ * work-group function. Only the LLVM API version supports them. The 
+ * arguments are the values of POCL_WG_VARIANT_SPECIALIZED_ARGS.
  */
 int call_pocl_workgroup(cl_device_id device,
                         cl_kernel kernel,
                         size_t local_x, size_t local_y, size_t local_z,
+                        unsigned variant_flags,
+                        const struct pocl_argument *arguments,
                         const char* parallel_filename,
                         const char* kernel_filename );
 
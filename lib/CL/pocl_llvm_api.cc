@@ -24,44 +24,55 @@
 
 #include "config.h"
 
+#include "clang/Basic/Version.h"
 #include "clang/CodeGen/CodeGenAction.h"
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Frontend/CompilerInvocation.h"
+#include "clang/Frontend/FrontendActions.h"
 #include "clang/Frontend/TextDiagnosticBuffer.h"
 #include "llvm/LinkAllPasses.h"
-#include "llvm/Linker.h"
 #include "llvm/PassManager.h"
 #include "llvm/Bitcode/ReaderWriter.h"
 #include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
 
 #ifdef LLVM_3_2
+#include "llvm/Constants.h"
 #include "llvm/Function.h"
 #include "llvm/LLVMContext.h"
 #include "llvm/Module.h"
 #include "llvm/Support/IRReader.h"
 #include "llvm/DataLayout.h"
 #else
+#include "llvm/IR/Constants.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Operator.h"
 #include "llvm/IRReader/IRReader.h"
 #endif
 
 #include "llvm/Support/Host.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/Path.h"
 #include "llvm/Support/raw_os_ostream.h"
 #include "llvm/Support/SourceMgr.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/Threading.h"
 #include "llvm/Support/ToolOutputFile.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetLibraryInfo.h"
+#include "llvm/MC/MCSubtargetInfo.h"
 #include "llvm/MC/SubtargetFeature.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include <iostream>
+#include <map>
+#include <set>
 #include <vector>
 #include <sstream>
 #include <string>
@@ -70,8 +81,11 @@
 // causing compilation error if they are included before the LLVM headers.
 #include "pocl_llvm.h"
 #include "pocl_runtime_config.h"
+#include "pocl_util.h"
+#include "pocl_wg_variants.h"
 #include "install-paths.h"
 #include "LLVMUtils.h"
+#include "WorkitemHandlerChooser.h"
 
 using namespace clang;
 using namespace llvm;
@@ -85,6 +99,209 @@ using llvm::sys::fs::F_Binary;
 
 //#define DEBUG_POCL_LLVM_API
 
+static void initialize_kernel_compiler();
+
+/* Creates the front end invocation from the given switches and sets 
+   up the OpenCL C language options. The same setup is used for the
+   kernels and for the precompiled header of the built-in declarations
+   so the two stay compatible. */
+static bool
+create_pocl_invocation(CompilerInvocation &pocl_build,
+                       cl_device_id device,
+                       const std::vector<const char*> &itemcstrs,
+                       clang::DiagnosticsEngine &diags)
+{
+  if (!CompilerInvocation::CreateFromArgs
+      (pocl_build, itemcstrs.data(), itemcstrs.data() + itemcstrs.size(), 
+       diags)) 
+    return false;
+  
+  LangOptions *la = pocl_build.getLangOpts();
+  pocl_build.setLangDefaults
+    (*la, clang::IK_OpenCL, clang::LangStandard::lang_opencl12);
+  
+  // LLVM 3.3 and older do not set that char is signed which is
+  // defined by the OpenCL C specs (but not by C specs).
+  la->CharIsSigned = true;
+
+  // the per-file types don't seem to override this 
+  la->OpenCLVersion = 120;
+  la->FakeAddressSpaceMap = true;
+  la->Blocks = true; //-fblocks
+  la->MathErrno = false; // -fno-math-errno
+  la->NoBuiltin = true;  // -fno-builtin
+#ifndef LLVM_3_2
+  la->AsmBlocks = true;  // -fasm (?)
+#endif
+
+  PreprocessorOptions &po = pocl_build.getPreprocessorOpts();
+  /* configure.ac sets a a few host specific flags for pthreads and
+     basic devices. */
+  if (device->has_64bit_long == 0)
+    po.addMacroDef("_CL_DISABLE_LONG");
+
+  po.addMacroDef("__OPENCL_VERSION__=120"); // -D__OPENCL_VERSION_=120
+
+  clang::TargetOptions &ta = pocl_build.getTargetOpts();
+  ta.Triple = device->llvm_target_triplet;
+  if (device->llvm_cpu != NULL)
+    ta.CPU = device->llvm_cpu;
+
+  // printf("### Triple: %s, CPU: %s\n", ta.Triple.c_str(), ta.CPU.c_str());
+  return true;
+}
+
+static pocl_lock_t kernel_header_pch_lock = POCL_LOCK_INITIALIZER;
+
+/**
+ * Returns the precompiled header of _kernel.h for the given front end
+ * switches, or an empty string in case it could not be produced.
+ *
+ * The header is precompiled at the first use to the kernel cache 
+ * directory. The file name includes a hash of everything the validity
+ * of the PCH depends on (the switches, the header file and the Clang 
+ * version) so it is shared by all builds using the same switches.
+ */
+static std::string
+kernel_header_pch(cl_device_id device,
+                  const std::vector<const char*> &itemcstrs,
+                  const std::string &kernelh)
+{
+  struct stat kernelh_stat;
+  if (stat(kernelh.c_str(), &kernelh_stat) != 0)
+    return "";
+
+  uint64_t hash = POCL_HASH_SEED;
+  for (size_t i = 0; i < itemcstrs.size(); ++i)
+    hash = pocl_hash_buffer(itemcstrs[i], strlen(itemcstrs[i]) + 1, hash);
+  hash = pocl_hash_buffer(kernelh.c_str(), kernelh.size(), hash);
+  hash = pocl_hash_buffer(&kernelh_stat.st_mtime, 
+                          sizeof(kernelh_stat.st_mtime), hash);
+  const std::string version = getClangFullVersion() + PACKAGE_VERSION;
+  hash = pocl_hash_buffer(version.c_str(), version.size(), hash);
+
+  std::string pch_dir = std::string(pocl_get_cache_dir()) + "/pch";
+  char hash_str[17];
+  snprintf(hash_str, sizeof(hash_str), "%016llx", (unsigned long long)hash);
+  std::string pch = pch_dir + "/_kernel.h-" + 
+    device->llvm_target_triplet + "-" + hash_str + ".pch";
+
+  if (access(pch.c_str(), R_OK) == 0)
+    return pch;
+
+  POCL_LOCK(kernel_header_pch_lock);
+  if (access(pch.c_str(), R_OK) == 0)
+    {
+      POCL_UNLOCK(kernel_header_pch_lock);
+      return pch;
+    }
+
+  pocl_mkdir_p(pch_dir.c_str());
+
+  llvm::IntrusiveRefCntPtr<clang::DiagnosticIDs> diagID = 
+    new clang::DiagnosticIDs();
+  llvm::IntrusiveRefCntPtr<clang::DiagnosticOptions> diagOpts = 
+    new clang::DiagnosticOptions();
+  clang::TextDiagnosticBuffer *diagsBuffer = 
+    new clang::TextDiagnosticBuffer();
+  clang::DiagnosticsEngine diags(diagID, &*diagOpts, diagsBuffer);
+
+  CompilerInstance CI;
+  if (!create_pocl_invocation(CI.getInvocation(), device, itemcstrs, diags))
+    {
+      POCL_UNLOCK(kernel_header_pch_lock);
+      return "";
+    }
+
+#ifdef LLVM_3_2
+  CI.createDiagnostics(0, NULL);
+#else
+  CI.createDiagnostics();
+#endif 
+
+  /* Write to a process specific file first and rename it in place 
+     when complete so other processes never see a partial PCH. */
+  std::stringstream tmp_pch;
+  tmp_pch << pch << "." << getpid() << ".tmp";
+
+  FrontendOptions &fe = CI.getInvocation().getFrontendOpts();
+  fe.Inputs.clear(); 
+  fe.Inputs.push_back(FrontendInputFile(kernelh, clang::IK_OpenCL));
+  fe.OutputFile = tmp_pch.str();
+
+  clang::GeneratePCHAction action;
+  bool success = CI.ExecuteAction(action);
+  if (success)
+    success = rename(tmp_pch.str().c_str(), pch.c_str()) == 0;
+  else
+    unlink(tmp_pch.str().c_str());
+  POCL_UNLOCK(kernel_header_pch_lock);
+
+#ifdef DEBUG_POCL_LLVM_API
+  std::cerr << "### precompiled " << kernelh << " to " << pch 
+            << (success ? "" : " FAILED") << std::endl;
+#endif
+  return success ? pch : "";
+}
+
+/* Returns true in case the subtarget of the CPU has the feature. A 
+   feature the CPU has is not changed by enabling it again but by 
+   disabling it. */
+static bool
+cpu_has_feature(const Target *target, const std::string &triple, 
+                const std::string &cpu, const char *feature)
+{
+  MCSubtargetInfo *plain = 
+    target->createMCSubtargetInfo(triple, cpu, "");
+  MCSubtargetInfo *enabled = 
+    target->createMCSubtargetInfo(triple, cpu, std::string("+") + feature);
+  MCSubtargetInfo *disabled = 
+    target->createMCSubtargetInfo(triple, cpu, std::string("-") + feature);
+  bool has_feature = 
+    plain != NULL && enabled != NULL && disabled != NULL &&
+    plain->getFeatureBits() == enabled->getFeatureBits() &&
+    plain->getFeatureBits() != disabled->getFeatureBits();
+  delete plain;
+  delete enabled;
+  delete disabled;
+  return has_feature;
+}
+
+/* Returns true in case the device CPU has fused multiply-add 
+   instructions, according to the features of its LLVM subtarget. */
+static bool
+device_has_fma(cl_device_id device)
+{
+  Triple triple(device->llvm_target_triplet);
+  std::string cpu;
+  if (device->llvm_cpu != NULL)
+    cpu = device->llvm_cpu;
+  else if (triple.getArch() == 
+           Triple(llvm::sys::getDefaultTargetTriple()).getArch())
+    cpu = llvm::sys::getHostCPUName();
+
+  std::string error;
+  const Target *target = 
+    TargetRegistry::lookupTarget(triple.getTriple(), error);
+  if (target == NULL)
+    return false;
+
+  /* Only the feature names of the target are asked, LLVM warns of the
+     unknown ones. */
+  switch (triple.getArch()) 
+    {
+    case Triple::x86:
+    case Triple::x86_64:
+      return cpu_has_feature(target, triple.getTriple(), cpu, "fma") ||
+        cpu_has_feature(target, triple.getTriple(), cpu, "fma4");
+    case Triple::arm:
+    case Triple::thumb:
+      return cpu_has_feature(target, triple.getTriple(), cpu, "vfp4");
+    default:
+      return false;
+    }
+}
+
 /* "emulate" the pocl_build script.
  * This compiles an .cl file into LLVM IR 
  * (the "program.bc") file.
@@ -101,6 +318,10 @@ int call_pocl_build(cl_program program,
 
 { 
 
+  /* The builds for different devices can run in parallel, make sure
+     LLVM is initialized for multithreading first. */
+  initialize_kernel_compiler();
+
   // Use CompilerInvocation::CreateFromArgs to initialize
   // CompilerInvocation. This way we can reuse the Clang's
   // command line parsing.
@@ -149,10 +370,18 @@ int call_pocl_build(cl_program program,
   // The current directory is a standard search path.
   ss << "-I. ";
 
-   /* With fp-contract we get calls to fma with processors which do not
-      have fma instructions. These ruin the performance. Better to have
-      the mul+add separated in the IR. */
-  ss << "-fno-builtin -ffp-contract=off ";
+  /* Contract the mul+adds the user allowed to be contracted in case the
+     CPU can do it in hardware. Otherwise the defaults of Clang apply. */
+  unsigned fp_flags = pocl_fp_math_flags(user_options);
+  ss << "-fno-builtin ";
+  if ((fp_flags & POCL_FP_MAD_ENABLE) && device_has_fma(device))
+    ss << "-ffp-contract=on ";
+  /* Clang maps the -cl-* options to the code generation options but
+     not to the fast-math flags of the instructions. */
+  if (fp_flags & POCL_FP_FAST_RELAXED_MATH)
+    ss << "-ffast-math ";
+  if (fp_flags & POCL_FP_FINITE_MATH_ONLY)
+    ss << "-ffinite-math-only ";
 
   // This is required otherwise the initialization fails with
   // unknown triplet ''
@@ -183,9 +412,7 @@ int call_pocl_build(cl_program program,
             << "user_options: " << user_options << std::endl;
 #endif
 
-  if (!CompilerInvocation::CreateFromArgs
-      (pocl_build, itemcstrs.data(), itemcstrs.data() + itemcstrs.size(), 
-       diags)) 
+  if (!create_pocl_invocation(pocl_build, device, itemcstrs, diags))
     {
       for (TextDiagnosticBuffer::const_iterator i = diagsBuffer->err_begin(), 
              e = diagsBuffer->err_end(); i != e; ++i) 
@@ -201,32 +428,6 @@ int call_pocl_build(cl_program program,
         }
       return CL_INVALID_BUILD_OPTIONS;
     }
-  
-  LangOptions *la = pocl_build.getLangOpts();
-  pocl_build.setLangDefaults
-    (*la, clang::IK_OpenCL, clang::LangStandard::lang_opencl12);
-  
-  // LLVM 3.3 and older do not set that char is signed which is
-  // defined by the OpenCL C specs (but not by C specs).
-  la->CharIsSigned = true;
-
-  // the per-file types don't seem to override this 
-  la->OpenCLVersion = 120;
-  la->FakeAddressSpaceMap = true;
-  la->Blocks = true; //-fblocks
-  la->MathErrno = false; // -fno-math-errno
-  la->NoBuiltin = true;  // -fno-builtin
-#ifndef LLVM_3_2
-  la->AsmBlocks = true;  // -fasm (?)
-#endif
-
-  PreprocessorOptions &po = pocl_build.getPreprocessorOpts();
-  /* configure.ac sets a a few host specific flags for pthreads and
-     basic devices. */
-  if (device->has_64bit_long == 0)
-    po.addMacroDef("_CL_DISABLE_LONG");
-
-  po.addMacroDef("__OPENCL_VERSION__=120"); // -D__OPENCL_VERSION_=120
 
   std::string kernelh;
   if (pocl_get_bool_option("POCL_BUILDING", 0))
@@ -239,16 +440,22 @@ int call_pocl_build(cl_program program,
       kernelh = PKGDATADIR;
       kernelh += "/include/_kernel.h";
     }
-  po.Includes.push_back(kernelh);
-
-  // TODO: user_options (clBuildProgram options) are not passed
-
-  clang::TargetOptions &ta = pocl_build.getTargetOpts();
-  ta.Triple = device->llvm_target_triplet;
-  if (device->llvm_cpu != NULL)
-    ta.CPU = device->llvm_cpu;
 
-  // printf("### Triple: %s, CPU: %s\n", ta.Triple.c_str(), ta.CPU.c_str());
+  /* Parsing the built-in declarations dominates the front end time 
+     for small programs. Include them from a precompiled header when 
+     possible. */
+  PreprocessorOptions &po = pocl_build.getPreprocessorOpts();
+  std::string pch;
+  uint64_t start = pocl_compile_timing() ? pocl_wall_time_us() : 0;
+  if (pocl_get_bool_option("POCL_USE_PCH", 1))
+    pch = kernel_header_pch(device, itemcstrs, kernelh);
+  if (pocl_compile_timing())
+    pocl_report_compile_time(NULL, device_tmpdir, "pch", 
+                             pocl_wall_time_us() - start);
+  if (pch != "")
+    po.ImplicitPCHInclude = pch;
+  else
+    po.Includes.push_back(kernelh);
 
   // FIXME: print out any diagnostics to stdout for now. These should go to a buffer for the user
   // to dig out. (and probably to stdout too, overridable with environment variables) 
@@ -269,10 +476,6 @@ int call_pocl_build(cl_program program,
   cg.EmitOpenCLArgMetadata = true;
   cg.StackRealignment = true;
 
-  // TODO: use pch: it is possible to disable the strict checking for
-  // the compilation flags used to compile it and the current translation
-  // unit via the preprocessor options directly.
-
   bool success = true;
   clang::CodeGenAction *action = NULL;
   // TODO: switch to EmitLLVMOnlyAction, when intermediate file is not needed
@@ -282,7 +485,12 @@ int call_pocl_build(cl_program program,
   else
     action = new clang::EmitLLVMOnlyAction();
 
+  if (pocl_compile_timing())
+    start = pocl_wall_time_us();
   success |= CI.ExecuteAction(*action);
+  if (pocl_compile_timing())
+    pocl_report_compile_time(NULL, device_tmpdir, "frontend", 
+                             pocl_wall_time_us() - start);
 
   if (!success) return CL_BUILD_PROGRAM_FAILURE;
 
@@ -554,33 +762,14 @@ int call_pocl_kernel(cl_program program,
 
 /* helpers copied from LLVM opt START */
 
-static llvm::TargetOptions GetTargetOptions() {
+static llvm::TargetOptions GetTargetOptions(unsigned fp_flags) {
   llvm::TargetOptions Options;
-  /* TODO: propagate these from clBuildProgram options. */
-#if 0
-  Options.LessPreciseFPMADOption = EnableFPMAD;
-  Options.NoFramePointerElim = DisableFPElim;
-  Options.NoFramePointerElimNonLeaf = DisableFPElimNonLeaf;
-  Options.AllowFPOpFusion = FuseFPOps;
-  Options.UnsafeFPMath = EnableUnsafeFPMath;
-  Options.NoInfsFPMath = EnableNoInfsFPMath;
-  Options.NoNaNsFPMath = EnableNoNaNsFPMath;
-  Options.HonorSignDependentRoundingFPMathOption =
-  EnableHonorSignDependentRoundingFPMath;
-  Options.UseSoftFloat = GenerateSoftFloatCalls;
-  if (FloatABIForCalls != FloatABI::Default)
-    Options.FloatABIType = FloatABIForCalls;
-  Options.NoZerosInBSS = DontPlaceZerosInBSS;
-  Options.GuaranteedTailCallOpt = EnableGuaranteedTailCallOpt;
-  Options.DisableTailCalls = DisableTailCalls;
-  Options.StackAlignmentOverride = OverrideStackAlignment;
-  Options.RealignStack = EnableRealignStack;
-  Options.TrapFuncName = TrapFuncName;
-  Options.PositionIndependentExecutable = EnablePIE;
-  Options.EnableSegmentedStacks = SegmentedStacks;
-  Options.UseInitArray = UseInitArray;
-  Options.SSPBufferSize = SSPBufferSize;
-#endif
+  Options.LessPreciseFPMADOption = (fp_flags & POCL_FP_MAD_ENABLE) != 0;
+  Options.AllowFPOpFusion = 
+    (fp_flags & POCL_FP_MAD_ENABLE) ? FPOpFusion::Fast : FPOpFusion::Standard;
+  Options.UnsafeFPMath = (fp_flags & POCL_FP_UNSAFE_MATH) != 0;
+  Options.NoInfsFPMath = (fp_flags & POCL_FP_FINITE_MATH_ONLY) != 0;
+  Options.NoNaNsFPMath = (fp_flags & POCL_FP_FINITE_MATH_ONLY) != 0;
   return Options;
 }
 
@@ -609,70 +798,162 @@ static TargetMachine* GetTargetMachine
   }
 
   return TheTarget->createTargetMachine(TheTriple.getTriple(),
-                                        MCPU, FeaturesStr, GetTargetOptions(),
+                                        MCPU, FeaturesStr, GetTargetOptions(0),
                                         Reloc::Default, CodeModel::Default,
                                         CodeGenOpt::Aggressive);
 }
 
 /* helpers copied from LLVM opt END */
 
-/* The kernel compiler passes are at the moment not thread safe,
-   ensure only one thread is using it at the time with a mutex. */
-static pocl_lock_t kernel_compiler_lock = POCL_LOCK_INITIALIZER;
+static pocl_lock_t kernel_compiler_init_lock = POCL_LOCK_INITIALIZER;
+static bool kernel_compiler_initialized = false;
 
 /**
- * Prepare the kernel compiler passes.
+ * Initializes LLVM for multithreaded use and sets the global LLVM 
+ * options of the kernel compiler.
  *
- * The passes are created only once per program run per device.
- * The returned pass manager should not be modified, only the Module
- * should be optimized using it.
+ * Done only once per program run. The LLVM options cannot be unset or
+ * set per compilation, thus they are controlled only by the 
+ * environment variables which stay the same during the run.
  */
-static PassManager& kernel_compiler_passes
-(cl_device_id device, std::string module_data_layout)
+static void initialize_kernel_compiler()
 {
-  static std::map<cl_device_id, PassManager*> kernel_compiler_passes;
-
-  if (kernel_compiler_passes.find(device) != 
-      kernel_compiler_passes.end())
+  POCL_LOCK(kernel_compiler_init_lock);
+  if (kernel_compiler_initialized)
     {
-      return *kernel_compiler_passes[device];
+      POCL_UNLOCK(kernel_compiler_init_lock);
+      return;
     }
 
-  Triple triple(device->llvm_target_triplet);
-  PassRegistry &Registry = *PassRegistry::getPassRegistry();
+  llvm_start_multithreaded();
 
-  const bool first_initialization_call = kernel_compiler_passes.size() == 0;
+  InitializeAllTargets();
+  InitializeAllTargetMCs();
 
-  if (first_initialization_call) 
-    {
-      // We have not initialized any pass managers for any device yet.
-      // Run the global LLVM pass initialization functions.
-      InitializeAllTargets();
-      InitializeAllTargetMCs();
-
-      // TODO: do this globally, and just once per program
-      initializeCore(Registry);
-      initializeScalarOpts(Registry);
-      initializeVectorization(Registry);
-      initializeIPO(Registry);
-      initializeAnalysis(Registry);
-      initializeIPA(Registry);
-      initializeTransformUtils(Registry);
-      initializeInstCombine(Registry);
-      initializeInstrumentation(Registry);
-      initializeTarget(Registry);
-    }
+  PassRegistry &Registry = *PassRegistry::getPassRegistry();
+  initializeCore(Registry);
+  initializeScalarOpts(Registry);
+  initializeVectorization(Registry);
+  initializeIPO(Registry);
+  initializeAnalysis(Registry);
+  initializeIPA(Registry);
+  initializeTransformUtils(Registry);
+  initializeInstCombine(Registry);
+  initializeInstrumentation(Registry);
+  initializeTarget(Registry);
 
 #ifndef LLVM_3_2
   StringMap<llvm::cl::Option*> opts;
   llvm::cl::getRegisteredOptions(opts);
+
+  const bool wi_vectorizer = 
+    pocl_get_bool_option("POCL_VECTORIZE_WORK_GROUPS", 0);
+
+  /* The 'loopvec' method needs no global options: the work-item loops
+     get the vectorization width as loop metadata and the scalarizer is
+     configured with a kernel compiler parameter. */
+  if (wi_vectorizer) 
+    {
+      llvm::cl::Option *O;
+      if (pocl_is_option_set("POCL_VECTORIZE_VECTOR_WIDTH"))
+        {
+          O = opts["wi-vectorize-vector-width"];
+          assert(O && "could not find LLVM option 'wi-vectorize-vector-width'");
+          O->addOccurrence(1, StringRef("wi-vectorize-vector-width"), 
+                           pocl_get_string_option("POCL_VECTORIZE_VECTOR_WIDTH", "0"), false); 
+        }
+
+      if (pocl_get_bool_option("POCL_VECTORIZE_NO_FP", 0)) 
+        {
+          O = opts["wi-vectorize-no-fp"];
+          assert(O && "could not find LLVM option 'wi-vectorize-no-fp'");
+          O->addOccurrence(1, StringRef("wi-vectorize-no-fp"), StringRef(""), false); 
+        }
+
+      if (pocl_get_bool_option("POCL_VECTORIZE_MEM_ONLY", 0)) 
+        {
+          O = opts["wi-vectorize-mem-ops-only"];
+          assert(O && "could not find LLVM option 'wi-vectorize-mem-ops-only'");
+          O->addOccurrence(1, StringRef("wi-vectorize-mem-ops-only"), StringRef(""), false); 
+        }
+
+      O = opts["add-wi-metadata"];
+      O->addOccurrence(1, StringRef("add-wi-metadata"), 
+                       StringRef(""), false); 
+    }
 #endif
 
+  kernel_compiler_initialized = true;
+  POCL_UNLOCK(kernel_compiler_init_lock);
+}
+
+/* The state shared by the CompileTimer passes of a pass manager. */
+typedef struct compile_timing
+{
+  std::string kernel;
+  std::string variant;
+  uint64_t last;
+} compile_timing;
+
+namespace {
+  /**
+   * Reports the wall time since the previous timer as the time of the 
+   * kernel compiler pass before it, for POCL_COMPILE_TIMING.
+   *
+   * A timer is added after each pass of the list. Being module passes,
+   * they also stop the function passes from being run function by
+   * function as a batch, so each one is timed over the whole module.
+   */
+  class CompileTimer : public ModulePass 
+  {
+  public:
+    static char ID;
+    CompileTimer(compile_timing *timing, const std::string &pass_name) : 
+      ModulePass(ID), timing(timing), pass_name(pass_name) {}
+
+    virtual const char *getPassName() const 
+    { return "pocl compile timer"; }
+    virtual void getAnalysisUsage(AnalysisUsage &AU) const 
+    { AU.setPreservesAll(); }
+    virtual bool runOnModule(llvm::Module &) 
+    {
+      pocl_report_compile_time(timing->kernel.c_str(), 
+                               timing->variant.c_str(), pass_name.c_str(),
+                               pocl_wall_time_us() - timing->last);
+      timing->last = pocl_wall_time_us();
+      return false;
+    }
+
+  private:
+    compile_timing *timing;
+    std::string pass_name;
+  };
+  char CompileTimer::ID = 0;
+}
+
+/**
+ * Creates the kernel compiler passes for the device and the work-group
+ * method.
+ *
+ * Each kernel compiler instance gets its own pass managers as the
+ * passes store state of the function being processed. The pass 
+ * manager should not be modified, only the Module should be optimized 
+ * using it.
+ */
+static PassManager* create_kernel_compiler_passes
+(cl_device_id device, std::string module_data_layout, 
+ const std::string &wg_method, compile_timing *timing, 
+ TargetMachine **target_machine)
+{
+  Triple triple(device->llvm_target_triplet);
+  PassRegistry &Registry = *PassRegistry::getPassRegistry();
+
   PassManager *Passes = new PassManager();
 
   // Need to setup the target info for target specific passes. */
   TargetMachine *Machine = 
     GetTargetMachine(triple, device->llvm_cpu ? device->llvm_cpu : "");
+  *target_machine = Machine;
   // Add internal analysis passes from the target machine.
 #ifndef LLVM_3_2
   Machine->addAnalysisPasses(*Passes);
@@ -681,7 +962,6 @@ static PassManager& kernel_compiler_passes
   if (module_data_layout != "")
     Passes->add(new DataLayout(module_data_layout));
  
-
   /* Disables automated generation of libcalls from code patterns. 
      TCE doesn't have a runtime linker which could link the libs later on.
      Also the libcalls might be harmful for WG autovectorization where we 
@@ -705,6 +985,10 @@ static PassManager& kernel_compiler_passes
      -loop-barriers, -barriertails, and -barriers should be ran after the implicit barrier 
      injection passes so they "normalize" the implicit barriers also
 
+     -remove-barriers after inlining so the calls to the non-inlined functions
+     that might access memory are known, and before the implicit barriers
+     are added as they never order memory accesses and would be removed.
+
      -phistoallocas before -workitemloops as otherwise it cannot inject context
      restore code (PHIs need to be at the beginning of the BB and so one cannot
      context restore them with non-PHI code if the value is needed in another PHI). */
@@ -720,6 +1004,7 @@ static PassManager& kernel_compiler_passes
   passes.push_back("globaldce");
   passes.push_back("simplifycfg");
   passes.push_back("loop-simplify");
+  passes.push_back("remove-barriers");
   passes.push_back("phistoallocas");
   passes.push_back("isolate-regions");
   passes.push_back("uniformity");
@@ -742,9 +1027,6 @@ static PassManager& kernel_compiler_passes
    * TODO: POCL_VECTORIZE_VECTOR_WIDTH
    * TODO: POCl_VECTORIZE_NO_FP
    */
-  const std::string wg_method = 
-    pocl_get_string_option("POCL_WORK_GROUP_METHOD", "auto");
-
   const bool wi_vectorizer = 
     pocl_get_bool_option("POCL_VECTORIZE_WORK_GROUPS", 0);
 
@@ -752,82 +1034,25 @@ static PassManager& kernel_compiler_passes
 #ifndef LLVM_3_2
   if (wg_method == "loopvec")
     {
-      if (kernel_compiler_passes.size() == 0) {
-        // Set the options only once. TODO: fix it so that each
-        // device can reset their own options. Now one cannot compile
-        // with different options to different devices at one run.
-   
-        llvm::cl::Option *O = opts["vectorizer-min-trip-count"];
-        assert(O && "could not find LLVM option 'vectorizer-min-trip-count'");
-        O->addOccurrence(1, StringRef("vectorizer-min-trip-count"), StringRef("2"), false); 
-
-        O = opts["scalarize-load-store"];
-        assert(O && "could not find LLVM option 'scalarize-load-store'");
-        O->addOccurrence(1, StringRef("scalarize-load-store"), StringRef(""), false); 
-
-        O = opts["enable-scalarizer"];
-        assert(O && "could not find LLVM option 'enable-scalarizer'");
-        O->addOccurrence(1, StringRef("enable-scalarizer"), StringRef(""), false); 
-
-#ifdef DEBUG_POCL_LLVM_API        
-        printf ("### autovectorizer enabled\n");
-
-        O = opts["debug-only"];
-        assert(O && "could not find LLVM option 'debug'");
-        O->addOccurrence(1, StringRef("debug-only"), StringRef("loop-vectorize"), false); 
-
-#endif
-      }
-
       passes.push_back("scalarizer");
       passes.push_back("mem2reg");
       passes.push_back("loop-vectorize");
       passes.push_back("slp-vectorizer");
     } 
+  else if (wg_method == "hybrid")
+    {
+      /* The work-item loops are unrolled by the SIMD width, let the
+         SLP vectorizer combine the unrolled work-items after the
+         cleanup of the generic passes. */
+      passes.push_back("STANDARD_OPTS");
+      passes.push_back("slp-vectorizer");
+    }
   else if (wi_vectorizer) 
     {
       /* The legacy repl based WI autovectorizer. Deprecated but 
          for still needed by some legacy TTA machines. */
       passes.push_back("STANDARD_OPTS");
       passes.push_back("wi-vectorize");
-      llvm::cl::Option *O;
-      if (pocl_is_option_set("POCL_VECTORIZE_VECTOR_WIDTH") && 
-          first_initialization_call) 
-        {
-          /* The options cannot be unset, it seems, so we must set them 
-             only once, globally. TODO: check further if there is some way to
-             unset the options so we can control them per kernel compilation. */
-          O = opts["wi-vectorize-vector-width"];
-          assert(O && "could not find LLVM option 'wi-vectorize-vector-width'");
-          O->addOccurrence(1, StringRef("wi-vectorize-vector-width"), 
-                           pocl_get_string_option("POCL_VECTORIZE_VECTOR_WIDTH", "0"), false); 
-
-        }
-
-      if (pocl_get_bool_option("POCL_VECTORIZE_NO_FP", 0) && 
-          first_initialization_call) 
-        {
-          O = opts["wi-vectorize-no-fp"];
-          assert(O && "could not find LLVM option 'wi-vectorize-no-fp'");
-          O->addOccurrence(1, StringRef("wi-vectorize-no-fp"), StringRef(""), false); 
-        }
-
-      if (pocl_get_bool_option("POCL_VECTORIZE_MEM_ONLY", 0) && 
-          first_initialization_call) 
-        {
-          O = opts["wi-vectorize-mem-ops-only"];
-          assert(O && "could not find LLVM option 'wi-vectorize-mem-ops-only'");
-          O->addOccurrence(1, StringRef("wi-vectorize-mem-ops-only"), StringRef(""), false); 
-        }
-       if (first_initialization_call)
-        {
-#ifndef LLVM_3_2
-          llvm::cl::Option *O = opts["add-wi-metadata"];
-          O->addOccurrence(1, StringRef("add-wi-metadata"), 
-                           StringRef(""), false); 
-#endif
-        }
-
     }
 #endif
 
@@ -850,6 +1075,8 @@ static PassManager& kernel_compiler_passes
           Builder.DisableSimplifyLibCalls = true;
 #endif
           Builder.populateModulePassManager(*Passes);
+          if (timing != NULL)
+            Passes->add(new CompileTimer(timing, passes[i]));
      
           continue;
         }
@@ -860,6 +1087,8 @@ static PassManager& kernel_compiler_passes
           //std::cout << "-"<<passes[i] << " ";
           Pass *thispass = PIs->createPass();
           Passes->add(thispass);
+          if (timing != NULL)
+            Passes->add(new CompileTimer(timing, passes[i]));
         }
       else
         {
@@ -867,43 +1096,12 @@ static PassManager& kernel_compiler_passes
           POCL_ABORT("FAIL");
         }
     }
-  kernel_compiler_passes[device] = Passes;
-  return *Passes;
+  return Passes;
 }
 
-/* This is used to communicate the work-group dimensions command-line parameter to the 
-   workitem loop. */
-namespace pocl {
-extern llvm::cl::list<int> LocalSize;
-} 
-
-/* This is used to control the kernel we want to process in the kernel compilation. */
-extern cl::opt<std::string> KernelName;
-
-/* This function links the input kernel LLVM bitcode and the
- * OpenCL kernel runtime library into one LLVM module, then
- * runs pocl's kernel compiler passes on that module to produce 
- * a function that executes all work-items in a work-group.
- *
- * Output is a LLVM bitcode file. 
- *
- * TODO: rename these functions for something more descriptive.
- * TODO: this is not thread-safe, it changes the LLVM global options to
- * control the compilation. We should enforce only one compilations is done
- * at a time or control the options through thread safe methods.
- */
-int call_pocl_workgroup(cl_device_id device,
-                        cl_kernel kernel,
-                        size_t local_x, size_t local_y, size_t local_z,
-                        const char* parallel_filename,
-                        const char* kernel_filename)
+static std::string
+kernel_library_path(cl_device_id device)
 {
-
-#ifdef DEBUG_POCL_LLVM_API        
-  printf("### calling the kernel compiler for kernel %s local_x %u local_y %u local_z %u parallel_filename: %s\n",
-         kernel->name, local_x, local_y, local_z, parallel_filename);
-#endif
-
   Triple triple(device->llvm_target_triplet);
 
   // TODO sync with Nat Ferrus' indexed linking
@@ -938,42 +1136,510 @@ int call_pocl_workgroup(cl_device_id device,
       kernellib += device->llvm_target_triplet;
       kernellib += ".bc";
     }
+  return kernellib;
+}
+
+/* The kernel compiler passes of a work-group method. */
+typedef struct kernel_compiler_passes
+{
+  PassManager *passes;
+  /* The target of the passes. Its floating point options are set per 
+     compilation from the build options of the program. */
+  TargetMachine *machine;
+  /* Set for the passes with the POCL_COMPILE_TIMING timers. */
+  compile_timing *timing;
+} kernel_compiler_passes;
+
+/**
+ * A kernel compiler instance of a device: an LLVMContext with the
+ * kernel library parsed in it, and the kernel compiler passes. 
+ *
+ * An instance is used by one compilation at a time. Multiple kernels 
+ * can be compiled in parallel, each in their own context with their own
+ * pass manager. The instances are pooled to reuse the parsed kernel 
+ * library and the pass managers.
+ */
+typedef struct kernel_compiler_instance 
+{
+  LLVMContext *context;
+  /* The built-ins are cloned from here to the kernel modules. 
+     The module itself is never modified. */
+  llvm::Module *kernel_library;
+  /* Created at the first compilation with the work-group method as the 
+     passes need the data layout of the kernel module. The ones with the
+     POCL_COMPILE_TIMING timers are kept under the method name suffixed 
+     with "+timing". */
+  std::map<std::string, kernel_compiler_passes> passes;
+} kernel_compiler_instance;
+
+typedef std::map<cl_device_id, std::vector<kernel_compiler_instance*> > 
+  kernel_compiler_instance_pool;
+static kernel_compiler_instance_pool idle_compiler_instances;
+static pocl_lock_t compiler_instance_lock = POCL_LOCK_INITIALIZER;
+
+/**
+ * Takes an idle kernel compiler instance of the device for exclusive 
+ * use, creating a new one if all of them are busy.
+ */
+static kernel_compiler_instance*
+acquire_compiler_instance(cl_device_id device)
+{
+  POCL_LOCK(compiler_instance_lock);
+  std::vector<kernel_compiler_instance*> &idle = 
+    idle_compiler_instances[device];
+  if (!idle.empty())
+    {
+      kernel_compiler_instance *instance = idle.back();
+      idle.pop_back();
+      POCL_UNLOCK(compiler_instance_lock);
+      return instance;
+    }
+  POCL_UNLOCK(compiler_instance_lock);
+
+  kernel_compiler_instance *instance = new kernel_compiler_instance;
+  instance->context = new LLVMContext;
 
-  LLVMContext *Context = NULL;
   SMDiagnostic Err;
-  std::string errmsg;
+  std::string kernellib = kernel_library_path(device);
+  instance->kernel_library = ParseIRFile(kernellib, Err, *instance->context);
+  if (instance->kernel_library == NULL)
+    {
+      raw_os_ostream os(std::cerr);
+      Err.print("pocl error: bad kernel library file ", os);
+      os.flush();
+      POCL_ABORT("Failed loading the kernel library.\n");
+    }
+  return instance;
+}
 
-  // Link the kernel and runtime library
+static void
+release_compiler_instance(cl_device_id device, 
+                          kernel_compiler_instance *instance)
+{
+  POCL_LOCK(compiler_instance_lock);
+  idle_compiler_instances[device].push_back(instance);
+  POCL_UNLOCK(compiler_instance_lock);
+}
+
+/* Adds the global values referred to by V (directly or through constant 
+   expressions and initializers) to the worklist. */
+static void
+find_referenced_globals(llvm::Value *V, 
+                        std::set<llvm::GlobalValue*> &seen,
+                        std::vector<llvm::GlobalValue*> &worklist)
+{
+  if (llvm::GlobalValue *G = dyn_cast<llvm::GlobalValue>(V))
+    {
+      if (seen.insert(G).second)
+        worklist.push_back(G);
+      return;
+    }
+  llvm::Constant *C = dyn_cast<llvm::Constant>(V);
+  if (C == NULL) return;
+  for (llvm::User::op_iterator op = C->op_begin(), e = C->op_end(); 
+       op != e; ++op)
+    find_referenced_globals(*op, seen, worklist);
+}
+
+/**
+ * Clones the kernel library functions and global variables the input
+ * module refers to, transitively, into the input module.
+ *
+ * This replaces linking the whole library module in: only the used 
+ * built-ins get copied and the library module itself is not modified
+ * so it can be reused for the next kernel.
+ */
+static void
+link_used_builtins(llvm::Module *input, llvm::Module *lib)
+{
+  std::set<llvm::GlobalValue*> seen;
+  std::vector<llvm::GlobalValue*> worklist;
+  std::vector<llvm::GlobalValue*> needed;
+
+  for (llvm::Module::iterator f = input->begin(), e = input->end();
+       f != e; ++f)
+    {
+      if (!f->isDeclaration()) continue;
+      llvm::GlobalValue *G = lib->getNamedValue(f->getName());
+      if (G != NULL && !G->hasLocalLinkage() && seen.insert(G).second)
+        worklist.push_back(G);
+    }
+  for (llvm::Module::global_iterator gv = input->global_begin(), 
+         e = input->global_end(); gv != e; ++gv)
+    {
+      if (!gv->isDeclaration()) continue;
+      llvm::GlobalValue *G = lib->getNamedValue(gv->getName());
+      if (G != NULL && !G->hasLocalLinkage() && seen.insert(G).second)
+        worklist.push_back(G);
+    }
+
+  while (!worklist.empty())
+    {
+      llvm::GlobalValue *G = worklist.back();
+      worklist.pop_back();
+      needed.push_back(G);
+
+      if (llvm::Function *F = dyn_cast<llvm::Function>(G))
+        {
+          for (llvm::Function::iterator bb = F->begin(), bbe = F->end();
+               bb != bbe; ++bb)
+            for (llvm::BasicBlock::iterator i = bb->begin(), ie = bb->end(); 
+                 i != ie; ++i)
+              for (llvm::User::op_iterator op = i->op_begin(), 
+                     ope = i->op_end(); op != ope; ++op)
+                find_referenced_globals(*op, seen, worklist);
+        }
+      else if (llvm::GlobalVariable *GV = dyn_cast<llvm::GlobalVariable>(G))
+        {
+          if (GV->hasInitializer())
+            find_referenced_globals(GV->getInitializer(), seen, worklist);
+        }
+      else if (llvm::GlobalAlias *GA = dyn_cast<llvm::GlobalAlias>(G))
+        find_referenced_globals(GA->getAliasee(), seen, worklist);
+    }
+
+  /* Create (or find) the counterparts of all the needed globals first so 
+     the references between the cloned built-ins can be mapped in any 
+     order. */
+  ValueToValueMapTy VMap;
+  std::vector<llvm::GlobalValue*> to_clone;
+  for (size_t i = 0; i < needed.size(); ++i)
+    {
+      llvm::GlobalValue *G = needed[i];
+      /* The library internals, e.g. the .str format literals of printf, 
+         are always cloned, like the Linker does, setName() uniques their 
+         names. Only the external globals are bound to the kernel's ones 
+         of the same name, not to its internal ones. */
+      llvm::GlobalValue *dst = NULL;
+      if (!G->hasLocalLinkage())
+        dst = input->getNamedValue(G->getName());
+      if (dst != NULL && dst->hasLocalLinkage())
+        dst = NULL;
+
+      if (dst != NULL && !dst->isDeclaration())
+        {
+          /* Defined by the kernel module itself, like the Linker would
+             prefer it. */
+          VMap[G] = ConstantExpr::getBitCast(dst, G->getType());
+          continue;
+        }
+
+      if (dst == NULL || dst->getType() != G->getType() || 
+          isa<llvm::GlobalAlias>(G))
+        {
+          llvm::GlobalValue *newgv;
+          if (llvm::Function *F = dyn_cast<llvm::Function>(G))
+            newgv = llvm::Function::Create
+              (F->getFunctionType(), F->getLinkage(), "", input);
+          else if (isa<llvm::GlobalAlias>(G))
+            /* The aliasee is set once all the globals have been mapped. */
+            newgv = new llvm::GlobalAlias
+              (G->getType(), G->getLinkage(), "", NULL, input);
+          else 
+            {
+              llvm::GlobalVariable *GV = cast<llvm::GlobalVariable>(G);
+              newgv = new llvm::GlobalVariable
+                (*input, GV->getType()->getElementType(), GV->isConstant(), 
+                 GV->getLinkage(), NULL, "", NULL, GV->getThreadLocalMode(),
+                 GV->getType()->getAddressSpace());
+            }
+          if (dst != NULL)
+            {
+              dst->replaceAllUsesWith
+                (ConstantExpr::getBitCast(newgv, dst->getType()));
+              dst->eraseFromParent();
+            }
+          newgv->setName(G->getName());
+          dst = newgv;
+        }
+      dst->copyAttributesFrom(G);
+      dst->setLinkage(G->getLinkage());
+      VMap[G] = dst;
+      if (!G->isDeclaration())
+        to_clone.push_back(G);
+    }
+
+  for (size_t i = 0; i < to_clone.size(); ++i)
+    {
+      if (llvm::Function *F = dyn_cast<llvm::Function>(to_clone[i]))
+        {
+          llvm::Function *NF = cast<llvm::Function>(VMap[F]);
+          llvm::Function::arg_iterator DestI = NF->arg_begin();
+          for (llvm::Function::const_arg_iterator a = F->arg_begin(), 
+                 ae = F->arg_end(); a != ae; ++a, ++DestI)
+            {
+              DestI->setName(a->getName());
+              VMap[a] = DestI;
+            }
+          SmallVector<ReturnInst*, 8> Returns;
+          CloneFunctionInto(NF, F, VMap, true, Returns);
+        }
+      else if (llvm::GlobalAlias *GA = 
+               dyn_cast<llvm::GlobalAlias>(to_clone[i]))
+        {
+          llvm::GlobalAlias *NGA = cast<llvm::GlobalAlias>(VMap[GA]);
+          NGA->setAliasee(MapValue(GA->getAliasee(), VMap));
+        }
+      else
+        {
+          llvm::GlobalVariable *GV = cast<llvm::GlobalVariable>(to_clone[i]);
+          llvm::GlobalVariable *NGV = cast<llvm::GlobalVariable>(VMap[GV]);
+          NGV->setInitializer(MapValue(GV->getInitializer(), VMap));
+          NGV->setConstant(GV->isConstant());
+        }
+    }
+
+#ifdef DEBUG_POCL_LLVM_API        
+  printf("### cloned %u built-in functions and globals from the kernel library\n",
+         (unsigned)to_clone.size());
+#endif
+}
+
+/**
+ * Applies the floating point relaxations of the build options to all
+ * functions of the linked kernel module. 
+ *
+ * The kernel library is compiled with the strict defaults, thus the 
+ * built-ins cloned to the module are relaxed only here. This lets the
+ * optimizers and the code generator use the faster, less precise
+ * sequences inside the math built-ins too, as allowed by the options.
+ */
+static void
+relax_fp_math(llvm::Module *module, unsigned fp_flags)
+{
+#if !defined LLVM_3_2 && !defined LLVM_3_3
+  if (fp_flags == 0) return;
+  for (llvm::Module::iterator f = module->begin(), e = module->end();
+       f != e; ++f)
+    {
+      if (f->isDeclaration()) continue;
+      if (fp_flags & POCL_FP_MAD_ENABLE)
+        f->addFnAttr("less-precise-fpmad", "true");
+      if (fp_flags & POCL_FP_UNSAFE_MATH)
+        f->addFnAttr("unsafe-fp-math", "true");
+      if (fp_flags & POCL_FP_FINITE_MATH_ONLY)
+        {
+          f->addFnAttr("no-infs-fp-math", "true");
+          f->addFnAttr("no-nans-fp-math", "true");
+        }
+      if ((fp_flags & POCL_FP_FAST_RELAXED_MATH) == 0) continue;
+      for (llvm::Function::iterator bb = f->begin(), bbe = f->end();
+           bb != bbe; ++bb)
+        for (llvm::BasicBlock::iterator i = bb->begin(), ie = bb->end(); 
+             i != ie; ++i)
+          if (isa<FPMathOperator>(i))
+            i->setHasUnsafeAlgebra(true);
+    }
+#endif
+}
+
+/**
+ * Replaces the uses of the scalar arguments of the kernel with the values
+ * of a variant with POCL_WG_VARIANT_SPECIALIZED_ARGS. 
+ *
+ * The arguments stay in the signature as the launcher passes them anyway.
+ * Only the integer and floating point scalars are folded, the vectors and
+ * the structs are left as they are.
+ */
+static void
+specialize_kernel_arguments(llvm::Function *kernel_function, cl_kernel kernel,
+                            const struct pocl_argument *arguments)
+{
+  unsigned i = 0;
+  for (llvm::Function::arg_iterator arg = kernel_function->arg_begin(),
+         e = kernel_function->arg_end(); arg != e && i < kernel->num_args; 
+       ++arg, ++i)
+    {
+      const struct pocl_argument *value = &arguments[i];
+      llvm::Type *type = arg->getType();
+      llvm::Constant *constant = NULL;
+
+      if (value->value == NULL || arg->use_empty())
+        continue;
+
+      if (type->isIntegerTy() && 
+          type->getPrimitiveSizeInBits() == value->size * 8)
+        {
+          uint64_t bits;
+          switch (value->size)
+            {
+            case 1: bits = *(const uint8_t*)value->value; break;
+            case 2: bits = *(const uint16_t*)value->value; break;
+            case 4: bits = *(const uint32_t*)value->value; break;
+            case 8: bits = *(const uint64_t*)value->value; break;
+            default: continue;
+            }
+          constant = ConstantInt::get(type, bits);
+        }
+      else if (type->isFloatTy() && value->size == sizeof(float))
+        constant = ConstantFP::get(type, *(const float*)value->value);
+      else if (type->isDoubleTy() && value->size == sizeof(double))
+        constant = ConstantFP::get(type, *(const double*)value->value);
+
+      if (constant != NULL)
+        arg->replaceAllUsesWith(constant);
+    }
+}
+
+/* This function links the input kernel LLVM bitcode and the
+ * built-ins it uses from the OpenCL kernel runtime library into one 
+ * LLVM module, then runs pocl's kernel compiler passes on that module 
+ * to produce a function that executes all work-items in a work-group.
+ *
+ * Output is a LLVM bitcode file. 
+ *
+ * The function is thread safe. The compilation parameters are passed
+ * to the passes in the kernel module, and the compilation is done in
+ * a kernel compiler instance not used by the other threads.
+ *
+ * TODO: rename these functions for something more descriptive.
+ */
+int call_pocl_workgroup(cl_device_id device,
+                        cl_kernel kernel,
+                        size_t local_x, size_t local_y, size_t local_z,
+                        unsigned variant_flags,
+                        const struct pocl_argument *arguments,
+                        const char* parallel_filename,
+                        const char* kernel_filename)
+{
+
+#ifdef DEBUG_POCL_LLVM_API        
+  printf("### calling the kernel compiler for kernel %s local_x %u local_y %u local_z %u parallel_filename: %s\n",
+         kernel->name, local_x, local_y, local_z, parallel_filename);
+#endif
+
+  initialize_kernel_compiler();
+  const bool timed = pocl_compile_timing();
+  std::string variant_dir(parallel_filename);
+  variant_dir = variant_dir.substr(0, variant_dir.rfind('/'));
+  uint64_t start = timed ? pocl_wall_time_us() : 0;
+
+  kernel_compiler_instance *instance = acquire_compiler_instance(device);
+  LLVMContext *Context = instance->context;
+  SMDiagnostic Err;
+
+  /* Bring the kernel to the instance's context. The program's Module 
+     is shared by all the compilations, thus it is serialized only 
+     while holding the program lock. */
   llvm::Module *input = NULL;
-  if (kernel->program->llvm_irs != NULL && 
-      kernel->program->llvm_irs[device->dev_id] != NULL) 
+  cl_program program = kernel->program;
+  if (program->llvm_irs != NULL && 
+      program->llvm_irs[device->dev_id] != NULL) 
     {
-      input = 
-        llvm::CloneModule
-        ((llvm::Module*)kernel->program->llvm_irs[device->dev_id]);
-      Context = &input->getContext();
+      std::string bitcode;
+      raw_string_ostream os(bitcode);
+      POCL_LOCK(program->pocl_lock);
+      WriteBitcodeToFile
+        ((llvm::Module*)program->llvm_irs[device->dev_id], os);
+      POCL_UNLOCK(program->pocl_lock);
+      os.flush();
+
+      MemoryBuffer *buffer = 
+        MemoryBuffer::getMemBuffer(StringRef(bitcode), "", false);
+      std::string errmsg;
+      input = ParseBitcodeFile(buffer, *Context, &errmsg);
+      delete buffer;
+    }
+  else if (program->binaries != NULL && 
+           program->binaries[device->dev_id] != NULL)
+    {
+      /* Program loaded from a binary, parse it directly without 
+         dumping it to a file first. */
+      MemoryBuffer *buffer = 
+        MemoryBuffer::getMemBuffer
+        (StringRef((const char*)program->binaries[device->dev_id], 
+                   program->binary_sizes[device->dev_id]), "", false);
+      std::string errmsg;
+      input = ParseBitcodeFile(buffer, *Context, &errmsg);
+      delete buffer;
     }
   else
     {
-      Context = new LLVMContext;
       input = ParseIRFile(kernel_filename, Err, *Context);
     }
+  assert (input != NULL);
+  if (timed)
+    {
+      pocl_report_compile_time(kernel->name, variant_dir.c_str(), "parse", 
+                               pocl_wall_time_us() - start);
+      start = pocl_wall_time_us();
+    }
 
-  // OPTIMIZE: the built-in libs should be loaded only once per device.
-  // Later this should be replaced with indexed linking of source code
-  // and/or bitcode for each kernel.
-  llvm::Module *libmodule = ParseIRFile(kernellib, Err, *Context);
-  assert (libmodule != NULL);
-#ifdef LLVM_3_2
-  Linker TheLinker("pocl", input);
-  TheLinker.LinkInModule(libmodule, &errmsg);
-#else
-  Linker TheLinker(input);
-  TheLinker.linkInModule(libmodule, &errmsg);
-#endif
-  llvm::Module *linked_bc = TheLinker.getModule();
-
-  assert (linked_bc != NULL);
+  // Link in the used built-ins from the kernel runtime library.
+  // TODO: replace with indexed linking of source code and/or bitcode
+  // for each kernel.
+  link_used_builtins(input, instance->kernel_library);
+  llvm::Module *linked_bc = input;
+  if (timed)
+    pocl_report_compile_time(kernel->name, variant_dir.c_str(), 
+                             "link-builtins", pocl_wall_time_us() - start);
+
+  unsigned fp_flags = pocl_fp_math_flags(program->compiler_options);
+  relax_fp_math(linked_bc, fp_flags);
+
+  llvm::Function *kernel_function = linked_bc->getFunction(kernel->name);
+  if (kernel_function != NULL && 
+      (variant_flags & POCL_WG_VARIANT_SPECIALIZED_ARGS))
+    specialize_kernel_arguments(kernel_function, kernel, arguments);
+
+  /* The per-compilation parameters for the passes. */
+  pocl::setKernelCompilerParam(*linked_bc, "kernel", kernel->name);
+  pocl::setKernelCompilerParam(*linked_bc, "local_size_x", local_x);
+  pocl::setKernelCompilerParam(*linked_bc, "local_size_y", local_y);
+  pocl::setKernelCompilerParam(*linked_bc, "local_size_z", local_z);
+  if (variant_flags & POCL_WG_VARIANT_DYNAMIC_LOCAL_SIZE)
+    pocl::setKernelCompilerParam(*linked_bc, "dynamic_local_size", 1ul);
+  /* Read by the vectorized work-group methods and the cost model of the 
+     'auto' method. */
+  pocl::setKernelCompilerParam
+    (*linked_bc, "native_vector_width_char", 
+     (unsigned long)device->native_vector_width_char);
+  pocl::setKernelCompilerParam
+    (*linked_bc, "native_vector_width_short", 
+     (unsigned long)device->native_vector_width_short);
+  pocl::setKernelCompilerParam
+    (*linked_bc, "native_vector_width_int", 
+     (unsigned long)device->native_vector_width_int);
+  pocl::setKernelCompilerParam
+    (*linked_bc, "native_vector_width_long", 
+     (unsigned long)device->native_vector_width_long);
+  pocl::setKernelCompilerParam
+    (*linked_bc, "native_vector_width_float", 
+     (unsigned long)device->native_vector_width_float);
+  pocl::setKernelCompilerParam
+    (*linked_bc, "native_vector_width_double", 
+     (unsigned long)device->native_vector_width_double);
+  if (pocl_is_option_set("POCL_CONTEXT_LAYOUT"))
+    pocl::setKernelCompilerParam
+      (*linked_bc, "context_layout", 
+       pocl_get_string_option("POCL_CONTEXT_LAYOUT", "auto"));
+  if (pocl_get_bool_option("POCL_KERNEL_ARGS_NOALIAS", 0))
+    pocl::setKernelCompilerParam(*linked_bc, "noalias_args", 1ul);
+  if (pocl_is_option_set("POCL_FULL_REPLICATION_THRESHOLD"))
+    pocl::setKernelCompilerParam
+      (*linked_bc, "full_replication_threshold",
+       (unsigned long)pocl_get_int_option("POCL_FULL_REPLICATION_THRESHOLD", 2));
+
+  /* The method of the variant is the one being measured or the one
+     measured the fastest earlier. With 'auto' the method is estimated 
+     here instead of in the workitem-handler-chooser, as the vectorized 
+     methods need their own passes. */
+  std::string wg_method = 
+    pocl_get_string_option("POCL_WORK_GROUP_METHOD", "auto");
+  if (POCL_WG_VARIANT_GET_METHOD(variant_flags) != 0)
+    wg_method = 
+      pocl_wg_method_name(POCL_WG_VARIANT_GET_METHOD(variant_flags));
+  if (wg_method == "auto" && kernel_function != NULL)
+    wg_method = pocl::WorkitemHandlerChooser::EstimateMethod
+      (*kernel_function, 
+       (variant_flags & POCL_WG_VARIANT_DYNAMIC_LOCAL_SIZE) ? 
+       0 : local_x * local_y * local_z);
+  pocl::setKernelCompilerParam(*linked_bc, "wg_method", wg_method);
+  if (wg_method == "loopvec")
+    {
+      pocl::setKernelCompilerParam(*linked_bc, "vectorize_wi_loops", 1ul);
+      pocl::setKernelCompilerParam(*linked_bc, "scalarize_load_store", 1ul);
+    }
 
   /* Now finally run the set of passes assembled above */
   std::string ErrorInfo;
@@ -981,18 +1647,28 @@ int call_pocl_workgroup(cl_device_id device,
                                                ErrorInfo, 
                                                F_Binary);
 
-  POCL_LOCK(kernel_compiler_lock);
-
-  // TODO pass these as parameters instead, this is not thread safe!
-  pocl::LocalSize.clear();
-  pocl::LocalSize.addValue(local_x);
-  pocl::LocalSize.addValue(local_y);
-  pocl::LocalSize.addValue(local_z);
-  KernelName = kernel->name;
-
-  kernel_compiler_passes(device, linked_bc->getDataLayout()).run(*linked_bc);
-  POCL_UNLOCK(kernel_compiler_lock);
+  kernel_compiler_passes &passes = 
+    instance->passes[timed ? wg_method + "+timing" : wg_method];
+  if (passes.passes == NULL)
+    {
+      passes.timing = timed ? new compile_timing : NULL;
+      passes.passes = 
+        create_kernel_compiler_passes(device, linked_bc->getDataLayout(),
+                                      wg_method, passes.timing, 
+                                      &passes.machine);
+    }
+  if (passes.machine != NULL)
+    passes.machine->Options = GetTargetOptions(fp_flags);
+  if (passes.timing != NULL)
+    {
+      passes.timing->kernel = kernel->name;
+      passes.timing->variant = variant_dir;
+      passes.timing->last = pocl_wall_time_us();
+    }
+  passes.passes->run(*linked_bc);
 
+  if (timed)
+    start = pocl_wall_time_us();
   WriteBitcodeToFile(linked_bc, Out->os()); 
 
   //  input->dump();
@@ -1000,13 +1676,13 @@ int call_pocl_workgroup(cl_device_id device,
 
   Out->keep();
   delete Out;
-#ifndef LLVM_3_2
-  // In LLVM 3.2 the Linker object deletes the associated Modules.
-  // If we delete here, it will crash.
+  if (timed)
+    pocl_report_compile_time(kernel->name, variant_dir.c_str(), 
+                             "write-bitcode", pocl_wall_time_us() - start);
   /* OPTIMIZE: store the fully linked work-group function llvm::Module 
      and pass it to code generation without writing to disk. */
   delete linked_bc;
-#endif
+  release_compiler_instance(device, instance);
 
   return 0;
 }
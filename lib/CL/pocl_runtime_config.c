@@ -40,18 +40,13 @@ struct env_data
 };
 
 static env_data *volatile env_cache = 0;
-static pocl_lock_t lock;
+static pocl_lock_t lock = POCL_LOCK_INITIALIZER;
 
 env_data* find_env (env_data* cache, const char* key)
 {
   env_data* ed;
   char *value;
 
-  /* if cache is empty -> it is not initialized */ 
-  if (env_cache == NULL)
-    {
-      POCL_INIT_LOCK(lock);
-    }
   POCL_LOCK(lock);
   LL_FOREACH(cache, ed)
     {
@@ -26,13 +26,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 #include "pocl_util.h"
 #include "pocl_cl.h"
 #include "utlist.h"
 #include "pocl_mem_management.h"
+#include "pocl_runtime_config.h"
 
 #define TEMP_DIR_PATH_CHARS 16
+#define COMPILE_TIMING_ENV "POCL_COMPILE_TIMING"
 
 struct list_item;
 
@@ -73,6 +77,157 @@ pocl_create_temp_dir()
   return path_name;
 }
 
+#define POCL_CACHEDIR_ENV "POCL_CACHE_DIR"
+
+int
+pocl_mkdir_p (const char *path_name)
+{
+  char *path = strdup (path_name);
+  char *p;
+  int error = 0;
+
+  for (p = path + 1; *p != '\0'; ++p)
+    {
+      if (*p != '/') continue;
+      *p = '\0';
+      if (mkdir (path, S_IRWXU) != 0 && errno != EEXIST)
+        error = -1;
+      *p = '/';
+    }
+  if (mkdir (path, S_IRWXU) != 0 && errno != EEXIST)
+    error = -1;
+  free (path);
+  return error;
+}
+
+static char *cache_dir = NULL;
+static pocl_lock_t cache_dir_lock = POCL_LOCK_INITIALIZER;
+
+const char*
+pocl_get_cache_dir() 
+{
+  char path_name[POCL_FILENAME_LENGTH];
+
+  POCL_LOCK (cache_dir_lock);
+  if (cache_dir != NULL)
+    {
+      POCL_UNLOCK (cache_dir_lock);
+      return cache_dir;
+    }
+
+  if (getenv (POCL_CACHEDIR_ENV) != NULL)
+    snprintf (path_name, POCL_FILENAME_LENGTH, "%s", 
+              getenv (POCL_CACHEDIR_ENV));
+  else if (getenv ("XDG_CACHE_HOME") != NULL)
+    snprintf (path_name, POCL_FILENAME_LENGTH, "%s/pocl", 
+              getenv ("XDG_CACHE_HOME"));
+  else if (getenv ("HOME") != NULL)
+    snprintf (path_name, POCL_FILENAME_LENGTH, "%s/.cache/pocl", 
+              getenv ("HOME"));
+  else
+    path_name[0] = '\0';
+
+  if (path_name[0] != '\0' && pocl_mkdir_p (path_name) == 0)
+    cache_dir = strdup (path_name);
+  else
+    /* No writable persistent location, the results then live only
+       until the exit. */
+    cache_dir = pocl_create_temp_dir ();
+
+  POCL_UNLOCK (cache_dir_lock);
+  return cache_dir;
+}
+
+uint64_t
+pocl_hash_buffer (const void *data, size_t len, uint64_t seed)
+{
+  const unsigned char *bytes = (const unsigned char*)data;
+  uint64_t hash = seed;
+  size_t i;
+  for (i = 0; i < len; ++i)
+    {
+      hash ^= bytes[i];
+      hash *= 0x100000001b3ULL;
+    }
+  return hash;
+}
+
+unsigned
+pocl_fp_math_flags (const char *build_options)
+{
+  unsigned flags = 0;
+  const char *p = build_options;
+  size_t len;
+
+  if (build_options == NULL)
+    return 0;
+
+  while (*p != '\0')
+    {
+      p += strspn (p, " ");
+      len = strcspn (p, " ");
+      if (len == strlen ("-cl-mad-enable") 
+          && strncmp (p, "-cl-mad-enable", len) == 0)
+        flags |= POCL_FP_MAD_ENABLE;
+      else if (len == strlen ("-cl-unsafe-math-optimizations") 
+               && strncmp (p, "-cl-unsafe-math-optimizations", len) == 0)
+        flags |= POCL_FP_UNSAFE_MATH | POCL_FP_MAD_ENABLE;
+      else if (len == strlen ("-cl-finite-math-only") 
+               && strncmp (p, "-cl-finite-math-only", len) == 0)
+        flags |= POCL_FP_FINITE_MATH_ONLY;
+      else if (len == strlen ("-cl-fast-relaxed-math") 
+               && strncmp (p, "-cl-fast-relaxed-math", len) == 0)
+        flags |= POCL_FP_FAST_RELAXED_MATH | POCL_FP_UNSAFE_MATH 
+          | POCL_FP_FINITE_MATH_ONLY | POCL_FP_MAD_ENABLE;
+      p += len;
+    }
+  return flags;
+}
+
+int
+pocl_compile_timing ()
+{
+  const char *timing = pocl_get_string_option (COMPILE_TIMING_ENV, "0");
+  return strcmp (timing, "0") != 0 && strcmp (timing, "") != 0;
+}
+
+uint64_t
+pocl_wall_time_us ()
+{
+  struct timeval now;
+  gettimeofday (&now, NULL);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+static pocl_lock_t compile_timing_lock = POCL_LOCK_INITIALIZER;
+
+void
+pocl_report_compile_time (const char *kernel, const char *variant,
+                          const char *phase, uint64_t microseconds)
+{
+  const char *timing = pocl_get_string_option (COMPILE_TIMING_ENV, "0");
+  FILE *out = stderr;
+
+  if (strcmp (timing, "0") == 0 || strcmp (timing, "") == 0)
+    return;
+
+  /* Any other value than 1 is a file to append the timings to, so the
+     concurrent compilations of all the processes can be collected. */
+  POCL_LOCK (compile_timing_lock);
+  if (strcmp (timing, "1") != 0)
+    out = fopen (timing, "a");
+  if (out != NULL)
+    {
+      fprintf (out, "pocl-compile-time\t%s\t%s\t%s\t%llu\n", 
+               kernel != NULL ? kernel : "-", 
+               variant != NULL ? variant : "-", phase, 
+               (unsigned long long)microseconds);
+      if (out != stderr)
+        fclose (out);
+    }
+  POCL_UNLOCK (compile_timing_lock);
+}
+
 uint32_t
 byteswap_uint32_t (uint32_t word, char should_swap) 
 {
@@ -41,6 +41,48 @@ extern "C" {
 char *pocl_create_temp_dir();
 void remove_directory (const char *path_name);
 
+/* Returns the directory for the kernel compiler files that persist
+ * across program runs (precompiled headers, tuning results).
+ *
+ * The directory is created if it does not exist. The path name
+ * is alive until the exit.
+ */
+const char *pocl_get_cache_dir();
+
+/* Creates the directory and its missing parent directories. 
+ * Returns 0 on success. */
+int pocl_mkdir_p (const char *path_name);
+
+/* Stable 64 bit FNV-1a hash, usable for cache file names. Pass the 
+ * result as the seed to hash several buffers in sequence. */
+#define POCL_HASH_SEED 0xcbf29ce484222325ULL
+uint64_t pocl_hash_buffer (const void *data, size_t len, uint64_t seed);
+
+/* The floating point relaxations allowed by the clBuildProgram options. 
+ * The implied options are included: -cl-fast-relaxed-math implies
+ * -cl-unsafe-math-optimizations and -cl-finite-math-only, which in 
+ * turn imply -cl-mad-enable. */
+#define POCL_FP_MAD_ENABLE        (1 << 0)
+#define POCL_FP_UNSAFE_MATH       (1 << 1)
+#define POCL_FP_FINITE_MATH_ONLY  (1 << 2)
+#define POCL_FP_FAST_RELAXED_MATH (1 << 3)
+unsigned pocl_fp_math_flags (const char *build_options);
+
+/* The wall time of the kernel compiler phases with POCL_COMPILE_TIMING. 
+ *
+ * pocl_compile_timing() returns nonzero if the timings are enabled and 
+ * pocl_wall_time_us() the current time. pocl_report_compile_time() 
+ * writes a line per phase, with tab-separated fields:
+ *
+ *   pocl-compile-time <kernel> <variant> <phase> <microseconds>
+ *
+ * The variant is the directory of the compiler files of the work-group
+ * function, and the kernel is '-' for the program builds. */
+int pocl_compile_timing ();
+uint64_t pocl_wall_time_us ();
+void pocl_report_compile_time (const char *kernel, const char *variant,
+                               const char *phase, uint64_t microseconds);
+
 uint32_t byteswap_uint32_t (uint32_t word, char should_swap);
 float byteswap_float (float word, char should_swap);
 
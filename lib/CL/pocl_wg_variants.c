@@ -0,0 +1,1556 @@
+/* pocl_wg_variants.c: compilation of the work-group function variants
+   of the kernels
+
+   Copyright (c) 2014 pocl developers
+   
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "pocl_wg_variants.h"
+#include "pocl_compiler_pool.h"
+#include "pocl_llvm.h"
+#include "pocl_runtime_config.h"
+#include "pocl_util.h"
+
+#define EAGER_COMPILE_ENV "POCL_EAGER_WG_COMPILE"
+#define DYNAMIC_LOCAL_SIZE_ENV "POCL_DYNAMIC_LOCAL_SIZE"
+#define METHOD_TUNING_ENV "POCL_WORK_GROUP_METHOD_TUNING"
+#define SPECIALIZE_ARGUMENTS_ENV "POCL_SPECIALIZE_ARGUMENTS"
+#define LOCAL_SIZE_TUNING_ENV "POCL_LOCAL_SIZE_TUNING"
+/* The maximum number of variants compiled ahead of time per kernel 
+   and device. */
+#define MAX_EAGER_VARIANTS 8
+/* The launches timed per work-group method, the fastest one counts. */
+#define TUNING_RUNS 3
+/* Replicating larger work-groups takes too long to compile to be worth 
+   measuring. */
+#define MAX_TUNED_REPL_SIZE 64
+/* The variants with specialized arguments compiled per kernel, so the
+   kernels launched with ever changing values are not compiled again and
+   again. */
+#define MAX_SPECIALIZED_VARIANTS 4
+/* The largest local size picked for the launches without one. Larger
+   work-groups only grow the work-item context data. */
+#define MAX_AUTO_LOCAL_SIZE 256
+/* The launch overhead of a work-group in the time of work-items. */
+#define WG_LAUNCH_OVERHEAD 8
+/* How much better a local size has to be to compile a variant for it 
+   when one exists already for a worse one. */
+#define COMPILED_VARIANT_BONUS 1.1
+/* The rounds of work-groups per worker thread worth aiming for. The 
+   groups do not take exactly as long, a few of them per worker even out 
+   the finishing times. */
+#define GROUPS_PER_WORKER 4
+/* The best scoring local sizes measured with POCL_LOCAL_SIZE_TUNING. */
+#define TUNED_LOCAL_SIZES 4
+
+//#define DEBUG_WG_VARIANTS
+
+typedef struct wg_size
+{
+  size_t x, y, z;
+} wg_size;
+
+typedef struct eager_compile_job
+{
+  cl_kernel kernel;
+  cl_device_id device;
+  unsigned num_sizes;
+  wg_size sizes[MAX_EAGER_VARIANTS];
+} eager_compile_job;
+
+/* A specialized variant being compiled in the background while the
+   launches use the dynamic local size variant. */
+typedef struct pending_variant pending_variant;
+struct pending_variant
+{
+  cl_kernel kernel;
+  cl_device_id device;
+  wg_size size;
+  pending_variant *next;
+};
+
+/* The measurements of the work-group methods of a kernel for a local 
+   size, indexed by the POCL_WG_METHOD_*. */
+typedef struct method_tuning method_tuning;
+struct method_tuning
+{
+  cl_kernel kernel;
+  cl_device_id device;
+  wg_size size;
+  unsigned launched[POCL_WG_NUM_METHODS + 1];
+  unsigned measured[POCL_WG_NUM_METHODS + 1];
+  cl_ulong best_time[POCL_WG_NUM_METHODS + 1];
+  /* The fastest method once all of them have been measured. */
+  unsigned winner;
+  method_tuning *next;
+};
+
+/* The measurements of the candidate local sizes of a kernel for a 
+   global size, for POCL_LOCAL_SIZE_TUNING. */
+typedef struct size_tuning size_tuning;
+struct size_tuning
+{
+  cl_kernel kernel;
+  cl_device_id device;
+  wg_size global;
+  unsigned num_sizes;
+  wg_size sizes[TUNED_LOCAL_SIZES];
+  unsigned launched[TUNED_LOCAL_SIZES];
+  unsigned measured[TUNED_LOCAL_SIZES];
+  cl_ulong best_time[TUNED_LOCAL_SIZES];
+  /* The index of the fastest size plus one once all of them have been 
+     measured. */
+  unsigned winner;
+  size_tuning *next;
+};
+
+static const char *wg_method_names[POCL_WG_NUM_METHODS + 1] = 
+  {NULL, "repl", "loops", "loopvec", "hybrid"};
+
+/* Guards the local size history and the method files of this process. */
+static pocl_lock_t wg_history_lock = POCL_LOCK_INITIALIZER;
+
+static pending_variant *pending_variants = NULL;
+static pocl_lock_t pending_variants_lock = POCL_LOCK_INITIALIZER;
+
+static method_tuning *method_tunings = NULL;
+static pocl_lock_t method_tunings_lock = POCL_LOCK_INITIALIZER;
+
+static size_tuning *size_tunings = NULL;
+static pocl_lock_t size_tunings_lock = POCL_LOCK_INITIALIZER;
+
+const char *
+pocl_wg_method_name (unsigned method)
+{
+  if (method == 0 || method > POCL_WG_NUM_METHODS)
+    return NULL;
+  return wg_method_names[method];
+}
+
+/* The work-group method is not set explicitly with 
+   POCL_WORK_GROUP_METHOD. */
+static int
+auto_wg_method ()
+{
+  return strcmp (pocl_get_string_option ("POCL_WORK_GROUP_METHOD", "auto"),
+                 "auto") == 0;
+}
+
+/* Adds the size to the array unless it is there already or the array
+   is full. Returns the new number of sizes. */
+static unsigned
+add_wg_size (wg_size *sizes, unsigned num_sizes, 
+             size_t x, size_t y, size_t z)
+{
+  unsigned i;
+  for (i = 0; i < num_sizes; ++i)
+    {
+      if (sizes[i].x == x && sizes[i].y == y && sizes[i].z == z)
+        return num_sizes;
+    }
+  if (num_sizes == MAX_EAGER_VARIANTS)
+    return num_sizes;
+  sizes[num_sizes].x = x;
+  sizes[num_sizes].y = y;
+  sizes[num_sizes].z = z;
+  return num_sizes + 1;
+}
+
+/* The local sizes launched with and the fastest work-group methods are 
+   recorded in the cache dir in a file per kernel and device, identified 
+   by a hash of the program. */
+static void
+wg_cache_filename (cl_kernel kernel, cl_device_id device, 
+                   const char *dir_name, char *path_name)
+{
+  cl_program program = kernel->program;
+  uint64_t hash = POCL_HASH_SEED;
+
+  if (program->source != NULL)
+    {
+      hash = pocl_hash_buffer (program->source, strlen (program->source), 
+                               hash);
+      if (program->compiler_options != NULL)
+        hash = pocl_hash_buffer (program->compiler_options, 
+                                 strlen (program->compiler_options), hash);
+    }
+  else if (program->binaries != NULL && program->binaries[0] != NULL)
+    hash = pocl_hash_buffer (program->binaries[0], 
+                             program->binary_sizes[0], hash);
+
+  hash = pocl_hash_buffer (kernel->name, strlen (kernel->name) + 1, hash);
+  hash = pocl_hash_buffer (device->short_name, 
+                           strlen (device->short_name), hash);
+
+  snprintf (path_name, POCL_FILENAME_LENGTH, "%s/%s/%016llx",
+            pocl_get_cache_dir (), dir_name, (unsigned long long)hash);
+}
+
+static unsigned
+read_wg_history (const char *path_name, wg_size *sizes, unsigned num_sizes)
+{
+  size_t x, y, z;
+  FILE *history = fopen (path_name, "r");
+  if (history == NULL)
+    return num_sizes;
+  while (fscanf (history, "%zu %zu %zu", &x, &y, &z) == 3)
+    num_sizes = add_wg_size (sizes, num_sizes, x, y, z);
+  fclose (history);
+  return num_sizes;
+}
+
+static void
+record_wg_size (cl_kernel kernel, cl_device_id device, 
+                size_t x, size_t y, size_t z)
+{
+  char path_name[POCL_FILENAME_LENGTH];
+  wg_size sizes[MAX_EAGER_VARIANTS];
+  unsigned num_sizes;
+  FILE *history;
+
+  wg_cache_filename (kernel, device, "wg_sizes", path_name);
+
+  POCL_LOCK (wg_history_lock);
+  num_sizes = read_wg_history (path_name, sizes, 0);
+  if (add_wg_size (sizes, num_sizes, x, y, z) > num_sizes)
+    {
+      *strrchr (path_name, '/') = '\0';
+      pocl_mkdir_p (path_name);
+      path_name[strlen (path_name)] = '/';
+
+      history = fopen (path_name, "a");
+      if (history != NULL)
+        {
+          fprintf (history, "%zu %zu %zu\n", x, y, z);
+          fclose (history);
+        }
+    }
+  POCL_UNLOCK (wg_history_lock);
+}
+
+/* Returns the fastest method recorded for the local size, 0 if none. */
+static unsigned
+read_wg_method (cl_kernel kernel, cl_device_id device, 
+                size_t local_x, size_t local_y, size_t local_z)
+{
+  char path_name[POCL_FILENAME_LENGTH];
+  char name[16];
+  size_t x, y, z;
+  unsigned method, found = 0;
+  FILE *methods;
+
+  wg_cache_filename (kernel, device, "wg_methods", path_name);
+
+  POCL_LOCK (wg_history_lock);
+  methods = fopen (path_name, "r");
+  if (methods != NULL)
+    {
+      /* The latest measurement wins. */
+      while (fscanf (methods, "%zu %zu %zu %15s", &x, &y, &z, name) == 4)
+        {
+          if (x != local_x || y != local_y || z != local_z)
+            continue;
+          for (method = 1; method <= POCL_WG_NUM_METHODS; ++method)
+            {
+              if (strcmp (name, wg_method_names[method]) == 0)
+                found = method;
+            }
+        }
+      fclose (methods);
+    }
+  POCL_UNLOCK (wg_history_lock);
+  return found;
+}
+
+static void
+record_wg_method (cl_kernel kernel, cl_device_id device, 
+                  size_t x, size_t y, size_t z, unsigned method)
+{
+  char path_name[POCL_FILENAME_LENGTH];
+  FILE *methods;
+
+  wg_cache_filename (kernel, device, "wg_methods", path_name);
+
+  POCL_LOCK (wg_history_lock);
+  *strrchr (path_name, '/') = '\0';
+  pocl_mkdir_p (path_name);
+  path_name[strlen (path_name)] = '/';
+
+  methods = fopen (path_name, "a");
+  if (methods != NULL)
+    {
+      fprintf (methods, "%zu %zu %zu %s\n", x, y, z, 
+               wg_method_names[method]);
+      fclose (methods);
+    }
+  POCL_UNLOCK (wg_history_lock);
+}
+
+static int
+is_scalar_argument (cl_kernel kernel, unsigned i)
+{
+  return !kernel->arg_is_pointer[i] && !kernel->arg_is_local[i] &&
+    !kernel->arg_is_image[i] && !kernel->arg_is_sampler[i];
+}
+
+/* Returns non-zero if the scalar arguments have the same values. */
+static int
+same_scalar_arguments (cl_kernel kernel, const struct pocl_argument *a,
+                       const struct pocl_argument *b)
+{
+  unsigned i;
+  for (i = 0; i < kernel->num_args; ++i)
+    {
+      if (!is_scalar_argument (kernel, i))
+        continue;
+      if (a[i].size != b[i].size || 
+          (a[i].value == NULL) != (b[i].value == NULL))
+        return 0;
+      if (a[i].value != NULL && memcmp (a[i].value, b[i].value, a[i].size))
+        return 0;
+    }
+  return 1;
+}
+
+static void
+free_scalar_arguments (cl_kernel kernel, struct pocl_argument *arguments)
+{
+  unsigned i;
+  if (arguments == NULL)
+    return;
+  for (i = 0; i < kernel->num_args; ++i)
+    free (arguments[i].value);
+  free (arguments);
+}
+
+/* Copies the values of the scalar arguments, leaving the others NULL. */
+static struct pocl_argument *
+copy_scalar_arguments (cl_kernel kernel, const struct pocl_argument *src)
+{
+  struct pocl_argument *arguments;
+  unsigned i;
+
+  arguments = (struct pocl_argument*) 
+    calloc (kernel->num_args, sizeof (struct pocl_argument));
+  if (arguments == NULL)
+    return NULL;
+
+  for (i = 0; i < kernel->num_args; ++i)
+    {
+      if (!is_scalar_argument (kernel, i) || src[i].value == NULL)
+        continue;
+      arguments[i].value = malloc (src[i].size);
+      if (arguments[i].value == NULL)
+        {
+          free_scalar_arguments (kernel, arguments);
+          return NULL;
+        }
+      memcpy (arguments[i].value, src[i].value, src[i].size);
+      arguments[i].size = src[i].size;
+    }
+  return arguments;
+}
+
+static uint64_t
+hash_scalar_arguments (cl_kernel kernel, const struct pocl_argument *arguments)
+{
+  uint64_t hash = POCL_HASH_SEED;
+  unsigned i;
+  for (i = 0; i < kernel->num_args; ++i)
+    {
+      if (arguments[i].value != NULL)
+        hash = pocl_hash_buffer (arguments[i].value, arguments[i].size, 
+                                 hash);
+      hash = pocl_hash_buffer (&arguments[i].size, sizeof (size_t), hash);
+    }
+  return hash;
+}
+
+static unsigned
+wg_variant_bucket (cl_device_id device, size_t local_x, size_t local_y,
+                   size_t local_z, unsigned flags)
+{
+  size_t hash = (size_t)device >> 4;
+  hash = hash * 31 + local_x;
+  hash = hash * 31 + local_y;
+  hash = hash * 31 + local_z;
+  hash = hash * 31 + flags;
+  return hash % POCL_WG_VARIANT_BUCKETS;
+}
+
+/* The arguments are compared only for the variants with specialized
+   arguments. */
+static pocl_wg_variant *
+find_wg_variant (cl_kernel kernel, pocl_wg_variant *variant, 
+                 cl_device_id device, size_t local_x, size_t local_y, 
+                 size_t local_z, unsigned flags,
+                 const struct pocl_argument *arguments)
+{
+  for (; variant != NULL; variant = variant->next)
+    {
+      if (variant->device == device && variant->local_x == local_x &&
+          variant->local_y == local_y && variant->local_z == local_z &&
+          variant->flags == flags &&
+          (variant->arguments == NULL || 
+           same_scalar_arguments (kernel, variant->arguments, arguments)))
+        return variant;
+    }
+  return NULL;
+}
+
+/* Generates the parallel.bc of the variant in tmpdir unless it exists
+   already. Called without the wg_variant_lock of the kernel held, the
+   other variants of the kernel can be compiled at the same time. */
+static cl_int
+compile_wg_variant (cl_kernel kernel, cl_device_id device,
+                    size_t local_x, size_t local_y, size_t local_z,
+                    unsigned flags, const struct pocl_argument *arguments,
+                    const char *tmpdir)
+{
+  cl_program program = kernel->program;
+  char kernel_filename[POCL_FILENAME_LENGTH];
+  char parallel_filename[POCL_FILENAME_LENGTH];
+  unsigned method_flags = 0;
+  int error;
+
+  error = snprintf
+    (parallel_filename, POCL_FILENAME_LENGTH,
+     "%s/%s", tmpdir, POCL_PARALLEL_BC_FILENAME);
+  if (error < 0)
+    return CL_OUT_OF_HOST_MEMORY;
+
+  if (access (parallel_filename, F_OK) == 0)
+    return CL_SUCCESS;
+
+  error = snprintf
+    (kernel_filename, POCL_FILENAME_LENGTH,
+     "%s/%s/%s/kernel.bc", program->temp_dir, 
+     device->short_name, kernel->name);
+  if (error < 0)
+    return CL_OUT_OF_HOST_MEMORY;
+
+  mkdir (tmpdir, S_IRWXU);
+
+#if !defined(USE_LLVM_API) || USE_LLVM_API != 1
+  /* The pocl-workgroup script reads the kernel from a file. With the 
+     LLVM API it is parsed directly from the program binary. The file is
+     shared by the variants, the lock keeps the others from reading it
+     while it is being written. */
+  POCL_LOCK (kernel->wg_variant_lock);
+  if (program->llvm_irs[0] == NULL && access (kernel_filename, F_OK) != 0)
+    {
+      size_t n;
+      FILE *kernel_file = fopen (kernel_filename, "w+");
+      if (kernel_file == NULL)
+        {
+          POCL_UNLOCK (kernel->wg_variant_lock);
+          return CL_OUT_OF_HOST_MEMORY;
+        }
+
+      n = fwrite (program->binaries[device->dev_id], 1,
+                  program->binary_sizes[device->dev_id], kernel_file);
+      fclose (kernel_file);
+      if (n < program->binary_sizes[device->dev_id])
+        {
+          remove (kernel_filename);
+          POCL_UNLOCK (kernel->wg_variant_lock);
+          return CL_OUT_OF_HOST_MEMORY;
+        }
+    }
+  POCL_UNLOCK (kernel->wg_variant_lock);
+#else
+  /* Use the method measured the fastest for the local size, unless one
+     is given explicitly. */
+  if ((flags & (POCL_WG_VARIANT_METHOD_MASK | 
+                POCL_WG_VARIANT_DYNAMIC_LOCAL_SIZE)) == 0 &&
+      auto_wg_method ())
+    method_flags = POCL_WG_VARIANT_METHOD 
+      (read_wg_method (kernel, device, local_x, local_y, local_z));
+#endif
+
+  error = call_pocl_workgroup (device, kernel, local_x, local_y, local_z,
+                               flags | method_flags, arguments, 
+                               parallel_filename, kernel_filename);
+  if (error)
+    return error;
+
+#ifdef DEBUG_WG_VARIANTS
+  printf ("### compiled %s for %zu x %zu x %zu flags %x\n", kernel->name, 
+          local_x, local_y, local_z, flags);
+#endif
+
+  if (flags == 0 && pocl_get_bool_option (EAGER_COMPILE_ENV, 0))
+    record_wg_size (kernel, device, local_x, local_y, local_z);
+
+  return CL_SUCCESS;
+}
+
+/* Returns the variant if it has been compiled already. */
+static pocl_wg_variant *
+lookup_wg_variant (cl_kernel kernel, cl_device_id device,
+                   size_t local_x, size_t local_y, size_t local_z,
+                   unsigned flags, const struct pocl_argument *arguments)
+{
+  unsigned bucket = 
+    wg_variant_bucket (device, local_x, local_y, local_z, flags);
+  pocl_wg_variant *variant = find_wg_variant 
+    (kernel, __atomic_load_n (&kernel->wg_variants[bucket], __ATOMIC_ACQUIRE),
+     device, local_x, local_y, local_z, flags, arguments);
+  if (variant == NULL || !pocl_wg_variant_is_compiled (variant))
+    return NULL;
+  return variant;
+}
+
+/* Creates the entry of a variant to be compiled in tmpdir. */
+static pocl_wg_variant *
+create_wg_variant (cl_kernel kernel, cl_device_id device,
+                   size_t local_x, size_t local_y, size_t local_z,
+                   unsigned flags, const struct pocl_argument *arguments,
+                   const char *tmpdir)
+{
+  pocl_wg_variant *variant = 
+    (pocl_wg_variant*) malloc (sizeof (pocl_wg_variant));
+  if (variant == NULL)
+    return NULL;
+  variant->device = device;
+  variant->local_x = local_x;
+  variant->local_y = local_y;
+  variant->local_z = local_z;
+  variant->flags = flags;
+  variant->arguments = NULL;
+  variant->tmp_dir = strdup (tmpdir);
+  if (variant->tmp_dir == NULL)
+    {
+      free (variant);
+      return NULL;
+    }
+  if (flags & POCL_WG_VARIANT_SPECIALIZED_ARGS)
+    {
+      variant->arguments = copy_scalar_arguments (kernel, arguments);
+      if (variant->arguments == NULL)
+        {
+          free (variant->tmp_dir);
+          free (variant);
+          return NULL;
+        }
+    }
+  variant->wg = NULL;
+  variant->status = POCL_WG_VARIANT_COMPILING;
+  variant->error = CL_SUCCESS;
+  pthread_cond_init (&variant->compiled, NULL);
+  variant->next = NULL;
+  return variant;
+}
+
+/* pocl_get_wg_variant() with the argument values of a variant with
+   POCL_WG_VARIANT_SPECIALIZED_ARGS. */
+static pocl_wg_variant *
+get_wg_variant (cl_kernel kernel, cl_device_id device,
+                size_t local_x, size_t local_y, size_t local_z,
+                unsigned flags, const struct pocl_argument *arguments,
+                cl_int *errcode)
+{
+  unsigned bucket = 
+    wg_variant_bucket (device, local_x, local_y, local_z, flags);
+  pocl_wg_variant *variant;
+  char tmpdir[POCL_FILENAME_LENGTH];
+  cl_int error;
+
+  /* The variants are published complete and never modified afterwards
+     (except for wg and status), so the lookup needs no locking. */
+  variant = lookup_wg_variant (kernel, device, local_x, local_y, local_z, 
+                               flags, arguments);
+  if (variant != NULL)
+    return variant;
+
+  POCL_LOCK (kernel->wg_variant_lock);
+  variant = find_wg_variant (kernel, kernel->wg_variants[bucket], device, 
+                             local_x, local_y, local_z, flags, arguments);
+  if (variant != NULL && variant->status == POCL_WG_VARIANT_COMPILING)
+    {
+      /* Being compiled by another thread, wait for it instead of 
+         compiling it again. */
+      while (variant->status == POCL_WG_VARIANT_COMPILING)
+        pthread_cond_wait (&variant->compiled, &kernel->wg_variant_lock);
+      error = variant->error;
+      POCL_UNLOCK (kernel->wg_variant_lock);
+      if (error == CL_SUCCESS)
+        return variant;
+      goto ERROR;
+    }
+  if (variant != NULL && variant->status == POCL_WG_VARIANT_COMPILED)
+    {
+      POCL_UNLOCK (kernel->wg_variant_lock);
+      return variant;
+    }
+
+  if (variant != NULL)
+    /* An earlier compilation failed, try again. */
+    __atomic_store_n (&variant->status, POCL_WG_VARIANT_COMPILING,
+                      __ATOMIC_RELAXED);
+  else
+    {
+      if (flags == 0)
+        snprintf (tmpdir, POCL_FILENAME_LENGTH, "%s/%s/%s/%zu-%zu-%zu", 
+                  kernel->program->temp_dir, device->short_name, 
+                  kernel->name, local_x, local_y, local_z);
+      else if (flags & POCL_WG_VARIANT_SPECIALIZED_ARGS)
+        /* The program dir can be reused from the cache by the later runs,
+           thus the dir is identified by the argument values. */
+        snprintf (tmpdir, POCL_FILENAME_LENGTH, 
+                  "%s/%s/%s/%zu-%zu-%zu.%x.%016llx", 
+                  kernel->program->temp_dir, device->short_name, 
+                  kernel->name, local_x, local_y, local_z, flags,
+                  (unsigned long long)hash_scalar_arguments (kernel, 
+                                                             arguments));
+      else
+        snprintf (tmpdir, POCL_FILENAME_LENGTH, "%s/%s/%s/%zu-%zu-%zu.%x", 
+                  kernel->program->temp_dir, device->short_name, 
+                  kernel->name, local_x, local_y, local_z, flags);
+
+      variant = create_wg_variant (kernel, device, local_x, local_y, local_z,
+                                   flags, arguments, tmpdir);
+      if (variant == NULL)
+        {
+          POCL_UNLOCK (kernel->wg_variant_lock);
+          error = CL_OUT_OF_HOST_MEMORY;
+          goto ERROR;
+        }
+      variant->next = kernel->wg_variants[bucket];
+      __atomic_store_n (&kernel->wg_variants[bucket], variant, 
+                        __ATOMIC_RELEASE);
+    }
+  POCL_UNLOCK (kernel->wg_variant_lock);
+
+  error = compile_wg_variant (kernel, device, local_x, local_y, local_z,
+                              flags, arguments, variant->tmp_dir);
+
+  POCL_LOCK (kernel->wg_variant_lock);
+  variant->error = error;
+  __atomic_store_n (&variant->status, 
+                    error == CL_SUCCESS ? 
+                    POCL_WG_VARIANT_COMPILED : POCL_WG_VARIANT_FAILED,
+                    __ATOMIC_RELEASE);
+  pthread_cond_broadcast (&variant->compiled);
+  POCL_UNLOCK (kernel->wg_variant_lock);
+
+  if (error != CL_SUCCESS)
+    goto ERROR;
+  return variant;
+
+ERROR:
+  if (errcode != NULL)
+    *errcode = error;
+  return NULL;
+}
+
+pocl_wg_variant *
+pocl_get_wg_variant (cl_kernel kernel, cl_device_id device,
+                     size_t local_x, size_t local_y, size_t local_z,
+                     unsigned flags, cl_int *errcode)
+{
+  return get_wg_variant (kernel, device, local_x, local_y, local_z, flags,
+                         NULL, errcode);
+}
+
+/* Returns the variant specialized for the current values of the scalar
+   arguments, compiling it once the kernel has been launched with them
+   the given number of times in a row. Returns NULL in case the generic 
+   variants should be used. */
+static pocl_wg_variant *
+select_specialized_wg_variant (cl_kernel kernel, cl_device_id device,
+                               size_t local_x, size_t local_y, 
+                               size_t local_z, unsigned launches)
+{
+  const struct pocl_argument *arguments = kernel->dyn_arguments;
+  pocl_wg_variant *variant;
+  unsigned i;
+
+  for (i = 0; i < kernel->num_args && !is_scalar_argument (kernel, i); ++i)
+    ;
+  if (i == kernel->num_args)
+    return NULL;
+
+  /* The check of the argument values guarding the specialized variant. */
+  variant = lookup_wg_variant (kernel, device, local_x, local_y, local_z,
+                               POCL_WG_VARIANT_SPECIALIZED_ARGS, arguments);
+  if (variant != NULL)
+    return variant;
+
+  if (kernel->spec_arguments != NULL &&
+      same_scalar_arguments (kernel, kernel->spec_arguments, arguments))
+    ++kernel->spec_launches;
+  else
+    {
+      free_scalar_arguments (kernel, kernel->spec_arguments);
+      kernel->spec_arguments = copy_scalar_arguments (kernel, arguments);
+      kernel->spec_launches = 1;
+    }
+
+  if (kernel->spec_arguments == NULL || kernel->spec_launches < launches ||
+      kernel->num_specialized_variants >= MAX_SPECIALIZED_VARIANTS)
+    return NULL;
+
+  kernel->spec_launches = 0;
+  variant = get_wg_variant (kernel, device, local_x, local_y, local_z,
+                            POCL_WG_VARIANT_SPECIALIZED_ARGS, 
+                            kernel->spec_arguments, NULL);
+  if (variant != NULL)
+    ++kernel->num_specialized_variants;
+  return variant;
+}
+
+static void
+compile_pending_variant (void *data)
+{
+  pending_variant *pending = (pending_variant*)data;
+  pending_variant **p;
+  pocl_wg_variant *variant;
+
+  variant = pocl_get_wg_variant (pending->kernel, pending->device, 
+                                 pending->size.x, pending->size.y, 
+                                 pending->size.z, 0, NULL);
+  if (variant != NULL)
+    pending->device->ops->compile_kernel (pending->kernel, variant);
+
+  POCL_LOCK (pending_variants_lock);
+  for (p = &pending_variants; *p != pending; p = &(*p)->next)
+    ;
+  *p = pending->next;
+  POCL_UNLOCK (pending_variants_lock);
+
+  POname(clReleaseKernel) (pending->kernel);
+  free (pending);
+}
+
+/* Returns the measured method with the shortest time, the loops if none
+   have been measured yet. Called with the method_tunings_lock held. */
+static unsigned
+fastest_wg_method (method_tuning *tuning)
+{
+  unsigned method, fastest = POCL_WG_METHOD_LOOPS;
+  cl_ulong best_time = CL_ULONG_MAX;
+
+  for (method = 1; method <= POCL_WG_NUM_METHODS; ++method)
+    {
+      if (tuning->measured[method] > 0 && 
+          tuning->best_time[method] < best_time)
+        {
+          fastest = method;
+          best_time = tuning->best_time[method];
+        }
+    }
+  return fastest;
+}
+
+static method_tuning *
+find_method_tuning (cl_kernel kernel, cl_device_id device,
+                    size_t local_x, size_t local_y, size_t local_z)
+{
+  method_tuning *tuning;
+  for (tuning = method_tunings; tuning != NULL; tuning = tuning->next)
+    {
+      if (tuning->kernel == kernel && tuning->device == device &&
+          tuning->size.x == local_x && tuning->size.y == local_y &&
+          tuning->size.z == local_z)
+        return tuning;
+    }
+  return NULL;
+}
+
+/* Excludes a method from the measurements. Called with the 
+   method_tunings_lock held. */
+static void
+skip_wg_method (method_tuning *tuning, unsigned method)
+{
+  tuning->launched[method] = TUNING_RUNS;
+  tuning->measured[method] = TUNING_RUNS;
+  tuning->best_time[method] = CL_ULONG_MAX;
+}
+
+/* Returns the variant of the next work-group method to measure for the
+   local size, or of the fastest method once all have been launched. */
+static pocl_wg_variant *
+select_tuned_wg_variant (cl_kernel kernel, cl_device_id device,
+                         size_t local_x, size_t local_y, size_t local_z,
+                         cl_int *errcode)
+{
+  method_tuning *tuning;
+  pocl_wg_variant *variant;
+  unsigned method, m;
+
+  POCL_LOCK (method_tunings_lock);
+  tuning = find_method_tuning (kernel, device, local_x, local_y, local_z);
+  if (tuning == NULL)
+    {
+      tuning = (method_tuning*) calloc (1, sizeof (method_tuning));
+      if (tuning == NULL)
+        {
+          POCL_UNLOCK (method_tunings_lock);
+          return pocl_get_wg_variant (kernel, device, local_x, local_y, 
+                                      local_z, 0, errcode);
+        }
+      tuning->kernel = kernel;
+      tuning->device = device;
+      tuning->size.x = local_x;
+      tuning->size.y = local_y;
+      tuning->size.z = local_z;
+      if (local_x * local_y * local_z > MAX_TUNED_REPL_SIZE)
+        skip_wg_method (tuning, POCL_WG_METHOD_REPL);
+      tuning->next = method_tunings;
+      method_tunings = tuning;
+    }
+
+  method = tuning->winner;
+  for (m = 1; method == 0 && m <= POCL_WG_NUM_METHODS; ++m)
+    {
+      if (tuning->launched[m] < TUNING_RUNS)
+        {
+          method = m;
+          ++tuning->launched[m];
+        }
+    }
+  /* The last measurements are still running. */
+  if (method == 0)
+    method = fastest_wg_method (tuning);
+  POCL_UNLOCK (method_tunings_lock);
+
+  variant = pocl_get_wg_variant (kernel, device, local_x, local_y, local_z,
+                                 POCL_WG_VARIANT_METHOD (method), NULL);
+  if (variant == NULL)
+    {
+      POCL_LOCK (method_tunings_lock);
+      skip_wg_method (tuning, method);
+      POCL_UNLOCK (method_tunings_lock);
+      return pocl_get_wg_variant (kernel, device, local_x, local_y, local_z,
+                                  0, errcode);
+    }
+
+  /* Generate the code now so it is not included in the measurement. */
+  device->ops->compile_kernel (kernel, variant);
+  return variant;
+}
+
+void
+pocl_record_wg_variant_time (cl_kernel kernel, pocl_wg_variant *variant,
+                             cl_ulong nanoseconds)
+{
+  unsigned method = POCL_WG_VARIANT_GET_METHOD (variant->flags);
+  unsigned winner = 0, m;
+  method_tuning *tuning;
+
+  POCL_LOCK (method_tunings_lock);
+  tuning = find_method_tuning (kernel, variant->device, variant->local_x,
+                               variant->local_y, variant->local_z);
+  if (tuning != NULL && tuning->winner == 0 && 
+      tuning->measured[method] < TUNING_RUNS)
+    {
+      if (tuning->measured[method] == 0 || 
+          nanoseconds < tuning->best_time[method])
+        tuning->best_time[method] = nanoseconds;
+      ++tuning->measured[method];
+
+      for (m = 1; m <= POCL_WG_NUM_METHODS; ++m)
+        {
+          if (tuning->measured[m] < TUNING_RUNS)
+            break;
+        }
+      if (m > POCL_WG_NUM_METHODS)
+        winner = tuning->winner = fastest_wg_method (tuning);
+    }
+  POCL_UNLOCK (method_tunings_lock);
+
+#ifdef DEBUG_WG_VARIANTS
+  printf ("### %s with %s took %llu ns\n", kernel->name, 
+          wg_method_names[method], (unsigned long long)nanoseconds);
+#endif
+
+  if (winner != 0)
+    record_wg_method (kernel, variant->device, variant->local_x, 
+                      variant->local_y, variant->local_z, winner);
+}
+
+pocl_wg_variant *
+pocl_select_wg_variant (cl_kernel kernel, cl_device_id device,
+                        size_t local_x, size_t local_y, size_t local_z,
+                        cl_int *errcode)
+{
+  pocl_wg_variant *variant;
+  pending_variant *pending;
+  unsigned spec_launches;
+  int submit = 0;
+
+#if !defined(USE_LLVM_API) || USE_LLVM_API != 1
+  /* The pocl-workgroup script cannot generate the dynamic variants. */
+  return pocl_get_wg_variant (kernel, device, local_x, local_y, local_z,
+                              0, errcode);
+#endif
+
+  spec_launches = pocl_get_int_option (SPECIALIZE_ARGUMENTS_ENV, 0);
+  if (spec_launches > 0)
+    {
+      variant = select_specialized_wg_variant (kernel, device, local_x, 
+                                               local_y, local_z, 
+                                               spec_launches);
+      if (variant != NULL)
+        return variant;
+    }
+
+  /* The code generation of the measured variants needs the device too. */
+  if (pocl_get_bool_option (METHOD_TUNING_ENV, 0) && auto_wg_method () &&
+      device->ops->compile_kernel != NULL &&
+      device->ops->get_timer_value != NULL &&
+      local_x * local_y * local_z > 1)
+    return select_tuned_wg_variant (kernel, device, local_x, local_y, 
+                                    local_z, errcode);
+
+  /* The background compilation needs the device to generate the code 
+     for the variant. With a reqd_work_group_size there is only one 
+     local size to compile for anyway. */
+  if (!pocl_get_bool_option (DYNAMIC_LOCAL_SIZE_ENV, 0) ||
+      device->ops->compile_kernel == NULL ||
+      (kernel->reqd_wg_size != NULL && kernel->reqd_wg_size[0] > 0) ||
+      local_x * local_y * local_z == 1)
+    return pocl_get_wg_variant (kernel, device, local_x, local_y, local_z,
+                                0, errcode);
+
+  variant = lookup_wg_variant (kernel, device, local_x, local_y, local_z, 0,
+                               NULL);
+  if (variant != NULL)
+    return variant;
+
+  variant = pocl_get_wg_variant (kernel, device, 0, 0, 0, 
+                                 POCL_WG_VARIANT_DYNAMIC_LOCAL_SIZE, NULL);
+  if (variant == NULL)
+    return pocl_get_wg_variant (kernel, device, local_x, local_y, local_z,
+                                0, errcode);
+
+  POCL_LOCK (pending_variants_lock);
+  for (pending = pending_variants; pending != NULL; pending = pending->next)
+    {
+      if (pending->kernel == kernel && pending->device == device &&
+          pending->size.x == local_x && pending->size.y == local_y &&
+          pending->size.z == local_z)
+        break;
+    }
+  if (pending == NULL)
+    {
+      pending = (pending_variant*) malloc (sizeof (pending_variant));
+      if (pending != NULL)
+        {
+          pending->kernel = kernel;
+          pending->device = device;
+          pending->size.x = local_x;
+          pending->size.y = local_y;
+          pending->size.z = local_z;
+          pending->next = pending_variants;
+          pending_variants = pending;
+          submit = 1;
+        }
+    }
+  POCL_UNLOCK (pending_variants_lock);
+
+  if (submit)
+    {
+      POname(clRetainKernel) (kernel);
+      pocl_compiler_submit (NULL, compile_pending_variant, pending);
+    }
+
+  return variant;
+}
+
+/* Appends the divisors of the global size up to the maximum local size. */
+static unsigned
+local_size_divisors (size_t global_size, size_t max_size, size_t *divisors)
+{
+  unsigned n = 0;
+  size_t d;
+  for (d = 1; d <= max_size && d <= global_size; ++d)
+    {
+      if (global_size % d == 0)
+        divisors[n++] = d;
+    }
+  return n;
+}
+
+/* Estimates the share of the peak throughput a local size reaches. */
+static double
+local_size_score (cl_device_id device, const wg_size *global, 
+                  const wg_size *local)
+{
+  size_t workers = device->max_compute_units > 0 ? 
+    device->max_compute_units : 1;
+  size_t multiple = device->preferred_wg_size_multiple > 0 ? 
+    device->preferred_wg_size_multiple : 1;
+  size_t wg_size = local->x * local->y * local->z;
+  size_t groups_x = global->x / local->x;
+  size_t groups_yz = (global->y / local->y) * (global->z / local->z);
+  /* The pthread driver splits the x dimension of the groups to its
+     threads, the others run in a loop in each of them. The y and z
+     groups thus do not change the balance, but each worker runs all of
+     them for each of its x groups. */
+  size_t rounds_x = (groups_x + workers - 1) / workers;
+  size_t groups_per_worker = rounds_x * groups_yz;
+  double balance = (double)groups_x / (rounds_x * workers);
+  double finish = (double)min (groups_per_worker, GROUPS_PER_WORKER) / 
+    (min (groups_per_worker, GROUPS_PER_WORKER) + 0.25);
+  double overhead = (double)wg_size / (wg_size + WG_LAUNCH_OVERHEAD);
+  /* The work-item loops are vectorized in the x dimension. */
+  double lanes = (double)local->x / 
+    (((local->x + multiple - 1) / multiple) * multiple);
+  return balance * finish * overhead * lanes;
+}
+
+/* Returns nonzero if the local size a is a better pick than b with the 
+   same score: the wider and then the larger groups as the x dimension is
+   the one vectorized, and the y dimension over the z for the locality. */
+static int
+preferred_local_size (const wg_size *a, const wg_size *b)
+{
+  size_t size_a = a->x * a->y * a->z, size_b = b->x * b->y * b->z;
+  if (a->x != b->x)
+    return a->x > b->x;
+  if (size_a != size_b)
+    return size_a > size_b;
+  return a->y > b->y;
+}
+
+/* Fills in the best scoring local sizes for the global size, the best 
+   one first, and returns their number. */
+static unsigned
+rank_local_sizes (cl_kernel kernel, cl_device_id device,
+                  size_t global_x, size_t global_y, size_t global_z,
+                  wg_size *sizes, unsigned max_sizes)
+{
+  size_t max_size = device->max_work_group_size;
+  size_t div_x[MAX_AUTO_LOCAL_SIZE], div_y[MAX_AUTO_LOCAL_SIZE];
+  size_t div_z[MAX_AUTO_LOCAL_SIZE];
+  double scores[TUNED_LOCAL_SIZES];
+  unsigned num_x, num_y, num_z, num_sizes = 0, i, j, k, n;
+  wg_size size, global;
+
+  assert (max_sizes > 0 && max_sizes <= TUNED_LOCAL_SIZES);
+
+  global.x = global_x;
+  global.y = global_y;
+  global.z = global_z;
+
+  if (max_size > MAX_AUTO_LOCAL_SIZE)
+    max_size = MAX_AUTO_LOCAL_SIZE;
+  num_x = local_size_divisors 
+    (global_x, min (max_size, device->max_work_item_sizes[0]), div_x);
+  num_y = local_size_divisors 
+    (global_y, min (max_size, device->max_work_item_sizes[1]), div_y);
+  num_z = local_size_divisors 
+    (global_z, min (max_size, device->max_work_item_sizes[2]), div_z);
+
+  for (i = 0; i < num_x; ++i)
+    for (j = 0; j < num_y && div_x[i] * div_y[j] <= max_size; ++j)
+      for (k = 0; k < num_z && 
+             div_x[i] * div_y[j] * div_z[k] <= max_size; ++k)
+        {
+          double score;
+          size.x = div_x[i];
+          size.y = div_y[j];
+          size.z = div_z[k];
+          score = local_size_score (device, &global, &size);
+          /* A new local size costs a compilation of its variant. */
+          if (lookup_wg_variant (kernel, device, size.x, size.y, size.z, 
+                                 0, NULL) != NULL)
+            score *= COMPILED_VARIANT_BONUS;
+
+          for (n = num_sizes; n > 0; --n)
+            {
+              if (score < scores[n - 1] ||
+                  (score == scores[n - 1] && 
+                   !preferred_local_size (&size, &sizes[n - 1])))
+                break;
+            }
+          if (n == max_sizes)
+            continue;
+          if (num_sizes < max_sizes)
+            ++num_sizes;
+          memmove (&sizes[n + 1], &sizes[n], 
+                   (num_sizes - 1 - n) * sizeof (wg_size));
+          memmove (&scores[n + 1], &scores[n], 
+                   (num_sizes - 1 - n) * sizeof (double));
+          sizes[n] = size;
+          scores[n] = score;
+        }
+  return num_sizes;
+}
+
+/* The tuned local sizes are recorded per power of two class of the 
+   global size, as the exact global size often varies from run to run. */
+static unsigned
+global_size_class (size_t global_size)
+{
+  unsigned size_class = 0;
+  while (((size_t)1 << size_class) < global_size)
+    ++size_class;
+  return size_class;
+}
+
+/* Reads the local size tuned for the class of the global size in the
+   earlier runs, if it fits this global size too. */
+static int
+read_tuned_local_size (cl_kernel kernel, cl_device_id device,
+                       size_t global_x, size_t global_y, size_t global_z,
+                       wg_size *local)
+{
+  char path_name[POCL_FILENAME_LENGTH];
+  unsigned class_x, class_y, class_z;
+  size_t x, y, z;
+  int found = 0;
+  FILE *sizes;
+
+  wg_cache_filename (kernel, device, "wg_local_sizes", path_name);
+
+  POCL_LOCK (wg_history_lock);
+  sizes = fopen (path_name, "r");
+  if (sizes != NULL)
+    {
+      /* The latest measurement wins. */
+      while (fscanf (sizes, "%u %u %u %zu %zu %zu", &class_x, &class_y, 
+                     &class_z, &x, &y, &z) == 6)
+        {
+          if (class_x != global_size_class (global_x) ||
+              class_y != global_size_class (global_y) ||
+              class_z != global_size_class (global_z) ||
+              x == 0 || y == 0 || z == 0 ||
+              global_x % x != 0 || global_y % y != 0 || global_z % z != 0 ||
+              x > device->max_work_item_sizes[0] ||
+              y > device->max_work_item_sizes[1] ||
+              z > device->max_work_item_sizes[2] ||
+              x * y * z > device->max_work_group_size)
+            continue;
+          local->x = x;
+          local->y = y;
+          local->z = z;
+          found = 1;
+        }
+      fclose (sizes);
+    }
+  POCL_UNLOCK (wg_history_lock);
+  return found;
+}
+
+static void
+record_tuned_local_size (cl_kernel kernel, cl_device_id device, 
+                         const wg_size *global, const wg_size *local)
+{
+  char path_name[POCL_FILENAME_LENGTH];
+  FILE *sizes;
+
+  wg_cache_filename (kernel, device, "wg_local_sizes", path_name);
+
+  POCL_LOCK (wg_history_lock);
+  *strrchr (path_name, '/') = '\0';
+  pocl_mkdir_p (path_name);
+  path_name[strlen (path_name)] = '/';
+
+  sizes = fopen (path_name, "a");
+  if (sizes != NULL)
+    {
+      fprintf (sizes, "%u %u %u %zu %zu %zu\n", 
+               global_size_class (global->x), global_size_class (global->y),
+               global_size_class (global->z), local->x, local->y, local->z);
+      fclose (sizes);
+    }
+  POCL_UNLOCK (wg_history_lock);
+}
+
+static unsigned
+fastest_local_size (size_tuning *tuning)
+{
+  unsigned i, fastest = 0;
+  cl_ulong best_time = CL_ULONG_MAX;
+
+  for (i = 0; i < tuning->num_sizes; ++i)
+    {
+      if (tuning->measured[i] > 0 && tuning->best_time[i] < best_time)
+        {
+          fastest = i;
+          best_time = tuning->best_time[i];
+        }
+    }
+  return fastest;
+}
+
+static size_tuning *
+find_size_tuning (cl_kernel kernel, cl_device_id device,
+                  size_t global_x, size_t global_y, size_t global_z)
+{
+  size_tuning *tuning;
+  for (tuning = size_tunings; tuning != NULL; tuning = tuning->next)
+    {
+      if (tuning->kernel == kernel && tuning->device == device &&
+          tuning->global.x == global_x && tuning->global.y == global_y &&
+          tuning->global.z == global_z)
+        return tuning;
+    }
+  return NULL;
+}
+
+/* Sets the next candidate local size to measure for the global size, or 
+   the fastest one once all have been launched. Returns nonzero once the 
+   local size is final: tuned in this or in an earlier run. */
+static int
+select_tuned_local_size (cl_kernel kernel, cl_device_id device,
+                         size_t global_x, size_t global_y, size_t global_z,
+                         wg_size *local, int *timed)
+{
+  size_tuning *tuning, *created;
+  unsigned i;
+
+  POCL_LOCK (size_tunings_lock);
+  tuning = find_size_tuning (kernel, device, global_x, global_y, global_z);
+  POCL_UNLOCK (size_tunings_lock);
+
+  if (tuning == NULL)
+    {
+      if (read_tuned_local_size (kernel, device, global_x, global_y, 
+                                 global_z, local))
+        return 1;
+
+      created = (size_tuning*) calloc (1, sizeof (size_tuning));
+      if (created == NULL)
+        {
+          rank_local_sizes (kernel, device, global_x, global_y, global_z, 
+                            local, 1);
+          return 1;
+        }
+      created->kernel = kernel;
+      created->device = device;
+      created->global.x = global_x;
+      created->global.y = global_y;
+      created->global.z = global_z;
+      created->num_sizes = 
+        rank_local_sizes (kernel, device, global_x, global_y, global_z, 
+                          created->sizes, TUNED_LOCAL_SIZES);
+      /* Nothing to choose from. */
+      if (created->num_sizes == 1)
+        created->winner = 1;
+
+      POCL_LOCK (size_tunings_lock);
+      tuning = find_size_tuning (kernel, device, global_x, global_y, 
+                                 global_z);
+      if (tuning == NULL)
+        {
+          created->next = size_tunings;
+          size_tunings = tuning = created;
+          created = NULL;
+        }
+      POCL_UNLOCK (size_tunings_lock);
+      free (created);
+    }
+
+  POCL_LOCK (size_tunings_lock);
+  if (tuning->winner != 0)
+    {
+      *local = tuning->sizes[tuning->winner - 1];
+      POCL_UNLOCK (size_tunings_lock);
+      return 1;
+    }
+  for (i = 0; i < tuning->num_sizes; ++i)
+    {
+      if (tuning->launched[i] < TUNING_RUNS)
+        {
+          ++tuning->launched[i];
+          *local = tuning->sizes[i];
+          *timed = 1;
+          POCL_UNLOCK (size_tunings_lock);
+          return 0;
+        }
+    }
+  /* The last measurements are still running. */
+  *local = tuning->sizes[fastest_local_size (tuning)];
+  POCL_UNLOCK (size_tunings_lock);
+  return 0;
+}
+
+int
+pocl_select_local_size (cl_kernel kernel, cl_device_id device,
+                        size_t global_x, size_t global_y, size_t global_z,
+                        size_t *local_x, size_t *local_y, size_t *local_z)
+{
+  /* The fallback if no local size divides the global size. */
+  wg_size local = {1, 1, 1};
+  int timed = 0, final = 1, cached = 0;
+
+  if (kernel->reqd_wg_size != NULL && kernel->reqd_wg_size[0] > 0 &&
+      kernel->reqd_wg_size[1] > 0 && kernel->reqd_wg_size[2] > 0)
+    {
+      *local_x = kernel->reqd_wg_size[0];
+      *local_y = kernel->reqd_wg_size[1];
+      *local_z = kernel->reqd_wg_size[2];
+      return 0;
+    }
+
+  /* The same global size is usually launched over and over again. */
+  POCL_LOCK_OBJ (kernel);
+  if (kernel->auto_local_device == device &&
+      kernel->auto_global_size[0] == global_x &&
+      kernel->auto_global_size[1] == global_y &&
+      kernel->auto_global_size[2] == global_z)
+    {
+      *local_x = kernel->auto_local_size[0];
+      *local_y = kernel->auto_local_size[1];
+      *local_z = kernel->auto_local_size[2];
+      cached = 1;
+    }
+  POCL_UNLOCK_OBJ (kernel);
+  if (cached)
+    return 0;
+
+  if (pocl_get_bool_option (LOCAL_SIZE_TUNING_ENV, 0) &&
+      device->ops->get_timer_value != NULL)
+    final = select_tuned_local_size (kernel, device, global_x, global_y, 
+                                     global_z, &local, &timed);
+  else
+    rank_local_sizes (kernel, device, global_x, global_y, global_z, 
+                      &local, 1);
+
+  *local_x = local.x;
+  *local_y = local.y;
+  *local_z = local.z;
+
+#ifdef DEBUG_WG_VARIANTS
+  printf ("### picked local size %zu-%zu-%zu for %zu-%zu-%zu of %s\n", 
+          *local_x, *local_y, *local_z, global_x, global_y, global_z, 
+          kernel->name);
+#endif
+
+  if (final)
+    {
+      POCL_LOCK_OBJ (kernel);
+      kernel->auto_local_device = device;
+      kernel->auto_global_size[0] = global_x;
+      kernel->auto_global_size[1] = global_y;
+      kernel->auto_global_size[2] = global_z;
+      kernel->auto_local_size[0] = *local_x;
+      kernel->auto_local_size[1] = *local_y;
+      kernel->auto_local_size[2] = *local_z;
+      POCL_UNLOCK_OBJ (kernel);
+    }
+  return timed;
+}
+
+void
+pocl_record_local_size_time (cl_kernel kernel, cl_device_id device,
+                             const struct pocl_context *pc,
+                             cl_ulong nanoseconds)
+{
+  size_tuning *tuning;
+  wg_size global, winner;
+  unsigned i, n;
+  int decided = 0;
+
+  global.x = pc->num_groups[0] * pc->local_size[0];
+  global.y = pc->num_groups[1] * pc->local_size[1];
+  global.z = pc->num_groups[2] * pc->local_size[2];
+
+  POCL_LOCK (size_tunings_lock);
+  tuning = find_size_tuning (kernel, device, global.x, global.y, global.z);
+  for (i = 0; tuning != NULL && i < tuning->num_sizes; ++i)
+    {
+      if (tuning->sizes[i].x == pc->local_size[0] &&
+          tuning->sizes[i].y == pc->local_size[1] &&
+          tuning->sizes[i].z == pc->local_size[2])
+        break;
+    }
+  if (tuning != NULL && tuning->winner == 0 && i < tuning->num_sizes &&
+      tuning->measured[i] < TUNING_RUNS)
+    {
+      /* The best of the runs counts, the first one also loads the 
+         variant. */
+      if (tuning->measured[i] == 0 || nanoseconds < tuning->best_time[i])
+        tuning->best_time[i] = nanoseconds;
+      ++tuning->measured[i];
+
+      for (n = 0; n < tuning->num_sizes; ++n)
+        {
+          if (tuning->measured[n] < TUNING_RUNS)
+            break;
+        }
+      if (n == tuning->num_sizes)
+        {
+          tuning->winner = fastest_local_size (tuning) + 1;
+          winner = tuning->sizes[tuning->winner - 1];
+          decided = 1;
+        }
+    }
+  POCL_UNLOCK (size_tunings_lock);
+
+#ifdef DEBUG_WG_VARIANTS
+  printf ("### %s with local size %zu-%zu-%zu took %llu ns\n", kernel->name, 
+          pc->local_size[0], pc->local_size[1], pc->local_size[2],
+          (unsigned long long)nanoseconds);
+#endif
+
+  if (decided)
+    record_tuned_local_size (kernel, device, &global, &winner);
+}
+
+void
+pocl_free_wg_variants (cl_kernel kernel)
+{
+  pocl_wg_variant *variant, *next;
+  method_tuning **tuning, *released;
+  size_tuning **sizes, *released_sizes;
+  unsigned bucket;
+
+  for (bucket = 0; bucket < POCL_WG_VARIANT_BUCKETS; ++bucket)
+    {
+      for (variant = kernel->wg_variants[bucket]; variant != NULL; 
+           variant = next)
+        {
+          next = variant->next;
+          free_scalar_arguments (kernel, variant->arguments);
+          free (variant->tmp_dir);
+          pthread_cond_destroy (&variant->compiled);
+          free (variant);
+        }
+      kernel->wg_variants[bucket] = NULL;
+    }
+  free_scalar_arguments (kernel, kernel->spec_arguments);
+  kernel->spec_arguments = NULL;
+
+  POCL_LOCK (method_tunings_lock);
+  for (tuning = &method_tunings; *tuning != NULL; )
+    {
+      if ((*tuning)->kernel != kernel)
+        {
+          tuning = &(*tuning)->next;
+          continue;
+        }
+      released = *tuning;
+      *tuning = released->next;
+      free (released);
+    }
+  POCL_UNLOCK (method_tunings_lock);
+  POCL_LOCK (size_tunings_lock);
+  for (sizes = &size_tunings; *sizes != NULL; )
+    {
+      if ((*sizes)->kernel != kernel)
+        {
+          sizes = &(*sizes)->next;
+          continue;
+        }
+      released_sizes = *sizes;
+      *sizes = released_sizes->next;
+      free (released_sizes);
+    }
+  POCL_UNLOCK (size_tunings_lock);
+}
+
+static void
+compile_wg_variants (void *data)
+{
+  eager_compile_job *job = (eager_compile_job*)data;
+  pocl_wg_variant *variant;
+  unsigned i;
+
+  for (i = 0; i < job->num_sizes; ++i)
+    {
+      variant = pocl_get_wg_variant (job->kernel, job->device, 
+                                     job->sizes[i].x, job->sizes[i].y,
+                                     job->sizes[i].z, 0, NULL);
+      if (variant == NULL)
+        continue;
+
+      if (job->device->ops->compile_kernel != NULL)
+        job->device->ops->compile_kernel (job->kernel, variant);
+    }
+
+  POname(clReleaseKernel) (job->kernel);
+  free (job);
+}
+
+void
+pocl_compile_wg_variants_eagerly (cl_kernel kernel)
+{
+  cl_program program = kernel->program;
+  char path_name[POCL_FILENAME_LENGTH];
+  unsigned device_i;
+
+  if (!pocl_get_bool_option (EAGER_COMPILE_ENV, 0))
+    return;
+
+  for (device_i = 0; device_i < program->num_devices; ++device_i)
+    {
+      cl_device_id device = program->devices[device_i];
+      size_t multiple = device->preferred_wg_size_multiple;
+      eager_compile_job *job;
+
+      /* The program was not built for this device. */
+      snprintf (path_name, POCL_FILENAME_LENGTH, "%s/%s", 
+                program->temp_dir, device->short_name);
+      if (access (path_name, F_OK) != 0)
+        continue;
+
+      job = (eager_compile_job*) malloc (sizeof (eager_compile_job));
+      if (job == NULL)
+        return;
+      job->kernel = kernel;
+      job->device = device;
+      job->num_sizes = 0;
+
+      if (kernel->reqd_wg_size != NULL && kernel->reqd_wg_size[0] > 0 &&
+          kernel->reqd_wg_size[1] > 0 && kernel->reqd_wg_size[2] > 0)
+        {
+          /* No other local size can be launched with. */
+          job->num_sizes = 
+            add_wg_size (job->sizes, 0, kernel->reqd_wg_size[0], 
+                         kernel->reqd_wg_size[1], kernel->reqd_wg_size[2]);
+        }
+      else
+        {
+          /* A likely local size of the launches without one, see
+             pocl_select_local_size(). */
+          if (multiple > 0 && multiple <= device->max_work_group_size &&
+              multiple <= device->max_work_item_sizes[0])
+            job->num_sizes = add_wg_size (job->sizes, 0, multiple, 1, 1);
+
+          wg_cache_filename (kernel, device, "wg_sizes", path_name);
+          POCL_LOCK (wg_history_lock);
+          job->num_sizes = read_wg_history (path_name, job->sizes, 
+                                            job->num_sizes);
+          POCL_UNLOCK (wg_history_lock);
+        }
+
+      if (job->num_sizes == 0)
+        {
+          free (job);
+          continue;
+        }
+
+      POname(clRetainKernel) (kernel);
+      pocl_compiler_submit (NULL, compile_wg_variants, job);
+    }
+}
@@ -0,0 +1,202 @@
+/* pocl_wg_variants.h: compilation of the work-group function variants
+   of the kernels
+
+   Copyright (c) 2014 pocl developers
+   
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+
+#ifndef POCL_WG_VARIANTS_H
+#define POCL_WG_VARIANTS_H
+
+#include "pocl_cl.h"
+
+#pragma GCC visibility push(hidden)
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The work-group function reads the local size from the pocl_context
+ * instead of having it as a compile time constant. The local size of 
+ * such a variant is 0 x 0 x 0. */
+#define POCL_WG_VARIANT_DYNAMIC_LOCAL_SIZE 0x1
+
+/* The scalar arguments of the kernel are constants, the values in the 
+ * arguments of the variant. Launched only with the same values. */
+#define POCL_WG_VARIANT_SPECIALIZED_ARGS 0x2
+
+/* The work-group method of the variant, one of the POCL_WG_METHOD_*, 
+ * overriding POCL_WORK_GROUP_METHOD. Set by the launches measuring the
+ * methods for POCL_WORK_GROUP_METHOD_TUNING, or from the method found 
+ * the fastest in the earlier runs. */
+#define POCL_WG_VARIANT_METHOD_SHIFT 4
+#define POCL_WG_VARIANT_METHOD_MASK 0xf0
+#define POCL_WG_VARIANT_METHOD(method) \
+  ((method) << POCL_WG_VARIANT_METHOD_SHIFT)
+#define POCL_WG_VARIANT_GET_METHOD(flags) \
+  (((flags) & POCL_WG_VARIANT_METHOD_MASK) >> POCL_WG_VARIANT_METHOD_SHIFT)
+
+#define POCL_WG_METHOD_REPL 1
+#define POCL_WG_METHOD_LOOPS 2
+#define POCL_WG_METHOD_LOOPVEC 3
+#define POCL_WG_METHOD_HYBRID 4
+#define POCL_WG_NUM_METHODS 4
+
+/* The states of a variant. */
+#define POCL_WG_VARIANT_COMPILING 0
+#define POCL_WG_VARIANT_COMPILED 1
+#define POCL_WG_VARIANT_FAILED 2
+
+/* A compiled work-group function variant of a kernel. 
+ *
+ * The variants are kept in a small hash table in the kernel, keyed by
+ * the device, the local size and the specialization flags (0 is the 
+ * generic variant). Lookups are lock-free so the repeated launches 
+ * need no file system access or string handling. 
+ *
+ * A variant is added to the table already when its compilation starts,
+ * so the other threads needing it wait for that compilation instead of
+ * starting their own, while the other variants of the kernel can be 
+ * compiled in parallel. The lock-free lookups skip it until it has been
+ * compiled. */
+typedef struct pocl_wg_variant pocl_wg_variant;
+struct pocl_wg_variant
+{
+  cl_device_id device;
+  size_t local_x, local_y, local_z;
+  unsigned flags;
+  /* The values of the scalar arguments of the kernel (the others are
+   * NULL) with POCL_WG_VARIANT_SPECIALIZED_ARGS, otherwise NULL. */
+  struct pocl_argument *arguments;
+  /* The directory of the compiler files of the variant. */
+  char *tmp_dir;
+  /* The work-group function, set by the device driver once it has 
+   * loaded the variant. Access it with the functions below. */
+  pocl_workgroup wg;
+  /* One of the POCL_WG_VARIANT_COMPILING/COMPILED/FAILED. Changed and
+   * waited for with the wg_variant_lock of the kernel held. */
+  int status;
+  cl_int error;
+  pthread_cond_t compiled;
+  pocl_wg_variant *next;
+};
+
+/* Returns the variant of the kernel for the given local size, compiling
+ * its parallel.bc first if it does not exist yet. Safe to call 
+ * concurrently, the variant is compiled only once. Returns NULL and 
+ * sets the errcode in case the compilation fails. */
+pocl_wg_variant *pocl_get_wg_variant (cl_kernel kernel, cl_device_id device,
+                                      size_t local_x, size_t local_y, 
+                                      size_t local_z, unsigned flags,
+                                      cl_int *errcode);
+
+/* Returns the variant to launch the kernel with the given local size.
+ *
+ * This is the generic variant of pocl_get_wg_variant() unless 
+ * POCL_DYNAMIC_LOCAL_SIZE is enabled. Then, in case the variant for
+ * the local size has not been compiled yet, the variant with the 
+ * dynamic local size is returned instead and the specialized one is
+ * compiled in the background for the later launches. 
+ *
+ * With POCL_WORK_GROUP_METHOD_TUNING the first launches go through the 
+ * variants of each work-group method, see pocl_record_wg_variant_time().
+ *
+ * With POCL_SPECIALIZE_ARGUMENTS=N a variant with the scalar arguments 
+ * folded to constants is compiled after N launches in a row with the same
+ * argument values, and returned whenever the arguments have those values.
+ * Like clSetKernelArg(), not thread safe for the same kernel. */
+pocl_wg_variant *pocl_select_wg_variant (cl_kernel kernel, 
+                                         cl_device_id device,
+                                         size_t local_x, size_t local_y, 
+                                         size_t local_z, cl_int *errcode);
+
+/* Picks the local size for a launch without one. Considers all the 
+ * dimensions of the global size, the preferred work-group size multiple
+ * of the device, the number of work-groups per compute unit and whether
+ * a variant has been compiled for the local size already. The choice is
+ * cached in the kernel for the same global size.
+ *
+ * With POCL_LOCAL_SIZE_TUNING the first launches go through the best 
+ * scoring local sizes instead. Returns nonzero if the launch should be 
+ * timed for pocl_record_local_size_time(). */
+int pocl_select_local_size (cl_kernel kernel, cl_device_id device,
+                            size_t global_x, size_t global_y, 
+                            size_t global_z, size_t *local_x, 
+                            size_t *local_y, size_t *local_z);
+
+/* Records the device time of a launch measuring a local size. Once all 
+ * the candidates have been measured, the fastest one is stored in the 
+ * cache dir for the class of the global size and used for the later 
+ * launches of the kernel, also in the later runs. */
+void pocl_record_local_size_time (cl_kernel kernel, cl_device_id device,
+                                  const struct pocl_context *pc,
+                                  cl_ulong nanoseconds);
+
+/* Returns the POCL_WORK_GROUP_METHOD name of a POCL_WG_METHOD_*. */
+const char *pocl_wg_method_name (unsigned method);
+
+/* Records the device time of a launch of a variant with the method 
+ * in its flags. Once all the methods have been measured for the local 
+ * size, the fastest one is stored in the cache dir and used for the 
+ * later compilations of the kernel. */
+void pocl_record_wg_variant_time (cl_kernel kernel, pocl_wg_variant *variant,
+                                  cl_ulong nanoseconds);
+
+static inline int
+pocl_wg_variant_is_timed (pocl_wg_variant *variant)
+{
+  return (variant->flags & POCL_WG_VARIANT_METHOD_MASK) != 0;
+}
+
+/* Frees the variant table of a kernel being released. */
+void pocl_free_wg_variants (cl_kernel kernel);
+
+static inline int
+pocl_wg_variant_is_compiled (pocl_wg_variant *variant)
+{
+  return __atomic_load_n (&variant->status, __ATOMIC_ACQUIRE) == 
+    POCL_WG_VARIANT_COMPILED;
+}
+
+static inline pocl_workgroup
+pocl_wg_variant_workgroup (pocl_wg_variant *variant)
+{
+  return __atomic_load_n (&variant->wg, __ATOMIC_ACQUIRE);
+}
+
+static inline void
+pocl_wg_variant_set_workgroup (pocl_wg_variant *variant, pocl_workgroup wg)
+{
+  __atomic_store_n (&variant->wg, wg, __ATOMIC_RELEASE);
+}
+
+/* If POCL_EAGER_WG_COMPILE is enabled, compiles the likely needed
+ * work-group function variants of a freshly created kernel in the 
+ * background compiler threads: the reqd_work_group_size, the preferred 
+ * work-group size multiple of the device and the local sizes seen 
+ * for the kernel in the previous runs. */
+void pocl_compile_wg_variants_eagerly (cl_kernel kernel);
+
+#ifdef __cplusplus
+}
+#endif
+#pragma GCC visibility pop
+
+#endif
@@ -48,8 +48,6 @@ namespace {
 
 }
 
-extern cl::opt<std::string> KernelName;
-
 char Flatten::ID = 0;
 static RegisterPass<Flatten> X("flatten", "Kernel function flattening pass");
 
@@ -63,6 +61,7 @@ bool
 Flatten::runOnModule(Module &M)
 {
   bool changed = false;
+  const std::string KernelName = pocl::Workgroup::kernelToProcess(M);
   for (llvm::Module::iterator i = M.begin(), e = M.end(); i != e; ++i)
     {
       llvm::Function *f = i;
@@ -95,7 +95,7 @@ ImplicitLoopBarriers::ProcessLoop(Loop *L, LPPassManager &LPM)
   }
   if (isBLoop) return false;
 
-  return AddInnerLoopBarrier(L, LPM);
+  return AddLoopBarrier(L, LPM);
 }
 
 /**
@@ -111,29 +111,33 @@ ImplicitLoopBarriers::ProcessLoop(Loop *L, LPPassManager &LPM)
  * OpenCL barrier semantics require either all or none of the WIs to
  * reach the barrier at each iteration. This is satisfied at least when
  *
- * a) loop exit condition does not depend on the WI and 
- * b) all or none of the WIs always enter the loop
+ * a) all or none of the WIs always enter the loop and
+ * b) all the exits of the loop are taken by all or none of the WIs, that
+ *    is, the exiting blocks are executed by all or none of the WIs and 
+ *    their exit conditions do not depend on the WI.
+ *
+ * The trip count need not be computed by a canonical induction variable,
+ * and the loop can have several exits, e.g., breaks with uniform 
+ * conditions.
+ *
+ * The loops are visited from the innermost outwards. An outer loop 
+ * is reached here only in case none of its inner loops could be given
+ * the barriers, as otherwise it would contain barriers already. Then
+ * the work-item loop is switched with the outer loop level instead,
+ * which parallelizes the work-items per iteration of the outer loop.
  */
 bool
-ImplicitLoopBarriers::AddInnerLoopBarrier(llvm::Loop *L, llvm::LPPassManager &LPM) {
-
-  /* Only add barriers to the innermost loops. */
-
-  if (L->getSubLoops().size() > 0)
-    return false;
+ImplicitLoopBarriers::AddLoopBarrier(llvm::Loop *L, llvm::LPPassManager &LPM) {
 
 #ifdef DEBUG_ILOOP_BARRIERS
   std::cerr << "### trying to add a loop barrier to force horizontal parallelization" 
             << std::endl;
 #endif
 
-  BasicBlock *brexit = L->getExitingBlock();
-  if (brexit == NULL) return false; /* Multiple exit points */
-
   llvm::BasicBlock *loopEntry = L->getHeader();
   if (loopEntry == NULL) return false; /* Multiple entries blocks? */
 
-  llvm::Function *f = brexit->getParent();
+  llvm::Function *f = loopEntry->getParent();
 
   VariableUniformityAnalysis &VUA = 
     getAnalysis<VariableUniformityAnalysis>();
@@ -149,34 +153,37 @@ ImplicitLoopBarriers::AddInnerLoopBarrier(llvm::Loop *L, llvm::LPPassManager &LP
     return false;
   }
 
-  /* Check the branch condition predicate. If it is uniform, we know the loop 
-     is  executed the same number of times for all WIs. */
-  llvm::BranchInst *br = dyn_cast<llvm::BranchInst>(brexit->getTerminator());  
-  if (br && br->isConditional() &&
-      VUA.isUniform(f, br->getCondition())) {
-
-    /* Add a barrier both to the beginning of the entry and to the very end
-       to nicely isolate the parallel region. */
-    Barrier::Create(brexit->getTerminator());   
-    Barrier::Create(loopEntry->getFirstNonPHI());
-
+  SmallVector<BasicBlock*, 4> exitingBlocks;
+  L->getExitingBlocks(exitingBlocks);
+  if (exitingBlocks.empty()) return false; /* No exits at all. */
+
+  /* Check the branch condition predicates. If they are uniform, we know the
+     loop is executed the same number of times for all WIs. */
+  for (SmallVectorImpl<BasicBlock*>::iterator i = exitingBlocks.begin(),
+         e = exitingBlocks.end(); i != e; ++i) {
+    BasicBlock *brexit = *i;
+    llvm::BranchInst *br = dyn_cast<llvm::BranchInst>(brexit->getTerminator());
+    if (br == NULL || !br->isConditional() || !VUA.isUniform(f, brexit) ||
+        !VUA.isUniform(f, br->getCondition())) {
 #ifdef DEBUG_ILOOP_BARRIERS
-    std::cerr << "### added an inner-loop barrier to the loop" << std::endl << std::endl;
+      std::cerr << "### loop exit '" << brexit->getName().str() 
+                << "' not uniform" << std::endl;
+      std::cerr << "### cannot add an inner-loop barrier to the loop" 
+                << std::endl << std::endl;
 #endif
-    return true;
-  } else {
-#ifdef DEBUG_ILOOP_BARRIERS
-    if (br && br->isConditional() && !VUA.isUniform(f, br->getCondition())) {
-      std::cerr << "### loop condition not uniform" << std::endl;
-      br->getCondition()->dump();
+      return false;
     }
-#endif
-
   }
 
+  /* Add a barrier both to the beginning of the entry and to the very end
+     of each exiting block to nicely isolate the parallel region. */
+  for (SmallVectorImpl<BasicBlock*>::iterator i = exitingBlocks.begin(),
+         e = exitingBlocks.end(); i != e; ++i)
+    Barrier::Create((*i)->getTerminator());
+  Barrier::Create(loopEntry->getFirstNonPHI());
+
 #ifdef DEBUG_ILOOP_BARRIERS
-  std::cerr << "### cannot add an inner-loop barrier to the loop" << std::endl << std::endl;
+  std::cerr << "### added an inner-loop barrier to the loop" << std::endl << std::endl;
 #endif
-  
-  return false;
+  return true;
 }
@@ -38,7 +38,7 @@ namespace pocl {
     llvm::DominatorTree *DT;
 
     bool ProcessLoop(llvm::Loop *L, llvm::LPPassManager &LPM);
-    bool AddInnerLoopBarrier(llvm::Loop *L, llvm::LPPassManager &LPM);
+    bool AddLoopBarrier(llvm::Loop *L, llvm::LPPassManager &LPM);
 
   };
 }
@@ -26,13 +26,17 @@
 #include "config.h"
 
 #ifdef LLVM_3_2
+#include <llvm/Constants.h>
 #include <llvm/Module.h>
 #include <llvm/Metadata.h>
 #else
+#include <llvm/IR/Constants.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Metadata.h>
 #endif
 
+#define KERNEL_COMPILER_PARAMS_MD "pocl.kernel_compiler_params"
+
 using namespace llvm;
 
 namespace pocl {
@@ -91,5 +95,93 @@ regenerate_kernel_metadata(llvm::Module &M, FunctionMapping &kernels)
   }
 }
 
+static void
+addKernelCompilerParam(llvm::Module &M, const std::string &key, Value *value)
+{
+  NamedMDNode *params = 
+    M.getOrInsertNamedMetadata(KERNEL_COMPILER_PARAMS_MD);
+  Value *operands[] = {MDString::get(M.getContext(), key), value};
+  params->addOperand(MDNode::get(M.getContext(), operands));
+}
+
+/* Returns the value of the last setting of the parameter, or NULL. */
+static Value *
+findKernelCompilerParam(const llvm::Module &M, const std::string &key)
+{
+  NamedMDNode *params = M.getNamedMetadata(KERNEL_COMPILER_PARAMS_MD);
+  if (params == NULL) return NULL;
+
+  Value *value = NULL;
+  for (unsigned i = 0, e = params->getNumOperands(); i != e; ++i) 
+    {
+      MDNode *param = params->getOperand(i);
+      MDString *name = dyn_cast<MDString>(param->getOperand(0));
+      if (name != NULL && name->getString() == key)
+        value = param->getOperand(1);
+    }
+  return value;
+}
+
+void
+setKernelCompilerParam(llvm::Module &M, const std::string &key, 
+                       const std::string &value)
+{
+  addKernelCompilerParam(M, key, MDString::get(M.getContext(), value));
+}
+
+void
+setKernelCompilerParam(llvm::Module &M, const std::string &key, 
+                       unsigned long value)
+{
+  addKernelCompilerParam
+    (M, key, ConstantInt::get(Type::getInt64Ty(M.getContext()), value));
+}
+
+bool
+getKernelCompilerParam(const llvm::Module &M, const std::string &key, 
+                       std::string &value)
+{
+  MDString *str = dyn_cast_or_null<MDString>(findKernelCompilerParam(M, key));
+  if (str == NULL) return false;
+  value = str->getString().str();
+  return true;
+}
+
+bool
+getKernelCompilerParam(const llvm::Module &M, const std::string &key, 
+                       unsigned long &value)
+{
+  ConstantInt *c = 
+    dyn_cast_or_null<ConstantInt>(findKernelCompilerParam(M, key));
+  if (c == NULL) return false;
+  value = c->getZExtValue();
+  return true;
 }
 
+bool
+getNativeVectorWidth(const llvm::Module &M, llvm::Type *type, 
+                     unsigned long &width)
+{
+  if (type->isVectorTy())
+    type = type->getVectorElementType();
+
+  std::string typeName;
+  if (type->isFloatTy()) 
+    typeName = "float";
+  else if (type->isDoubleTy()) 
+    typeName = "double";
+  else if (type->isIntegerTy(8))
+    typeName = "char";
+  else if (type->isIntegerTy(16))
+    typeName = "short";
+  else if (type->isIntegerTy(32))
+    typeName = "int";
+  else if (type->isIntegerTy(64))
+    typeName = "long";
+  else
+    return false;
+
+  return getKernelCompilerParam(M, "native_vector_width_" + typeName, width);
+}
+
+}
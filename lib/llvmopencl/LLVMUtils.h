@@ -52,6 +52,36 @@ typedef std::map<llvm::Function*, llvm::Function*> FunctionMapping;
 void
 regenerate_kernel_metadata(llvm::Module &M, FunctionMapping &kernels);
 
+/* The parameters of a single kernel compiler invocation (the kernel to
+   process, the local size, the work-item handler method, ...) are 
+   passed to the passes in the named metadata of the compiled module 
+   instead of global options. This way multiple kernels can be compiled 
+   at the same time. The getters return false in case the parameter has 
+   not been set, in which case the passes fall back to the command line 
+   options of the pocl-workgroup script version. */
+void
+setKernelCompilerParam(llvm::Module &M, const std::string &key, 
+                       const std::string &value);
+
+void
+setKernelCompilerParam(llvm::Module &M, const std::string &key, 
+                       unsigned long value);
+
+bool
+getKernelCompilerParam(const llvm::Module &M, const std::string &key, 
+                       std::string &value);
+
+bool
+getKernelCompilerParam(const llvm::Module &M, const std::string &key, 
+                       unsigned long &value);
+
+/* Returns the native vector width of the device for the scalar type (or
+   the element type of a vector type) from the 'native_vector_width_<type>' 
+   kernel compiler parameters. Returns false if the width is not known. */
+bool
+getNativeVectorWidth(const llvm::Module &M, llvm::Type *type, 
+                     unsigned long &width);
+
 inline bool
 is_automatic_local(const std::string& funcName, llvm::GlobalVariable &var) 
 {
@@ -38,6 +38,8 @@
 #endif
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Support/Mutex.h"
+#include "llvm/Support/MutexGuard.h"
 
 #include <set>
 #include <sstream>
@@ -62,8 +64,9 @@ ParallelRegion::ParallelRegion(int forcedRegionId) :
   LocalIDXLoadInstr(NULL), LocalIDYLoadInstr(NULL), LocalIDZLoadInstr(NULL),
   exitIndex_(0), entryIndex_(0), pRegionId(forcedRegionId)
 {
+  /* Regions of concurrent compilations are created in parallel. */
   if (forcedRegionId == -1)
-    pRegionId = idGen++;
+    pRegionId = __atomic_fetch_add(&idGen, 1, __ATOMIC_RELAXED);
 }
 
 /**
@@ -111,8 +114,10 @@ ParallelRegion::replicate(ValueToValueMapTy &map,
      by LLVM). This causes the variable references to become
      broken. This hack ensures the BB suffixes are unique
      before cloning so each path gets their own value
-     names. Split points can be such paths.*/
+     names. Split points can be such paths. The counts are shared
+     by the concurrently compiled kernels, thus the lock. */
   static std::map<std::string, int> cloneCounts;
+  static llvm::sys::Mutex cloneCountsLock;
 
   for (iterator i = begin(), e = end(); i != e; ++i) {
     BasicBlock *block = *i;
@@ -120,12 +125,16 @@ ParallelRegion::replicate(ValueToValueMapTy &map,
     std::ostringstream suf;
     suf << suffix.str();
     std::string block_name = block->getName().str() + "." + suffix.str();
-    if (cloneCounts[block_name] > 0)
+    int cloneCount;
+    {
+      llvm::MutexGuard guard(cloneCountsLock);
+      cloneCount = cloneCounts[block_name]++;
+    }
+    if (cloneCount > 0)
       {
-        suf << ".pocl_" << cloneCounts[block_name];
+        suf << ".pocl_" << cloneCount;
       }
     BasicBlock *new_block = CloneBasicBlock(block, map, suf.str());
-    cloneCounts[block_name]++;
     // Insert the block itself into the map.
     map[block] = new_block;
     new_region->push_back(new_block);
@@ -0,0 +1,312 @@
+// LLVM function pass that removes the explicit barriers that do not order
+// any memory accesses visible to the other work-items.
+// 
+// Copyright (c) 2014 pocl developers
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#define DEBUG_TYPE "remove-barriers"
+
+#include "config.h"
+#include "RemoveBarriers.h"
+#include "Barrier.h"
+#include "Workgroup.h"
+#include "WorkitemHandlerChooser.h"
+#include "VariableUniformityAnalysis.h"
+#include "pocl.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/Support/CFG.h"
+#if (defined LLVM_3_1 or defined LLVM_3_2)
+#include "llvm/Instructions.h"
+#include "llvm/IntrinsicInst.h"
+#include "llvm/Module.h"
+#else
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
+#endif
+
+#include <cstdlib>
+#include <iostream>
+
+//#define DEBUG_REMOVE_BARRIERS
+
+using namespace llvm;
+using namespace pocl;
+
+namespace {
+  static
+  RegisterPass<RemoveBarriers> X("remove-barriers",
+                                 "Removes the barriers that order no shared memory accesses");
+}
+
+char RemoveBarriers::ID = 0;
+
+STATISTIC(RemovedBarriers, "Number of redundant barriers removed");
+
+void
+RemoveBarriers::getAnalysisUsage(AnalysisUsage &AU) const
+{
+  AU.addRequired<AliasAnalysis>();
+  AU.addRequired<VariableUniformityAnalysis>();
+  AU.addPreserved<pocl::WorkitemHandlerChooser>();
+  AU.setPreservesCFG();
+}
+
+static unsigned
+addressSpace(Value *pointer)
+{
+  return cast<PointerType>(pointer->getType())->getAddressSpace();
+}
+
+/* Collects the basic blocks reachable from the successors of the given
+   block, or the ones it is reachable from when walking backwards. The
+   block itself is included only in case it is in a loop. */
+static void
+reachableBlocks
+(BasicBlock *bb, bool backwards, std::set<BasicBlock*> &blocks)
+{
+  std::vector<BasicBlock*> worklist;
+  worklist.push_back(bb);
+  while (!worklist.empty())
+    {
+      BasicBlock *b = worklist.back();
+      worklist.pop_back();
+      if (backwards)
+        {
+          for (pred_iterator i = pred_begin(b), e = pred_end(b); i != e; ++i)
+            if (blocks.insert(*i).second)
+              worklist.push_back(*i);
+        }
+      else
+        {
+          for (succ_iterator i = succ_begin(b), e = succ_end(b); i != e; ++i)
+            if (blocks.insert(*i).second)
+              worklist.push_back(*i);
+        }
+    }
+}
+
+bool
+RemoveBarriers::runOnFunction(Function &F)
+{
+  if (!Workgroup::isKernelToProcess(F))
+    return false;
+
+  AA = &getAnalysis<AliasAnalysis>();
+  VUA = &getAnalysis<VariableUniformityAnalysis>();
+  function = &F;
+
+  std::vector<Barrier*> barriers;
+  for (Function::iterator bb = F.begin(), e = F.end(); bb != e; ++bb)
+    {
+      for (BasicBlock::iterator i = bb->begin(), ie = bb->end(); 
+           i != ie; ++i)
+        {
+          if (isa<Barrier>(i))
+            barriers.push_back(cast<Barrier>(i));
+        }
+    }
+
+  /* The accesses are collected across the other barriers, thus removing 
+     one barrier does not make another one necessary and all of the 
+     redundant ones can be removed at once. */
+  std::vector<Barrier*> redundant;
+  for (std::vector<Barrier*>::iterator i = barriers.begin(), 
+         e = barriers.end(); i != e; ++i)
+    {
+      if (IsRedundant(*i))
+        redundant.push_back(*i);
+    }
+
+  for (std::vector<Barrier*>::iterator i = redundant.begin(), 
+         e = redundant.end(); i != e; ++i)
+    {
+#ifdef DEBUG_REMOVE_BARRIERS
+      std::cerr << "### removing a redundant barrier from " 
+                << (*i)->getParent()->getName().str() << std::endl;
+#endif
+      (*i)->eraseFromParent();
+      ++RemovedBarriers;
+    }
+
+  if (getenv("POCL_VERBOSE") != NULL && !barriers.empty())
+    std::cerr << "### removed " << redundant.size() << " of " 
+              << barriers.size() << " barriers of " << F.getName().str()
+              << std::endl;
+
+  return !redundant.empty();
+}
+
+bool
+RemoveBarriers::IsRedundant(Barrier *barrier)
+{
+  BasicBlock *bb = barrier->getParent();
+  BasicBlock::iterator barrierPos = barrier;
+
+  BasicBlockSet before, after;
+  reachableBlocks(bb, true, before);
+  reachableBlocks(bb, false, after);
+
+  SharedAccessVec beforeAccesses, afterAccesses;
+  for (BasicBlockSet::iterator i = before.begin(), e = before.end(); 
+       i != e; ++i)
+    CollectAccesses((*i)->begin(), (*i)->end(), beforeAccesses);
+  if (before.find(bb) == before.end())
+    CollectAccesses(bb->begin(), barrierPos, beforeAccesses);
+
+  if (beforeAccesses.empty())
+    return true;
+
+  for (BasicBlockSet::iterator i = after.begin(), e = after.end(); 
+       i != e; ++i)
+    CollectAccesses((*i)->begin(), (*i)->end(), afterAccesses);
+  if (after.find(bb) == after.end())
+    CollectAccesses(++barrierPos, bb->end(), afterAccesses);
+
+  for (SharedAccessVec::iterator a = beforeAccesses.begin(), 
+         ae = beforeAccesses.end(); a != ae; ++a)
+    {
+      for (SharedAccessVec::iterator b = afterAccesses.begin(), 
+             be = afterAccesses.end(); b != be; ++b)
+        {
+          if (Conflict(*a, *b))
+            return false;
+        }
+    }
+  return true;
+}
+
+void
+RemoveBarriers::CollectAccesses
+(BasicBlock::iterator begin, BasicBlock::iterator end, 
+ SharedAccessVec &accesses)
+{
+  for (BasicBlock::iterator i = begin; i != end; ++i)
+    {
+      SharedAccess access;
+      if (SharedMemoryAccess(i, access))
+        accesses.push_back(access);
+    }
+}
+
+/**
+ * Returns true in case the instruction might access memory that is
+ * visible to the other work-items, i.e., other than the private or the
+ * read-only constant memory.
+ */
+bool
+RemoveBarriers::SharedMemoryAccess(Instruction *instr, SharedAccess &access)
+{
+  access.write = true;
+  access.location = AliasAnalysis::Location();
+
+  if (isa<Barrier>(instr) || !instr->mayReadOrWriteMemory())
+    return false;
+
+  if (LoadInst *load = dyn_cast<LoadInst>(instr))
+    {
+      unsigned as = addressSpace(load->getPointerOperand());
+      if (as == POCL_ADDRESS_SPACE_PRIVATE || 
+          as == POCL_ADDRESS_SPACE_CONSTANT)
+        return false;
+      /* Volatile and atomic loads are treated as writes to keep them
+         ordered with the other accesses. */
+      access.write = !load->isSimple();
+      access.location = AA->getLocation(load);
+      return true;
+    }
+
+  if (StoreInst *store = dyn_cast<StoreInst>(instr))
+    {
+      if (addressSpace(store->getPointerOperand()) == 
+          POCL_ADDRESS_SPACE_PRIVATE)
+        return false;
+      access.location = AA->getLocation(store);
+      return true;
+    }
+
+  if (isa<DbgInfoIntrinsic>(instr))
+    return false;
+
+  if (IntrinsicInst *intrinsic = dyn_cast<IntrinsicInst>(instr))
+    {
+      if (intrinsic->getIntrinsicID() == Intrinsic::lifetime_start ||
+          intrinsic->getIntrinsicID() == Intrinsic::lifetime_end)
+        return false;
+    }
+
+  if (MemIntrinsic *mem = dyn_cast<MemIntrinsic>(instr))
+    {
+      MemTransferInst *transfer = dyn_cast<MemTransferInst>(mem);
+      bool writesShared = 
+        addressSpace(mem->getDest()) != POCL_ADDRESS_SPACE_PRIVATE;
+      bool readsShared = 
+        transfer != NULL &&
+        addressSpace(transfer->getSource()) != POCL_ADDRESS_SPACE_PRIVATE &&
+        addressSpace(transfer->getSource()) != POCL_ADDRESS_SPACE_CONSTANT;
+      if (!writesShared && !readsShared)
+        return false;
+      access.write = writesShared;
+      return true;
+    }
+
+  if (CallInst *call = dyn_cast<CallInst>(instr))
+    {
+      access.write = !call->onlyReadsMemory();
+      return true;
+    }
+
+  /* Atomic read-modify-writes, fences and the rest. */
+  return true;
+}
+
+/**
+ * Returns true in case the two accesses might touch the same memory
+ * and at least one of them writes it.
+ *
+ * The accesses are executed by different work-items. Thus, the alias
+ * analysis is asked only in case both of the addresses are the same for 
+ * all the work-items, otherwise only the accesses to distinct objects 
+ * are known not to conflict.
+ */
+bool
+RemoveBarriers::Conflict(const SharedAccess &a, const SharedAccess &b)
+{
+  if (!a.write && !b.write)
+    return false;
+  if (a.location.Ptr == NULL || b.location.Ptr == NULL)
+    return true;
+
+  Value *ptrA = const_cast<Value*>(a.location.Ptr);
+  Value *ptrB = const_cast<Value*>(b.location.Ptr);
+
+  /* The local and the global memory do not overlap. */
+  if (addressSpace(ptrA) != addressSpace(ptrB))
+    return false;
+
+  if (VUA->isUniform(function, ptrA) && VUA->isUniform(function, ptrB))
+    return AA->alias(a.location, b.location) != AliasAnalysis::NoAlias;
+
+  Value *objectA = GetUnderlyingObject(ptrA);
+  Value *objectB = GetUnderlyingObject(ptrB);
+  return objectA == objectB || 
+    !isIdentifiedObject(objectA) || !isIdentifiedObject(objectB);
+}
@@ -0,0 +1,95 @@
+// Header for RemoveBarriers function pass.
+// 
+// Copyright (c) 2014 pocl developers
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef _POCL_REMOVE_BARRIERS_H
+#define _POCL_REMOVE_BARRIERS_H
+
+#include "config.h"
+#if (defined LLVM_3_1 or defined LLVM_3_2)
+#include "llvm/Function.h"
+#else
+#include "llvm/IR/Function.h"
+#endif
+
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Pass.h"
+#include <set>
+#include <vector>
+
+namespace pocl {
+  class Barrier;
+  class VariableUniformityAnalysis;
+
+  /**
+   * Removes the explicit barriers that do not order any memory accesses
+   * visible to the other work-items.
+   *
+   * A barrier is redundant in case no local or global memory access that
+   * can execute before it conflicts with one that can execute after it.
+   * Such a barrier only splits the parallel regions, adding context saves
+   * and ending the work-item loops, without the work-items being able to
+   * observe the difference.
+   *
+   * The barrier orders the accesses of different work-items, thus the
+   * alias analysis, which reasons about a single work-item, decides the
+   * conflicts only for addresses that are the same for all the work-items
+   * of the work-group. Otherwise, e.g., a write to buf[lid] and a read of
+   * buf[lid + 1], the accesses conflict unless they are to provably
+   * distinct objects.
+   *
+   * The calls that might access memory (e.g. printf) are treated as
+   * writes to unknown memory, thus preserve the barriers around them.
+   */
+  class RemoveBarriers : public llvm::FunctionPass {
+    
+  public:
+    static char ID;
+    
+  RemoveBarriers() : FunctionPass(ID) {}
+    
+    virtual void getAnalysisUsage(llvm::AnalysisUsage &AU) const;
+    virtual bool runOnFunction(llvm::Function &F);
+
+  private:
+    /* An access to memory possibly shared with the other work-items. */
+    struct SharedAccess {
+      bool write;
+      /* The accessed location. A NULL pointer when unknown. */
+      llvm::AliasAnalysis::Location location;
+    };
+    typedef std::vector<SharedAccess> SharedAccessVec;
+    typedef std::set<llvm::BasicBlock*> BasicBlockSet;
+
+    bool IsRedundant(Barrier *barrier);
+    bool SharedMemoryAccess(llvm::Instruction *instr, SharedAccess &access);
+    void CollectAccesses
+      (llvm::BasicBlock::iterator begin, llvm::BasicBlock::iterator end,
+       SharedAccessVec &accesses);
+    bool Conflict(const SharedAccess &a, const SharedAccess &b);
+
+    llvm::AliasAnalysis *AA;
+    VariableUniformityAnalysis *VUA;
+    llvm::Function *function;
+  };
+}
+
+#endif
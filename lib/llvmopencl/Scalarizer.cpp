@@ -30,6 +30,7 @@
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "LLVMUtils.h"
 
 using namespace llvm;
 
@@ -179,6 +180,9 @@ private:
   GatherList Gathered;
   unsigned ParallelLoopAccessMDKind;
   const DataLayout *TDL;
+  // Scalarize the loads and stores, set with the command line option
+  // or the 'scalarize_load_store' kernel compiler parameter.
+  bool ScalarizeMemory;
 };
 
 char Scalarizer::ID = 0;
@@ -266,6 +270,9 @@ void Scalarizer::getAnalysisUsage(AnalysisUsage &AU) const {
 bool Scalarizer::doInitialization(Module &M) {
   ParallelLoopAccessMDKind =
     M.getContext().getMDKindID("llvm.mem.parallel_loop_access");
+  unsigned long Param = 0;
+  ScalarizeMemory = ScalarizeLoadStore ||
+    (pocl::getKernelCompilerParam(M, "scalarize_load_store", Param) && Param);
   return false;
 }
 
@@ -577,7 +584,7 @@ bool Scalarizer::visitPHINode(PHINode &PHI) {
 }
 
 bool Scalarizer::visitLoadInst(LoadInst &LI) {
-  if (!ScalarizeLoadStore)
+  if (!ScalarizeMemory)
     return false;
   if (!LI.isSimple())
     return false;
@@ -600,7 +607,7 @@ bool Scalarizer::visitLoadInst(LoadInst &LI) {
 }
 
 bool Scalarizer::visitStoreInst(StoreInst &SI) {
-  if (!ScalarizeLoadStore)
+  if (!ScalarizeMemory)
     return false;
   if (!SI.isSimple())
     return false;
@@ -23,6 +23,8 @@
 #include "config.h"
 #include <sstream>
 #include <iostream>
+#include <set>
+#include <vector>
 
 #ifdef LLVM_3_2
 #include "llvm/Metadata.h"
@@ -41,6 +43,7 @@
 #endif
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Analysis/PostDominators.h"
+#include "llvm/Analysis/ValueTracking.h"
 
 #include "WorkitemHandler.h"
 #include "Kernel.h"
@@ -94,10 +97,14 @@ VariableUniformityAnalysis::runOnFunction(Function &F) {
   /* Mark the canonical induction variable PHI as uniform. 
      If there's a canonical induction variable in loops, the variable
      update for each iteration should be uniform. Note: this does not yet imply
-     all the work-items execute the loop same number of times! */
+     all the work-items execute the loop same number of times! 
+     The nested loops are visited as well. */
   llvm::LoopInfo &LI = getAnalysis<LoopInfo>();
-  for (llvm::LoopInfo::iterator i = LI.begin(), e = LI.end(); i != e; ++i) {
-    llvm::Loop *L = *i;
+  std::vector<llvm::Loop*> loops(LI.begin(), LI.end());
+  while (!loops.empty()) {
+    llvm::Loop *L = loops.back();
+    loops.pop_back();
+    loops.insert(loops.end(), L->begin(), L->end());
     if (llvm::PHINode *inductionVar = L->getCanonicalInductionVariable()) {
 #ifdef DEBUG_UNIFORMITY_ANALYSIS
       std::cerr << "### canonical induction variable, assuming uniform:";
@@ -229,13 +236,77 @@ VariableUniformityAnalysis::isUniformityAnalyzed(llvm::Function *f, llvm::Value
   return false;
 }
 
+/**
+ * Returns true if the given pointer points to one of the work-item id
+ * variables, the only globals with different contents for each work-item.
+ */
+static bool
+isLocalIdVariable(llvm::Value *pointer) {
+  llvm::GlobalVariable *global = 
+    dyn_cast<llvm::GlobalVariable>(pointer->stripPointerCasts());
+  if (global == NULL) 
+    return false;
+  return global->getName() == "_local_id_x" ||
+    global->getName() == "_local_id_y" ||
+    global->getName() == "_local_id_z";
+}
+
+/**
+ * Returns true if the result of a call to the function depends on its 
+ * arguments and the memory only, not on the calling work-item.
+ *
+ * The functions that do not access memory qualify, as well as the defined
+ * functions that do not refer to the work-item ids and write only to their
+ * own stack, directly or through their callees.
+ */
+static bool
+isWorkItemIndependent
+(llvm::Function *f, std::set<llvm::Function*> &visited) {
+  if (f->doesNotAccessMemory()) 
+    return true;
+  if (f->isDeclaration()) 
+    return false;
+  if (!visited.insert(f).second)
+    return true;
+
+  for (llvm::Function::iterator bb = f->begin(), bbe = f->end(); 
+       bb != bbe; ++bb) {
+    for (llvm::BasicBlock::iterator i = bb->begin(), e = bb->end(); 
+         i != e; ++i) {
+      for (unsigned opr = 0; opr < i->getNumOperands(); ++opr) {
+        if (isLocalIdVariable(i->getOperand(opr)))
+          return false;
+      }
+      if (llvm::CallInst *call = dyn_cast<llvm::CallInst>(i)) {
+        llvm::Function *callee = call->getCalledFunction();
+        if (callee == NULL || !isWorkItemIndependent(callee, visited))
+          return false;
+        continue;
+      }
+      if (llvm::StoreInst *store = dyn_cast<llvm::StoreInst>(i)) {
+        if (!store->isSimple() ||
+            !isa<llvm::AllocaInst>
+            (GetUnderlyingObject(store->getPointerOperand())))
+          return false;
+        continue;
+      }
+      if (i->mayWriteToMemory())
+        return false;
+    }
+  }
+  return true;
+}
+
 /**
  * Simple uniformity analysis that recursively analyses all the
  * operands affecting the value.
  *
  * Known uniform Values:
  * a) kernel arguments
- * b) constants
+ * b) constants, including the addresses of globals
+ * c) loads from uniform addresses, except of the work-item ids
+ * d) calls with uniform arguments to functions that do not depend on
+ *    the work-item id
  * 
  */
 bool 
@@ -259,7 +330,7 @@ VariableUniformityAnalysis::isUniform(llvm::Function *f, llvm::Value* v) {
     return true;
   }
 
-  if (isa<llvm::ConstantInt>(v)) {
+  if (isa<llvm::Constant>(v)) {
     setUniform(f, v, true);
     return true;
   }
@@ -346,6 +417,24 @@ VariableUniformityAnalysis::isUniform(llvm::Function *f, llvm::Value* v) {
       setUniform(f, v, true);
       return true;
     } 
+
+    /* The work-item ids are the only variables with the same address
+       but different contents for each work-item. Elsewhere, such as in
+       the __constant and the read-only global buffers, a uniform address
+       means a uniform value, which is checked with the operands below. */
+    if (isLocalIdVariable(pointer)) {
+      setUniform(f, v, false);
+      return false;
+    }
+  }
+
+  if (llvm::CallInst *call = dyn_cast<llvm::CallInst>(v)) {
+    std::set<llvm::Function*> visited;
+    llvm::Function *callee = call->getCalledFunction();
+    if (callee == NULL || !isWorkItemIndependent(callee, visited)) {
+      setUniform(f, v, false);
+      return false;
+    }
   }
 
   if (isa<llvm::PHINode>(v)) {
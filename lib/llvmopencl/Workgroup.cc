@@ -64,6 +64,7 @@
 #include <iostream>
 
 #include "pocl.h"
+#include "LLVMUtils.h"
 
 #define STRING_LENGTH 32
 
@@ -71,80 +72,61 @@ using namespace std;
 using namespace llvm;
 using namespace pocl;
 
-static Function *createLauncher(Module &M, Function *F);
+static Function *createLauncher(Module &M, Function *F, int size_t_width);
 static void privatizeContext(Module &M, Function *F);
-static void createWorkgroup(Module &M, Function *F);
-static void createWorkgroupFast(Module &M, Function *F);
+static void createWorkgroup(Module &M, Function *F, int size_t_width);
+static void createWorkgroupFast(Module &M, Function *F, int size_t_width);
 
 // extern cl::opt<string> Header;
 // extern cl::list<int> LocalSize;
 
-/* The kernel to process in this kernel compiler launch. */
+/* The kernel to process in this kernel compiler launch. Overridden by
+   the "kernel" kernel compiler parameter of the module. */
 cl::opt<string>
 KernelName("kernel",
        cl::desc("Kernel function name"),
        cl::value_desc("kernel"),
        cl::init(""));
 
-namespace llvm {
+/* The fields of struct _pocl_context passed to the work-group functions. */
+enum PoclContextField {
+  WORK_DIM,
+  NUM_GROUPS,
+  GROUP_ID,
+  GLOBAL_OFFSET,
+  LOCAL_SIZE
+};
 
-  typedef struct _pocl_context PoclContext;
-  
-  template<bool xcompile> class TypeBuilder<PoclContext, xcompile> {
-  public:
-    static StructType *get(LLVMContext &Context) {
-      if (size_t_width == 64)
-        {
-          return StructType::get
-            (TypeBuilder<types::i<32>, xcompile>::get(Context),
-             TypeBuilder<types::i<64>[3], xcompile>::get(Context),
-             TypeBuilder<types::i<64>[3], xcompile>::get(Context),
-             TypeBuilder<types::i<64>[3], xcompile>::get(Context),
-             NULL);
-        }
-      else if (size_t_width == 32)
-        {
-          return StructType::get
-            (TypeBuilder<types::i<32>, xcompile>::get(Context),
-             TypeBuilder<types::i<32>[3], xcompile>::get(Context),
-             TypeBuilder<types::i<32>[3], xcompile>::get(Context),
-             TypeBuilder<types::i<32>[3], xcompile>::get(Context),
-             NULL);
-        }
-      else
-        {
-          assert (false && "Unsupported size_t width.");
-          return NULL;
-        }
-    }
-
-    /** 
-     * We compile for various targets with various widths for the size_t
-     * type that depends on the pointer type. 
-     *
-     * This should be set when the correct type is known. This is a hack
-     * until a better way is found. It's not thread safe, e.g. if one
-     * compiles multiple Modules for multiple different pointer widths in
-     * a same process with multiple threads. */
-    static void setSizeTWidth(int width) {
-      size_t_width = width;
-    }    
-  
-    enum Fields {
-      WORK_DIM,
-      NUM_GROUPS,
-      GROUP_ID,
-      GLOBAL_OFFSET
-    };
-  private:
-    static int size_t_width;
-    
-  };  
-
-  template<bool xcompile>  
-  int TypeBuilder<PoclContext, xcompile>::size_t_width = 0;
+/**
+ * Returns the LLVM type of struct _pocl_context.
+ *
+ * The width of the size_t fields depends on the pointer width of the
+ * target, thus it is passed in by the caller for each compiled module.
+ */
+static StructType *
+getPoclContextType(LLVMContext &Context, int size_t_width)
+{
+  assert ((size_t_width == 64 || size_t_width == 32) &&
+          "Unsupported size_t width.");
+  Type *SizeTArray = ArrayType::get(IntegerType::get(Context, size_t_width), 3);
+  return StructType::get(Type::getInt32Ty(Context), SizeTArray, SizeTArray,
+                         SizeTArray, SizeTArray, NULL);
+}
 
-}  // namespace llvm
+/**
+ * Returns the type of the KERNELNAME_workgroup(_fast) functions that take
+ * the argument pointer array and the context struct.
+ */
+static FunctionType *
+getWorkgroupFunctionType(LLVMContext &Context, int size_t_width)
+{
+  Type *args[] = {
+    Type::getInt8PtrTy(Context)->getPointerTo(),
+    getPoclContextType(Context, size_t_width)->getPointerTo()
+  };
+  return FunctionType::get(Type::getVoidTy(Context),
+                           ArrayRef<Type *>(args), false);
+}
   
 char Workgroup::ID = 0;
 static RegisterPass<Workgroup> X("workgroup", "Workgroup creation pass");
@@ -153,13 +135,14 @@ static RegisterPass<Workgroup> X("workgroup", "Workgroup creation pass");
 bool
 Workgroup::runOnModule(Module &M)
 {
+  int size_t_width = 0;
   if (M.getPointerSize() == llvm::Module::Pointer64)
     {
-      TypeBuilder<PoclContext, true>::setSizeTWidth(64);
+      size_t_width = 64;
     }
   else if (M.getPointerSize() == llvm::Module::Pointer32) 
     {
-      TypeBuilder<PoclContext, true>::setSizeTWidth(32);
+      size_t_width = 32;
     }
   else 
     {
@@ -173,7 +156,7 @@ Workgroup::runOnModule(Module &M)
 
   for (Module::iterator i = M.begin(), e = M.end(); i != e; ++i) {
     if (!isKernelToProcess(*i)) continue;
-    Function *L = createLauncher(M, i);
+    Function *L = createLauncher(M, i, size_t_width);
       
 #if defined LLVM_3_2
     L->addFnAttr(Attributes::NoInline);
@@ -183,8 +166,8 @@ Workgroup::runOnModule(Module &M)
 
     privatizeContext(M, L);
 
-    createWorkgroup(M, L);
-    createWorkgroupFast(M, L);
+    createWorkgroup(M, L, size_t_width);
+    createWorkgroupFast(M, L, size_t_width);
   }
 
   Function *barrier = cast<Function> 
@@ -198,14 +181,15 @@ Workgroup::runOnModule(Module &M)
 }
 
 static Function *
-createLauncher(Module &M, Function *F)
+createLauncher(Module &M, Function *F, int size_t_width)
 {
   SmallVector<Type *, 8> sv;
 
   for (Function::const_arg_iterator i = F->arg_begin(), e = F->arg_end();
        i != e; ++i)
     sv.push_back (i->getType());
-  sv.push_back(TypeBuilder<PoclContext*, true>::get(M.getContext()));
+  sv.push_back
+    (getPoclContextType(M.getContext(), size_t_width)->getPointerTo());
 
   FunctionType *ft = FunctionType::get(Type::getVoidTy(M.getContext()),
 				       ArrayRef<Type *> (sv),
@@ -236,21 +220,14 @@ createLauncher(Module &M, Function *F)
 
   IRBuilder<> builder(BasicBlock::Create(M.getContext(), "", L));
 
-  ptr = builder.CreateStructGEP(ai,
-				TypeBuilder<PoclContext, true>::WORK_DIM);
+  ptr = builder.CreateStructGEP(ai, WORK_DIM);
   gv = M.getGlobalVariable("_work_dim");
   if (gv != NULL) {
     v = builder.CreateLoad(builder.CreateConstGEP1_32(ptr, 0));
     builder.CreateStore(v, gv);
   }
 
-
-  int size_t_width = 32;
-  if (M.getPointerSize() == llvm::Module::Pointer64)
-    size_t_width = 64;
-
-  ptr = builder.CreateStructGEP(ai,
-				TypeBuilder<PoclContext, true>::GROUP_ID);
+  ptr = builder.CreateStructGEP(ai, GROUP_ID);
   for (int i = 0; i < 3; ++i) {
     snprintf(s, STRING_LENGTH, "_group_id_%c", 'x' + i);
     gv = M.getGlobalVariable(s);
@@ -267,8 +244,7 @@ createLauncher(Module &M, Function *F)
     }
   }
 
-  ptr = builder.CreateStructGEP(ai,
-				TypeBuilder<PoclContext, true>::NUM_GROUPS);
+  ptr = builder.CreateStructGEP(ai, NUM_GROUPS);
   for (int i = 0; i < 3; ++i) {
     snprintf(s, STRING_LENGTH, "_num_groups_%c", 'x' + i);
     gv = M.getGlobalVariable(s);
@@ -285,8 +261,7 @@ createLauncher(Module &M, Function *F)
     }
   }
 
-  ptr = builder.CreateStructGEP(ai,
-				TypeBuilder<PoclContext, true>::GLOBAL_OFFSET);
+  ptr = builder.CreateStructGEP(ai, GLOBAL_OFFSET);
   for (int i = 0; i < 3; ++i) {
     snprintf(s, STRING_LENGTH, "_global_offset_%c", 'x' + i);
     gv = M.getGlobalVariable(s);
@@ -303,6 +278,30 @@ createLauncher(Module &M, Function *F)
     }
   }
 
+  /* The local size is a compile time constant stored by the kernel
+     itself unless the work-group function was generated for a dynamic 
+     local size. */
+  unsigned long dynamic_local_size = 0;
+  if (getKernelCompilerParam(M, "dynamic_local_size", dynamic_local_size) &&
+      dynamic_local_size) {
+    ptr = builder.CreateStructGEP(ai, LOCAL_SIZE);
+    for (int i = 0; i < 3; ++i) {
+      snprintf(s, STRING_LENGTH, "_local_size_%c", 'x' + i);
+      gv = M.getGlobalVariable(s);
+      if (gv != NULL) {
+        if (size_t_width == 64)
+          {
+            v = builder.CreateLoad(builder.CreateConstGEP2_64(ptr, 0, i));
+          }
+        else
+          {
+            v = builder.CreateLoad(builder.CreateConstGEP2_32(ptr, 0, i));
+          }
+        builder.CreateStore(v, gv);
+      }
+    }
+  }
+
   CallInst *c = builder.CreateCall(F, ArrayRef<Value*>(arguments));
   builder.CreateRetVoid();
 
@@ -450,13 +449,11 @@ privatizeContext(Module &M, Function *F)
  * actual buffers and that scalar data is loaded from the default memory.
  */
 static void
-createWorkgroup(Module &M, Function *F)
+createWorkgroup(Module &M, Function *F, int size_t_width)
 {
   IRBuilder<> builder(M.getContext());
 
-  FunctionType *ft =
-    TypeBuilder<void(types::i<8>*[],
-		     PoclContext*), true>::get(M.getContext());
+  FunctionType *ft = getWorkgroupFunctionType(M.getContext(), size_t_width);
 
   std::string funcName = "";
   funcName = F->getName().str();
@@ -521,13 +518,11 @@ createWorkgroup(Module &M, Function *F)
  * at the device.
  */
 static void
-createWorkgroupFast(Module &M, Function *F)
+createWorkgroupFast(Module &M, Function *F, int size_t_width)
 {
   IRBuilder<> builder(M.getContext());
 
-  FunctionType *ft =
-    TypeBuilder<void(types::i<8>*[],
-		     PoclContext*), true>::get(M.getContext());
+  FunctionType *ft = getWorkgroupFunctionType(M.getContext(), size_t_width);
 
   std::string funcName = "";
   funcName = F->getName().str();
@@ -587,6 +582,18 @@ createWorkgroupFast(Module &M, Function *F)
 }
 
 
+/**
+ * Returns the name of the kernel to process in this kernel compiler
+ * invocation, or an empty string if all kernels should be processed.
+ */
+std::string
+Workgroup::kernelToProcess(const Module &M)
+{
+  std::string kernel = KernelName;
+  getKernelCompilerParam(M, "kernel", kernel);
+  return kernel;
+}
+
 /**
  * Returns true in case the given function is a kernel that
  * should be processed by the kernel compiler.
@@ -598,9 +605,10 @@ Workgroup::isKernelToProcess(const Function &F)
 
   NamedMDNode *kernels = m->getNamedMetadata("opencl.kernels");
   if (kernels == NULL) {
-    if (KernelName == "")
+    std::string kernel = kernelToProcess(*m);
+    if (kernel == "")
       return true;
-    if (F.getName() == KernelName)
+    if (F.getName() == kernel)
       return true;
 
     return false;
@@ -31,6 +31,8 @@
 #endif
 #include "llvm/Pass.h"
 
+#include <string>
+
 namespace pocl {
   class Workgroup : public llvm::ModulePass {  
   public:
@@ -41,6 +43,7 @@ namespace pocl {
     virtual bool runOnModule(llvm::Module &M);
 
     static bool isKernelToProcess(const llvm::Function &F);
+    static std::string kernelToProcess(const llvm::Module &M);
 
   };
 }
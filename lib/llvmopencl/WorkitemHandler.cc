@@ -42,6 +42,7 @@
 #include "llvm/Support/CommandLine.h"
 #include "WorkitemHandler.h"
 #include "Kernel.h"
+#include "LLVMUtils.h"
 
 //#define DEBUG_REFERENCE_FIXING
 
@@ -74,9 +75,25 @@ WorkitemHandler::Initialize(Kernel *K)
 {
   llvm::Module *M = K->getParent();
   
-  LocalSizeX = LocalSize[0];
-  LocalSizeY = LocalSize[1];
-  LocalSizeZ = LocalSize[2];
+  unsigned long x, y, z;
+  if (getKernelCompilerParam(*M, "local_size_x", x) &&
+      getKernelCompilerParam(*M, "local_size_y", y) &&
+      getKernelCompilerParam(*M, "local_size_z", z))
+    {
+      LocalSizeX = x;
+      LocalSizeY = y;
+      LocalSizeZ = z;
+    }
+  else
+    {
+      LocalSizeX = LocalSize[0];
+      LocalSizeY = LocalSize[1];
+      LocalSizeZ = LocalSize[2];
+    }
+
+  unsigned long dynamic = 0;
+  DynamicLocalSize = 
+    getKernelCompilerParam(*M, "dynamic_local_size", dynamic) && dynamic;
   
   llvm::NamedMDNode *size_info = M->getNamedMetadata("opencl.kernel_wg_size_info");
   if (size_info) {
@@ -86,6 +103,7 @@ WorkitemHandler::Initialize(Kernel *K)
         LocalSizeX = (llvm::cast<ConstantInt>(KernelSizeInfo->getOperand(1)))->getLimitedValue();
         LocalSizeY = (llvm::cast<ConstantInt>(KernelSizeInfo->getOperand(2)))->getLimitedValue();
         LocalSizeZ = (llvm::cast<ConstantInt>(KernelSizeInfo->getOperand(3)))->getLimitedValue();
+        DynamicLocalSize = false;
       }
     }
   }
@@ -59,6 +59,9 @@ namespace pocl {
     bool dominatesUse(llvm::DominatorTree *DT, llvm::Instruction &I, unsigned i);
 
     int LocalSizeX, LocalSizeY, LocalSizeZ;
+    /* The local size is not known at compile time but read from the
+       pocl_context at run time. Only the work-item loops support it. */
+    bool DynamicLocalSize;
 
     unsigned size_t_width;
 
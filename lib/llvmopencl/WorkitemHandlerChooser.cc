@@ -29,15 +29,156 @@
 #include "Workgroup.h"
 #include "CanonicalizeBarriers.h"
 #include "Kernel.h"
+#include "Barrier.h"
+#include "LLVMUtils.h"
 
 #include "llvm/Analysis/PostDominators.h"
 #include "llvm/Analysis/LoopInfo.h"
+#include "llvm/ADT/SmallVector.h"
+#if (defined LLVM_3_2 or defined LLVM_3_3)
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#else
+#include "llvm/Analysis/CFG.h"
+#endif
+#ifdef LLVM_3_1
+#include "llvm/Target/TargetData.h"
+#elif defined LLVM_3_2
+#include "llvm/DataLayout.h"
+#else
+#include "llvm/IR/DataLayout.h"
+#endif
+
+#if (defined LLVM_3_1 or defined LLVM_3_2)
+#include "llvm/Instructions.h"
+#else
+#include "llvm/IR/Instructions.h"
+#endif
 
 #include <iostream>
 
+/* The instructions the fully replicated work-group function can have 
+   before its code size costs more than the loops save. */
+#define MAX_REPLICATED_INSTRUCTIONS 512
+/* The instructions of the work-item loop: the increment, the compare and
+   the branch. */
+#define LOOP_OVERHEAD 3
+/* The deepest call chain whose instructions are counted. OpenCL C does 
+   not allow recursion, this only guards against malformed input. */
+#define MAX_CALL_DEPTH 16
+
 using namespace llvm;
 using namespace pocl;
 
+namespace {
+  /* The properties of a kernel the estimate of the best work-group 
+     method is based on. */
+  struct KernelCost {
+    KernelCost() : Instructions(0), Barriers(0), ContextBytes(0),
+                   VectorWidth(0), HasLoops(false), HasBranches(false) {}
+    /* The instructions of a work-item, including the callees which are
+       inlined later on. */
+    unsigned long Instructions;
+    /* Each barrier starts a new parallel region. */
+    unsigned long Barriers;
+    /* The private data of a work-item: the allocas and the values used
+       outside of the basic block defining them. With multiple parallel
+       regions the loops store them in the context arrays. */
+    unsigned long ContextBytes;
+    /* The narrowest native vector width of the loaded and stored types,
+       the work-items the vectorized methods process at a time. */
+    unsigned long VectorWidth;
+    /* The kernel has loops, so the work-item loop is not an innermost
+       loop the loop vectorizer could vectorize. */
+    bool HasLoops;
+    /* The kernel has conditional code which the loop vectorizer might
+       fail to if-convert, but which does not stop the SLP vectorizer from
+       combining the straight-line parts of the unrolled work-items. 
+
+       The loops and the branches are looked for only in the kernel 
+       itself, as those of the built-ins mostly depend on constant 
+       arguments, such as the dimension of get_global_id(), and are 
+       folded away after inlining. */
+    bool HasBranches;
+  };
+}
+
+#ifdef LLVM_3_1
+static void
+AddFunctionCost(Function &F, TargetData &TD, KernelCost &Cost, unsigned Depth)
+#else
+static void
+AddFunctionCost(Function &F, DataLayout &TD, KernelCost &Cost, unsigned Depth)
+#endif
+{
+  Module &M = *F.getParent();
+  if (Depth == 0)
+    {
+      SmallVector<std::pair<const BasicBlock*, const BasicBlock*>, 8> 
+        backedges;
+      FindFunctionBackedges(F, backedges);
+      if (!backedges.empty())
+        Cost.HasLoops = true;
+    }
+
+  for (Function::iterator fi = F.begin(); fi != F.end(); ++fi)
+    {
+      BasicBlock *bb = fi;
+      TerminatorInst *t = bb->getTerminator();
+      if (Depth == 0 && t != NULL && t->getNumSuccessors() > 1)
+        Cost.HasBranches = true;
+
+      for (BasicBlock::iterator i = bb->begin(); i != bb->end(); ++i)
+        {
+          Instruction *instr = i;
+          ++Cost.Instructions;
+
+          if (isa<Barrier>(instr))
+            {
+              ++Cost.Barriers;
+              continue;
+            }
+
+          if (AllocaInst *alloca = dyn_cast<AllocaInst>(instr))
+            {
+              Cost.ContextBytes += 
+                TD.getTypeAllocSize(alloca->getAllocatedType());
+              continue;
+            }
+
+          Type *type = NULL;
+          if (LoadInst *load = dyn_cast<LoadInst>(instr))
+            type = load->getType();
+          else if (StoreInst *store = dyn_cast<StoreInst>(instr))
+            type = store->getValueOperand()->getType();
+          unsigned long width;
+          if (type != NULL && getNativeVectorWidth(M, type, width) &&
+              (Cost.VectorWidth == 0 || width < Cost.VectorWidth))
+            Cost.VectorWidth = width;
+
+          if (CallInst *call = dyn_cast<CallInst>(instr))
+            {
+              Function *callee = call->getCalledFunction();
+              if (callee != NULL && !callee->isDeclaration() &&
+                  Depth < MAX_CALL_DEPTH)
+                AddFunctionCost(*callee, TD, Cost, Depth + 1);
+            }
+
+          if (instr->getType()->isVoidTy())
+            continue;
+          for (Value::use_iterator u = instr->use_begin(); 
+               u != instr->use_end(); ++u)
+            {
+              Instruction *user = dyn_cast<Instruction>(*u);
+              if (user != NULL && user->getParent() != bb)
+                {
+                  Cost.ContextBytes += TD.getTypeAllocSize(instr->getType());
+                  break;
+                }
+            }
+        }
+    }
+}
+
 namespace {
   static
   RegisterPass<WorkitemHandlerChooser> X(
@@ -65,49 +206,133 @@ WorkitemHandlerChooser::runOnFunction(Function &F)
     return false;
 
   Kernel *K = cast<Kernel> (&F);
-
-  /* FIXME: this is not thread safe. We cannot compile multiple kernels at
-     the same time with the same instances of these passes as they store
-     to private attributes and use global values to pass in the dimensions.
-     In the LLVMAPI version this logic should be at higher-level when
-     constructing the passes for the kernel, or done fully inside a single
-     FunctionPass that delegates to other passes. */    
   Initialize(K);
 
+  /* The method is a kernel compiler parameter of the Module in the
+     LLVM API version. The pocl-workgroup script passes it in the
+     environment. */
   std::string method = "auto";
-  if (getenv("POCL_WORK_GROUP_METHOD") != NULL)
+  if (!getKernelCompilerParam(*F.getParent(), "wg_method", method) &&
+      getenv("POCL_WORK_GROUP_METHOD") != NULL)
+    method = getenv("POCL_WORK_GROUP_METHOD");
+
+  if (method == "repl" || method == "workitemrepl")
+    chosenHandler_ = POCL_WIH_FULL_REPLICATION;
+  else if (method == "loops" || method == "workitemloops" || 
+           method == "loopvec" || method == "hybrid")
+    chosenHandler_ = POCL_WIH_LOOPS;
+  else if (method != "auto")
     {
-      method = getenv("POCL_WORK_GROUP_METHOD");
-      if (method == "repl" || method == "workitemrepl")
-        chosenHandler_ = POCL_WIH_FULL_REPLICATION;
-      else if (method == "loops" || method == "workitemloops" || method == "loopvec")
-        chosenHandler_ = POCL_WIH_LOOPS;
-      else if (method != "auto")
-        {
-          std::cerr << "Unknown work group generation method. Using 'auto'." << std::endl;
-          method = "auto";
-        }
+      std::cerr << "Unknown work group generation method. Using 'auto'." << std::endl;
+      method = "auto";
+    }
+
+  if (DynamicLocalSize)
+    {
+      /* Replication needs the local size at compile time. */
+      chosenHandler_ = POCL_WIH_LOOPS;
+      return false;
     }
 
   if (method == "auto") 
     {
-      int ReplThreshold = 2;
-      if (getenv("POCL_FULL_REPLICATION_THRESHOLD") != NULL) 
-      {
-        ReplThreshold = atoi(getenv("POCL_FULL_REPLICATION_THRESHOLD"));
-      }
-      
-      if (LocalSizeX*LocalSizeY*LocalSizeZ <= ReplThreshold)
-        {
-          chosenHandler_ = POCL_WIH_FULL_REPLICATION;
-        }
+      if (EstimateMethod(F, LocalSizeX*LocalSizeY*LocalSizeZ) == "repl")
+        chosenHandler_ = POCL_WIH_FULL_REPLICATION;
       else
-        {
-          chosenHandler_ = POCL_WIH_LOOPS;
-        }
+        chosenHandler_ = POCL_WIH_LOOPS;
     }
 
   return false;
 }
 
+/**
+ * Estimates the fastest work-group method ("repl", "loops", "loopvec" or
+ * "hybrid") for the kernel with a simple cost model.
+ *
+ * The cost of each method is the number of instructions executed for as
+ * many work-items as fit in a SIMD vector. The loops pay the loop overhead 
+ * per parallel region and save and restore the context of the work-items
+ * between the regions. Replication has neither of those costs, but is 
+ * limited by the size of the replicated code. The loop vectorizer executes
+ * the whole vector at once, but only for the innermost loops without 
+ * conditional code. The SLP vectorizer of the hybrid method is assumed to
+ * vectorize half of the unrolled code.
+ *
+ * WorkGroupSize is the number of work-items in a work-group, 0 if it is
+ * not known at compile time. The native vector widths of the device are
+ * read from the kernel compiler parameters.
+ */
+std::string
+WorkitemHandlerChooser::EstimateMethod(Function &F, 
+                                       unsigned long WorkGroupSize)
+{
+  Module &M = *F.getParent();
+
+  unsigned long ReplThreshold = 2;
+  if (!getKernelCompilerParam(M, "full_replication_threshold", 
+                              ReplThreshold) &&
+      getenv("POCL_FULL_REPLICATION_THRESHOLD") != NULL) 
+    {
+      ReplThreshold = atoi(getenv("POCL_FULL_REPLICATION_THRESHOLD"));
+    }
+  if (WorkGroupSize > 0 && WorkGroupSize <= ReplThreshold)
+    return "repl";
+
+#ifdef LLVM_3_1
+  TargetData TD(&M);
+#else
+  DataLayout TD(&M);
+#endif
+  KernelCost Cost;
+  AddFunctionCost(F, TD, Cost, 0);
+
+  unsigned long Width = Cost.VectorWidth;
+#ifdef LLVM_3_2
+  /* The vectorizers are not used with LLVM 3.2. */
+  Width = 1;
+#endif
+  while ((Width & (Width - 1)) != 0)
+    Width &= Width - 1;
+  while (WorkGroupSize > 0 && Width > WorkGroupSize)
+    Width /= 2;
+  if (Width == 0)
+    Width = 1;
+
+  unsigned long Regions = Cost.Barriers + 1;
+  /* A save and a restore per word of the private data at each border of 
+     the parallel regions. */
+  unsigned long ContextOps = 
+    Regions > 1 ? (Cost.ContextBytes + 3) / 4 * 2 * (Regions - 1) : 0;
+  unsigned long Work = Cost.Instructions + ContextOps;
+
+  std::string Method = "loops";
+  unsigned long Best = Width * (Work + LOOP_OVERHEAD * Regions);
+
+  /* The instruction count does not tell the trip counts of the loops, 
+     which replication would unroll in case they have barriers. */
+  if (WorkGroupSize > 0 && !Cost.HasLoops &&
+      WorkGroupSize * Cost.Instructions <= MAX_REPLICATED_INSTRUCTIONS &&
+      Width * Cost.Instructions < Best)
+    {
+      Method = "repl";
+      Best = Width * Cost.Instructions;
+    }
+
+  if (Width > 1 && !Cost.HasLoops && !Cost.HasBranches &&
+      Work + LOOP_OVERHEAD * Regions < Best)
+    {
+      Method = "loopvec";
+      Best = Work + LOOP_OVERHEAD * Regions;
+    }
+
+  if (Width > 1 && !Cost.HasLoops &&
+      Work * (Width + 1) / 2 + LOOP_OVERHEAD * Regions < Best)
+    {
+      Method = "hybrid";
+      Best = Work * (Width + 1) / 2 + LOOP_OVERHEAD * Regions;
+    }
+
+  return Method;
+}
+
 }
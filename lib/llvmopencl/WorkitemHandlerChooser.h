@@ -25,6 +25,8 @@
 
 #include "WorkitemHandler.h"
 
+#include <string>
+
 namespace pocl {
   class Workgroup;
 
@@ -44,6 +46,9 @@ namespace pocl {
     virtual bool runOnFunction(llvm::Function &F);
     
     WorkitemHandlerType chosenHandler() { return chosenHandler_; }
+
+    static std::string EstimateMethod(llvm::Function &F, 
+                                      unsigned long WorkGroupSize);
   private:
     WorkitemHandlerType chosenHandler_;
   };
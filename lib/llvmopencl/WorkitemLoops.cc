@@ -54,13 +54,17 @@
 #include "llvm/IR/ValueSymbolTable.h"
 #endif
 #include "llvm/Analysis/PostDominators.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 
 #include "WorkitemHandlerChooser.h"
+#include "LLVMUtils.h"
 
+#include <algorithm>
 #include <iostream>
 #include <map>
 #include <sstream>
+#include <set>
 #include <vector>
 
 //#define DUMP_CFGS
@@ -70,9 +74,15 @@
 //#define DEBUG_WORK_ITEM_LOOPS
 
 #include "VariableUniformityAnalysis.h"
+#include "pocl.h"
 
 #define CONTEXT_ARRAY_ALIGN 64
 
+/* The number of context saved values restored in a single parallel region
+   from which on the context data is laid out as per work-item records,
+   unless the work-item loops are to be vectorized. */
+#define CONTEXT_RECORD_MIN_VALUES 4
+
 using namespace llvm;
 using namespace pocl;
 
@@ -84,6 +94,163 @@ namespace {
 
 char WorkitemLoops::ID = 0;
 
+STATISTIC(ContextArrays, "Number of context arrays allocated");
+STATISTIC(SharedContextValues, "Number of values sharing a context array");
+STATISTIC(HoistedUniforms, 
+          "Number of uniform instructions hoisted out of the work-item loops");
+STATISTIC(ContextBytesSaved, 
+          "Context bytes per work-item saved by sharing the context arrays");
+
+namespace {
+  /* A context array shared by values of the same size, and the parallel 
+     regions it is in use in. */
+  struct ContextSlot {
+    llvm::Type *type;
+    uint64_t size;
+    unsigned align;
+    std::set<ParallelRegion*> liveRegions;
+    std::vector<llvm::Instruction*> values;
+  };
+}
+
+/* Returns the index of the current work-item in a flat context array
+   of a work-group with the given (run time) local size. */
+static llvm::Value *
+flatLocalIdIndex
+(IRBuilder<> &builder, ParallelRegion *region, 
+ llvm::Value *localSizeX, llvm::Value *localSizeY)
+{
+  return builder.CreateAdd
+    (builder.CreateMul
+     (builder.CreateAdd
+      (builder.CreateMul(region->LocalIDZLoad(), localSizeY),
+       region->LocalIDYLoad()), 
+      localSizeX),
+     region->LocalIDXLoad());
+}
+
+/* Casts a pointer to a context array element to point to the type of the
+   given value, in case the value shares the array with another type. */
+static llvm::Value *
+contextSlotPointer
+(IRBuilder<> &builder, llvm::Value *elementPtr, llvm::Type *valueType)
+{
+  llvm::Type *ptrType = valueType->getPointerTo();
+  if (elementPtr->getType() == ptrType)
+    return elementPtr;
+  return builder.CreateBitCast(elementPtr, ptrType);
+}
+
+/* The work-group generation method of the compilation. The method is a 
+   kernel compiler parameter of the Module in the LLVM API version, the 
+   pocl-workgroup script passes it in the environment. */
+static std::string
+workGroupMethod(llvm::Module &M)
+{
+  std::string method = "auto";
+  if (!getKernelCompilerParam(M, "wg_method", method) &&
+      getenv("POCL_WORK_GROUP_METHOD") != NULL)
+    method = getenv("POCL_WORK_GROUP_METHOD");
+  return method;
+}
+
+/* Adds the given loop identifier to the parallel loop access metadata of
+   the memory instructions in the body of a work-item loop. The body is
+   walked from its entry until the loop header, so the unrolled and peeled
+   copies of the region as well as the control code of the inner work-item
+   loops are included. The accesses to the iteration variable of the loop
+   itself are left unmarked as they carry a dependence between the
+   iterations until the variable is promoted to a register. */
+static void
+markParallelLoopAccesses
+(llvm::BasicBlock *entryBB, llvm::BasicBlock *headerBB, 
+ llvm::Value *localIdVar, llvm::MDNode *loopId)
+{
+  std::set<llvm::BasicBlock*> visited;
+  std::vector<llvm::BasicBlock*> worklist;
+  worklist.push_back(entryBB);
+  visited.insert(headerBB);
+  while (!worklist.empty())
+    {
+      llvm::BasicBlock *bb = worklist.back();
+      worklist.pop_back();
+      if (!visited.insert(bb).second)
+        continue;
+
+      for (llvm::BasicBlock::iterator ii = bb->begin(), ee = bb->end();
+           ii != ee; ++ii)
+        {
+          if (!ii->mayReadOrWriteMemory())
+            continue;
+          if (LoadInst *load = dyn_cast<LoadInst>(ii))
+            {
+              if (load->getPointerOperand() == localIdVar)
+                continue;
+            }
+          else if (StoreInst *store = dyn_cast<StoreInst>(ii))
+            {
+              if (store->getPointerOperand() == localIdVar)
+                continue;
+            }
+          std::vector<Value*> loopIds;
+          MDNode *oldIds = ii->getMetadata("llvm.mem.parallel_loop_access");
+          if (oldIds != NULL) 
+            {
+              for (unsigned i = 0; i < oldIds->getNumOperands(); ++i)
+                loopIds.push_back(oldIds->getOperand(i));
+            }
+          loopIds.push_back(loopId);
+          ii->setMetadata("llvm.mem.parallel_loop_access", 
+                          MDNode::get(bb->getContext(), loopIds));
+        }
+
+      for (llvm::succ_iterator si = llvm::succ_begin(bb), 
+             se = llvm::succ_end(bb); si != se; ++si)
+        worklist.push_back(*si);
+    }
+}
+
+/* Marks the pointer arguments of the kernel 'noalias' as if they were
+   declared 'restrict'. Only done when the application promises that
+   the buffers passed to a kernel do not overlap. The attributes are
+   copied to the launcher where the kernel is inlined, which lets the
+   generic LICM and vectorizers see that the accesses through the 
+   different arguments are independent. */
+static void
+addNoAliasArguments(llvm::Function &F)
+{
+  for (Function::arg_iterator a = F.arg_begin(), e = F.arg_end(); 
+       a != e; ++a)
+    {
+      if (!a->getType()->isPointerTy() || a->hasNoAliasAttr())
+        continue;
+#ifdef LLVM_3_1
+      a->addAttr(Attribute::NoAlias);
+#elif defined LLVM_3_2
+      AttrBuilder b;
+      a->addAttr
+        (Attributes::get(F.getContext(), b.addAttribute(Attributes::NoAlias)));
+#else
+      a->addAttr
+        (AttributeSet::get
+         (F.getContext(), a->getArgNo() + 1, Attribute::NoAlias));
+#endif
+    }
+}
+
+static bool
+disjointRegions
+(const std::set<ParallelRegion*> &a, const std::set<ParallelRegion*> &b)
+{
+  for (std::set<ParallelRegion*>::const_iterator i = a.begin(), e = a.end();
+       i != e; ++i)
+    {
+      if (b.find(*i) != b.end())
+        return false;
+    }
+  return true;
+}
+
 void
 WorkitemLoops::getAnalysisUsage(AnalysisUsage &AU) const
 {
@@ -147,6 +314,9 @@ WorkitemLoops::runOnFunction(Function &F)
   F.viewCFG();
 #endif
   contextArrays.clear();
+  contextSlots.clear();
+  contextFields.clear();
+  blockRegions.clear();
   tempInstructionIds.clear();
 
   return changed;
@@ -156,8 +326,8 @@ std::pair<llvm::BasicBlock *, llvm::BasicBlock *>
 WorkitemLoops::CreateLoopAround
 (ParallelRegion &region,
  llvm::BasicBlock *entryBB, llvm::BasicBlock *exitBB, 
- bool peeledFirst, llvm::Value *localIdVar, size_t LocalSizeForDim,
- bool addIncBlock) 
+ bool peeledFirst, llvm::Value *localIdVar, llvm::Value *LocalSizeForDim,
+ bool addIncBlock, unsigned vectorWidth) 
 {
   assert (localIdVar != NULL);
 
@@ -268,7 +438,12 @@ WorkitemLoops::CreateLoopAround
         (ConstantInt::get(IntegerType::get(C, size_t_width), 0), localIdVar);
     }
 
-  builder.CreateBr(loopBodyEntryBB);
+  /* With a dynamic local size the peeled loop might have no iterations
+     left, check the condition first. */
+  if (peeledFirst && DynamicLocalSize)
+    builder.CreateBr(forCondBB);
+  else
+    builder.CreateBr(loopBodyEntryBB);
 
   exitBB->getTerminator()->replaceUsesOfWith(oldExit, forCondBB);
   if (addIncBlock)
@@ -279,10 +454,7 @@ WorkitemLoops::CreateLoopAround
   builder.SetInsertPoint(forCondBB);
   llvm::Value *cmpResult = 
     builder.CreateICmpULT
-    (builder.CreateLoad(localIdVar),
-     (ConstantInt::get
-      (IntegerType::get(C, size_t_width), 
-       LocalSizeForDim)));
+    (builder.CreateLoad(localIdVar), LocalSizeForDim);
       
   Instruction *loopBranch =
       builder.CreateCondBr(cmpResult, loopBodyEntryBB, loopEndBB);
@@ -294,7 +466,19 @@ WorkitemLoops::CreateLoopAround
   /* This creation of the identifier metadata is copied from
      LLVM's MDBuilder::createAnonymousTBAARoot(). */
   MDNode *Dummy = MDNode::getTemporary(C, ArrayRef<Value*>());
-  MDNode *Root = MDNode::get(C, Dummy);
+  std::vector<Value*> loopIdOperands;
+  loopIdOperands.push_back(Dummy);
+#if !defined LLVM_3_2 && !defined LLVM_3_3
+  /* The vectorization width hint for the loop vectorizer. */
+  if (vectorWidth > 1)
+    {
+      Value *widthHint[] = 
+        { MDString::get(C, "llvm.vectorizer.width"),
+          ConstantInt::get(IntegerType::get(C, 32), vectorWidth) };
+      loopIdOperands.push_back(MDNode::get(C, widthHint));
+    }
+#endif
+  MDNode *Root = MDNode::get(C, loopIdOperands);
   // At this point we have
   //   !0 = metadata !{}            <- dummy
   //   !1 = metadata !{metadata !0} <- root
@@ -309,7 +493,7 @@ WorkitemLoops::CreateLoopAround
 #else
   loopBranch->setMetadata("llvm.loop", Root);
 #endif
-  region.AddParallelLoopMetadata(Root);
+  markParallelLoopAccesses(loopBodyEntryBB, forCondBB, localIdVar, Root);
 
   builder.SetInsertPoint(loopEndBB);
   builder.CreateBr(oldExit);
@@ -338,7 +522,48 @@ WorkitemLoops::ProcessFunction(Function &F)
   Initialize(K);
   unsigned workItemCount = LocalSizeX*LocalSizeY*LocalSizeZ;
 
-  if (workItemCount == 1)
+  /* The hybrid method unrolls the work-item loops by the SIMD width of
+     the device to produce straight-line code of multiple work-items for
+     the vectorizers. */
+  const bool hybrid = workGroupMethod(*F.getParent()) == "hybrid";
+
+  unsigned long noAliasArgs = 0;
+  if (!getKernelCompilerParam(*F.getParent(), "noalias_args", noAliasArgs) &&
+      getenv("POCL_KERNEL_ARGS_NOALIAS") != NULL)
+    noAliasArgs = atoi(getenv("POCL_KERNEL_ARGS_NOALIAS"));
+  if (noAliasArgs)
+    addNoAliasArguments(F);
+
+  llvm::Type *SizeT = IntegerType::get(F.getContext(), size_t_width);
+  llvm::Value *localSizeForDim[3];
+  if (DynamicLocalSize)
+    {
+      /* The launcher stores the local size from the pocl_context to the
+         globals before entering the kernel. */
+      llvm::Module *M = F.getParent();
+      IRBuilder<> builder(F.getEntryBlock().getFirstInsertionPt());
+      dynLocalSizeX = 
+        builder.CreateLoad(M->getOrInsertGlobal("_local_size_x", SizeT));
+      dynLocalSizeY = 
+        builder.CreateLoad(M->getOrInsertGlobal("_local_size_y", SizeT));
+      dynLocalSizeZ = 
+        builder.CreateLoad(M->getOrInsertGlobal("_local_size_z", SizeT));
+      dynWorkItemCount = cast<Instruction>
+        (builder.CreateMul
+         (builder.CreateMul(dynLocalSizeX, dynLocalSizeY), dynLocalSizeZ,
+          ".pocl.work_item_count"));
+      localSizeForDim[0] = dynLocalSizeX;
+      localSizeForDim[1] = dynLocalSizeY;
+      localSizeForDim[2] = dynLocalSizeZ;
+    }
+  else
+    {
+      localSizeForDim[0] = ConstantInt::get(SizeT, LocalSizeX);
+      localSizeForDim[1] = ConstantInt::get(SizeT, LocalSizeY);
+      localSizeForDim[2] = ConstantInt::get(SizeT, LocalSizeZ);
+    }
+
+  if (!DynamicLocalSize && workItemCount == 1)
     {
       K->addLocalSizeInitCode(LocalSizeX, LocalSizeY, LocalSizeZ);
       ParallelRegion::insertLocalIdInit(&F.getEntryBlock(), 0, 0, 0);
@@ -381,6 +606,8 @@ WorkitemLoops::ProcessFunction(Function &F)
   /* Count how many parallel regions share each entry node to
      detect diverging regions that need to be peeled. */
   std::map<llvm::BasicBlock*, int> entryCounts;
+  InstructionVec instructionsToFix;
+  InstructionIndex instructionsFound;
 
   for (ParallelRegion::ParallelRegionVector::iterator
            i = original_parallel_regions->begin(), 
@@ -388,19 +615,40 @@ WorkitemLoops::ProcessFunction(Function &F)
        i != e; ++i) 
   {
     ParallelRegion *region = (*i);
-#ifdef DEBUG_WORK_ITEM_LOOPS
-    std::cerr << "### Adding context save/restore for PR: ";
-    region->dumpNames();    
-#endif
-    FixMultiRegionVariables(region);
+    for (BasicBlockVector::iterator bb = region->begin();
+         bb != region->end(); ++bb)
+      blockRegions[*bb].push_back(region);
+  }
+
+  for (ParallelRegion::ParallelRegionVector::iterator
+           i = original_parallel_regions->begin(), 
+           e = original_parallel_regions->end();
+       i != e; ++i) 
+  {
+    ParallelRegion *region = (*i);
+    FindMultiRegionVariables(region, instructionsToFix, instructionsFound);
     entryCounts[region->entryBB()]++;
   }
 
+  AssignContextSlots(F, instructionsToFix);
+
+  /* Finally, fix the instructions. */
+  for (InstructionVec::iterator i = instructionsToFix.begin();
+       i != instructionsToFix.end(); ++i)
+    {
+#ifdef DEBUG_WORK_ITEM_LOOPS
+      std::cerr << "### adding context/save restore for" << std::endl;
+      (*i)->dump();
+#endif 
+      AddContextSaveRestore(*i);
+    }
+
 #if 0
   std::cerr << "### After context code addition:" << std::endl;
   F.viewCFG();
 #endif
   std::map<ParallelRegion*, bool> peeledRegion;
+  std::map<ParallelRegion*, llvm::BasicBlock*> loopPreheaders;
   for (ParallelRegion::ParallelRegionVector::iterator
            i = original_parallel_regions->begin(), 
            e = original_parallel_regions->end();
@@ -465,8 +713,12 @@ WorkitemLoops::ProcessFunction(Function &F)
           }
 
         int unrollCount;
-        if (getenv("POCL_WILOOPS_MAX_UNROLL_COUNT") != NULL)
+        if (DynamicLocalSize)
+            unrollCount = 1;
+        else if (getenv("POCL_WILOOPS_MAX_UNROLL_COUNT") != NULL)
             unrollCount = atoi(getenv("POCL_WILOOPS_MAX_UNROLL_COUNT"));
+        else if (hybrid)
+            unrollCount = std::max(NativeVectorWidth(original), 1u);
         else
             unrollCount = 1;
         /* Find a two's exponent unroll count, if available. */
@@ -487,7 +739,7 @@ WorkitemLoops::ProcessFunction(Function &F)
             original->AddBlockAfter(lastBB, original->exitBB());
             original->SetExitBB(lastBB);
 
-            if (AddWIMetadata)
+            if (AddWIMetadata || hybrid)
                 original->AddIDMetadata(F.getContext(), 0);
 
             for (int c = 1; c < unrollCount; ++c) 
@@ -497,7 +749,7 @@ WorkitemLoops::ProcessFunction(Function &F)
                 unrolled->chainAfter(prev);
                 prev = unrolled;
                 lastBB = unrolled->exitBB();
-                if (AddWIMetadata)
+                if (AddWIMetadata || hybrid)
                     unrolled->AddIDMetadata(F.getContext(), c);
             }
             unrolled = true;
@@ -507,14 +759,21 @@ WorkitemLoops::ProcessFunction(Function &F)
         }
       }
 
-    if (LocalSizeX > 1)
-      l = CreateLoopAround(*original, l.first, l.second, peelFirst, localIdX, LocalSizeX, !unrolled);
+    if (DynamicLocalSize || LocalSizeX > 1)
+      l = CreateLoopAround(*original, l.first, l.second, peelFirst, localIdX, 
+                           localSizeForDim[0], !unrolled, 
+                           VectorWidth(original));
+
+    if (DynamicLocalSize || LocalSizeY > 1)
+      l = CreateLoopAround(*original, l.first, l.second, false, localIdY, 
+                           localSizeForDim[1]);
 
-    if (LocalSizeY > 1)
-      l = CreateLoopAround(*original, l.first, l.second, false, localIdY, LocalSizeY);
+    if (DynamicLocalSize || LocalSizeZ > 1)
+      l = CreateLoopAround(*original, l.first, l.second, false, localIdZ, 
+                           localSizeForDim[2]);
 
-    if (LocalSizeZ > 1)
-      l = CreateLoopAround(*original, l.first, l.second, false, localIdZ, LocalSizeZ);
+    if (!peelFirst && !unrolled)
+      loopPreheaders[original] = l.first;
 
     /* Loop edges coming from another region mean B-loops which means 
        we have to fix the loop edge to jump to the beginning of the wi-loop 
@@ -551,7 +810,13 @@ WorkitemLoops::ProcessFunction(Function &F)
        localIdXFirstVar);       
   }
 
-  K->addLocalSizeInitCode(LocalSizeX, LocalSizeY, LocalSizeZ);
+  DT->runOnFunction(F);
+  for (std::map<ParallelRegion*, llvm::BasicBlock*>::iterator 
+         i = loopPreheaders.begin(), e = loopPreheaders.end(); i != e; ++i)
+    HoistUniformInstructions(i->first, i->second);
+
+  if (!DynamicLocalSize)
+    K->addLocalSizeInitCode(LocalSizeX, LocalSizeY, LocalSizeZ);
   ParallelRegion::insertLocalIdInit(&F.getEntryBlock(), 0, 0, 0);
 
 #if 0
@@ -562,18 +827,21 @@ WorkitemLoops::ProcessFunction(Function &F)
 }
 
 /*
- * Add context save/restore code to variables that are defined in 
- * the given region and are used outside the region.
+ * Find the variables that are defined in the given region and are used
+ * outside the region, thus need context save/restore code.
  *
  * Each such variable gets a slot in the stack frame. The variable
- * is restored from the stack whenever it's used.
+ * is restored from the stack whenever it's used. The blocks shared by
+ * diverging regions are scanned once, the already found instructions
+ * are in 'found'.
  *
  */
 void
-WorkitemLoops::FixMultiRegionVariables(ParallelRegion *region)
+WorkitemLoops::FindMultiRegionVariables
+(ParallelRegion *region, InstructionVec &instructionsToFix, 
+ InstructionIndex &found)
 {
   InstructionIndex instructionsInRegion;
-  InstructionVec instructionsToFix;
 
   /* Construct an index of the region's instructions so it's
      fast to figure out if the variable uses are all
@@ -601,6 +869,7 @@ WorkitemLoops::FixMultiRegionVariables(ParallelRegion *region)
         {
           llvm::Instruction *instruction = instr;
 
+          if (found.find(instruction) != found.end()) continue;
           if (ShouldNotBeContextSaved(instr)) continue;
 
           for (Instruction::use_iterator ui = instruction->use_begin(),
@@ -619,22 +888,234 @@ WorkitemLoops::FixMultiRegionVariables(ParallelRegion *region)
                    RegionOfBlock(user->getParent()) != NULL))
                 {
                   instructionsToFix.push_back(instruction);
+                  found.insert(instruction);
                   break;
                 }
             }
         }
     }  
+}
 
-  /* Finally, fix the instructions. */
-  for (InstructionVec::iterator i = instructionsToFix.begin();
-       i != instructionsToFix.end(); ++i)
+/**
+ * Collects the parallel regions in which the context array slot of the
+ * given value must be kept intact: the regions the value is defined in,
+ * restored in, or passes through to a later use.
+ *
+ * The liveness is computed on the original CFG by walking backwards from
+ * the uses until the definition, thus the regions are conservative also
+ * for the b-loops that execute the regions multiple times.
+ */
+void
+WorkitemLoops::ContextLiveRegions
+(llvm::Instruction *instruction, ParallelRegionSet &regions)
+{
+  std::set<llvm::BasicBlock*> liveBlocks;
+  BasicBlockVector worklist;
+
+  liveBlocks.insert(instruction->getParent());
+  for (Instruction::use_iterator ui = instruction->use_begin(),
+         ue = instruction->use_end();
+       ui != ue; ++ui) 
     {
-#ifdef DEBUG_WORK_ITEM_LOOPS
-      std::cerr << "### adding context/save restore for" << std::endl;
-      (*i)->dump();
-#endif 
-      llvm::Instruction *instructionToFix = *i;
-      AddContextSaveRestore(instructionToFix);
+      Instruction *user;
+      if ((user = dyn_cast<Instruction> (*ui)) == NULL) continue;
+      PHINode *phi = dyn_cast<PHINode>(user);
+      if (phi == NULL) 
+        {
+          worklist.push_back(user->getParent());
+          continue;
+        }
+      /* The value of a PHI is restored in the incoming block. */
+      for (unsigned incoming = 0; incoming < phi->getNumIncomingValues(); 
+           ++incoming)
+        {
+          if (phi->getIncomingValue(incoming) == instruction)
+            worklist.push_back(phi->getIncomingBlock(incoming));
+        }
+    }
+
+  while (!worklist.empty())
+    {
+      llvm::BasicBlock *bb = worklist.back();
+      worklist.pop_back();
+      if (!liveBlocks.insert(bb).second) continue;
+      for (llvm::pred_iterator PI = llvm::pred_begin(bb), 
+             E = llvm::pred_end(bb); PI != E; ++PI)
+        worklist.push_back(*PI);
+    }
+
+  for (std::set<llvm::BasicBlock*>::iterator i = liveBlocks.begin(),
+         e = liveBlocks.end(); i != e; ++i)
+    {
+      std::vector<ParallelRegion*> &inRegions = blockRegions[*i];
+      regions.insert(inRegions.begin(), inRegions.end());
+    }
+}
+
+/**
+ * Packs the context saved values to shared context arrays.
+ *
+ * Values of the same size and alignment whose live regions do not
+ * overlap use the same context array, which reduces the stack usage and
+ * the cache footprint of the work-group function. Private arrays 
+ * (allocas) keep their own context arrays as their contents are not 
+ * tracked by the SSA liveness.
+ */
+void
+WorkitemLoops::AssignContextSlots
+(Function &F, InstructionVec &instructions)
+{
+#ifdef LLVM_3_1
+  TargetData &TD = getAnalysis<TargetData>();
+#else
+  DataLayout &TD = getAnalysis<DataLayout>();
+#endif
+
+  std::vector<ContextSlot> slots;
+  uint64_t unsharedBytes = 0, privateArrayBytes = 0;
+  unsigned privateArrays = 0;
+  std::map<ParallelRegion*, unsigned> restoredValues;
+  unsigned maxRestoredValues = 0;
+
+  for (InstructionVec::iterator i = instructions.begin(); 
+       i != instructions.end(); ++i)
+    {
+      llvm::Instruction *instruction = *i;
+      if (AllocaInst *alloca = dyn_cast<AllocaInst>(instruction))
+        {
+          uint64_t size = TD.getTypeAllocSize(alloca->getAllocatedType());
+          unsharedBytes += size;
+          privateArrayBytes += size;
+          ++privateArrays;
+          continue;
+        }
+
+      llvm::Type *type = instruction->getType();
+      uint64_t size = TD.getTypeAllocSize(type);
+      unsigned align = TD.getABITypeAlignment(type);
+      unsharedBytes += size;
+
+      ParallelRegionSet liveRegions, useRegions;
+      ContextLiveRegions(instruction, liveRegions);
+
+      for (Instruction::use_iterator ui = instruction->use_begin(),
+             ue = instruction->use_end();
+           ui != ue; ++ui) 
+        {
+          Instruction *user;
+          if ((user = dyn_cast<Instruction> (*ui)) == NULL) continue;
+          std::vector<ParallelRegion*> &inRegions = 
+            blockRegions[user->getParent()];
+          useRegions.insert(inRegions.begin(), inRegions.end());
+        }
+      for (ParallelRegionSet::iterator r = useRegions.begin(); 
+           r != useRegions.end(); ++r)
+        maxRestoredValues = std::max(maxRestoredValues, ++restoredValues[*r]);
+
+      std::vector<ContextSlot>::iterator slot = slots.begin();
+      for (; slot != slots.end(); ++slot)
+        {
+          if (slot->size == size && slot->align == align &&
+              disjointRegions(slot->liveRegions, liveRegions))
+            break;
+        }
+      if (slot == slots.end())
+        {
+          ContextSlot newSlot;
+          newSlot.type = type;
+          newSlot.size = size;
+          newSlot.align = align;
+          slots.push_back(newSlot);
+          slot = slots.end() - 1;
+        }
+      slot->liveRegions.insert(liveRegions.begin(), liveRegions.end());
+      slot->values.push_back(instruction);
+    }
+
+  /* Choose the layout of the context data. The arrays per variable with 
+     the x dimension innermost give unit strides to the vectorized 
+     work-item loops. A region that restores many values touches a cache
+     line per value with them, thus such kernels get an array of records
+     of all the values of a work-item instead, unless the loops are
+     going to be vectorized. */
+  std::string layout = "auto";
+  if (!getKernelCompilerParam(*F.getParent(), "context_layout", layout) &&
+      getenv("POCL_CONTEXT_LAYOUT") != NULL)
+    layout = getenv("POCL_CONTEXT_LAYOUT");
+  if (layout != "auto" && layout != "soa" && layout != "aos")
+    {
+      std::cerr << "Unknown context data layout. Using 'auto'." << std::endl;
+      layout = "auto";
+    }
+  if (layout == "auto")
+    {
+      std::string method = workGroupMethod(*F.getParent());
+      bool vectorized = 
+        method == "loopvec" || method == "hybrid" || AddWIMetadata;
+      layout = 
+        !vectorized && maxRestoredValues >= CONTEXT_RECORD_MIN_VALUES ?
+        "aos" : "soa";
+    }
+
+  uint64_t contextBytes = privateArrayBytes;
+  if (layout == "aos" && slots.size() > 1)
+    {
+      std::vector<llvm::Type*> fields;
+      for (std::vector<ContextSlot>::iterator slot = slots.begin();
+           slot != slots.end(); ++slot)
+        fields.push_back(slot->type);
+      llvm::StructType *record = StructType::get(F.getContext(), fields);
+      llvm::AllocaInst *array = 
+        CreateContextArray(F, record, ".record.pocl_context");
+      for (unsigned field = 0; field < slots.size(); ++field)
+        {
+          std::vector<llvm::Instruction*> &values = slots[field].values;
+          for (std::vector<llvm::Instruction*>::iterator v = values.begin();
+               v != values.end(); ++v)
+            {
+              contextSlots[*v] = array;
+              contextFields[*v] = field;
+            }
+          if (values.size() > 1)
+            SharedContextValues += values.size();
+        }
+      contextBytes += TD.getTypeAllocSize(record);
+    }
+  else
+    {
+      layout = "soa";
+      for (std::vector<ContextSlot>::iterator slot = slots.begin();
+           slot != slots.end(); ++slot)
+        {
+          contextBytes += slot->size;
+          /* A value with an array of its own gets it named after the value
+             in GetContextArray(). */
+          if (slot->values.size() < 2)
+            continue;
+          llvm::AllocaInst *array = 
+            CreateContextArray(F, slot->type, ".shared.pocl_context");
+          for (std::vector<llvm::Instruction*>::iterator 
+                 v = slot->values.begin(); v != slot->values.end(); ++v)
+            contextSlots[*v] = array;
+          SharedContextValues += slot->values.size();
+        }
+    }
+  /* The padding of the records might exceed the savings of sharing. */
+  if (unsharedBytes > contextBytes)
+    ContextBytesSaved += unsharedBytes - contextBytes;
+
+  if (getenv("POCL_VERBOSE") != NULL && !instructions.empty())
+    {
+      std::cerr << "### context data of " << F.getName().str() << ": "
+                << instructions.size() << " values in " 
+                << (layout == "aos" ? 1 : slots.size()) + privateArrays 
+                << " arrays (" << layout << "), "
+                << contextBytes << " bytes per work-item (" 
+                << unsharedBytes << " unshared)";
+      if (!DynamicLocalSize)
+        std::cerr << ", " << contextBytes * LocalSizeX * LocalSizeY * LocalSizeZ
+                  << " bytes per work-group";
+      std::cerr << std::endl;
     }
 }
 
@@ -668,17 +1149,31 @@ WorkitemLoops::AddContextSave
   assert ("Adding context save outside any region produces illegal code." && 
           region != NULL);
 
-  gepArgs.push_back(region->LocalIDZLoad());
-  gepArgs.push_back(region->LocalIDYLoad());
-  gepArgs.push_back(region->LocalIDXLoad());
+  if (DynamicLocalSize)
+    {
+      gepArgs.clear();
+      gepArgs.push_back
+        (flatLocalIdIndex(builder, region, dynLocalSizeX, dynLocalSizeY));
+    }
+  else
+    {
+      gepArgs.push_back(region->LocalIDZLoad());
+      gepArgs.push_back(region->LocalIDYLoad());
+      gepArgs.push_back(region->LocalIDXLoad());
+    }
+
+  AddContextFieldIndex(gepArgs, instruction);
 
-  return builder.CreateStore(instruction, builder.CreateGEP(alloca, gepArgs));
+  return builder.CreateStore
+    (instruction, 
+     contextSlotPointer
+     (builder, builder.CreateGEP(alloca, gepArgs), instruction->getType()));
 }
 
 llvm::Instruction *
 WorkitemLoops::AddContextRestore
 (llvm::Value *val, llvm::Instruction *alloca, llvm::Instruction *before, 
- bool isAlloca)
+ bool isAlloca, llvm::Instruction *savedValue)
 {
   assert (val != NULL);
   assert (alloca != NULL);
@@ -707,10 +1202,20 @@ WorkitemLoops::AddContextRestore
   assert ("Adding context save outside any region produces illegal code." && 
           region != NULL);
 
-  gepArgs.push_back(region->LocalIDZLoad());
-  gepArgs.push_back(region->LocalIDYLoad());
-  gepArgs.push_back(region->LocalIDXLoad());
-
+  if (DynamicLocalSize)
+    {
+      gepArgs.clear();
+      gepArgs.push_back
+        (flatLocalIdIndex(builder, region, dynLocalSizeX, dynLocalSizeY));
+    }
+  else
+    {
+      gepArgs.push_back(region->LocalIDZLoad());
+      gepArgs.push_back(region->LocalIDYLoad());
+      gepArgs.push_back(region->LocalIDXLoad());
+    }
+  if (savedValue != NULL)
+    AddContextFieldIndex(gepArgs, savedValue);
 
   llvm::Instruction *gep = 
     dyn_cast<Instruction>(builder.CreateGEP(alloca, gepArgs));
@@ -720,7 +1225,27 @@ WorkitemLoops::AddContextRestore
        to the elements to emulate the original alloca. */
     return gep;
   }           
-  return builder.CreateLoad(gep);
+  if (savedValue == NULL)
+    return builder.CreateLoad(gep);
+  return builder.CreateLoad
+    (contextSlotPointer(builder, gep, savedValue->getType()));
+}
+
+/**
+ * Adds the index of the field of the value in the context record, in case
+ * the context data is stored as an array of records.
+ */
+void
+WorkitemLoops::AddContextFieldIndex
+(std::vector<llvm::Value *> &gepArgs, llvm::Instruction *instruction)
+{
+  std::map<llvm::Instruction*, unsigned>::iterator field = 
+    contextFields.find(instruction);
+  if (field == contextFields.end())
+    return;
+  gepArgs.push_back
+    (ConstantInt::get
+     (IntegerType::get(instruction->getContext(), 32), field->second));
 }
 
 /**
@@ -730,7 +1255,10 @@ WorkitemLoops::AddContextRestore
 llvm::Instruction *
 WorkitemLoops::GetContextArray(llvm::Instruction *instruction)
 {
-  
+  InstructionMap::iterator slot = contextSlots.find(instruction);
+  if (slot != contextSlots.end())
+    return slot->second;
+
   /*
    * Unnamed temp instructions need a generated name for the
    * context array. Create one using a running integer.
@@ -758,8 +1286,6 @@ WorkitemLoops::GetContextArray(llvm::Instruction *instruction)
   if (contextArrays.find(varName) != contextArrays.end())
     return contextArrays[varName];
 
-  IRBuilder<> builder(instruction->getParent()->getParent()->getEntryBlock().getFirstInsertionPt());
-
   llvm::Type *elementType;
   if (isa<AllocaInst>(instruction))
     {
@@ -779,24 +1305,53 @@ WorkitemLoops::GetContextArray(llvm::Instruction *instruction)
       elementType = instruction->getType();
     }
 
-  /* 3D context array. */
-  llvm::Type *contextArrayType = 
-    ArrayType::get(
+  llvm::AllocaInst *alloca = 
+    CreateContextArray
+    (*instruction->getParent()->getParent(), elementType, varName);
+  contextArrays[varName] = alloca;
+  return alloca;
+}
+
+/**
+ * Creates a context array with an element of the given type for each
+ * work-item.
+ */
+llvm::AllocaInst *
+WorkitemLoops::CreateContextArray
+(llvm::Function &F, llvm::Type *elementType, const std::string &varName)
+{
+  IRBuilder<> builder(F.getEntryBlock().getFirstInsertionPt());
+
+  llvm::AllocaInst *alloca;
+  if (DynamicLocalSize)
+    {
+      /* A flat array of elements for each work-item, allocated once the
+         local size is known. */
+      BasicBlock::iterator insertPt = dynWorkItemCount;
+      ++insertPt;
+      builder.SetInsertPoint(insertPt);
+      alloca = builder.CreateAlloca(elementType, dynWorkItemCount, varName);
+    }
+  else
+    {
+      /* 3D context array. */
+      llvm::Type *contextArrayType = 
         ArrayType::get(
             ArrayType::get(
-                elementType, LocalSizeX), 
-            LocalSizeY), LocalSizeZ);
+                ArrayType::get(
+                    elementType, LocalSizeX), 
+                LocalSizeY), LocalSizeZ);
 
-  /* Allocate the context data array for the variable. */
-  llvm::AllocaInst *alloca = 
-    builder.CreateAlloca(contextArrayType, 0, varName);
+      /* Allocate the context data array for the variable. */
+      alloca = builder.CreateAlloca(contextArrayType, 0, varName);
+    }
   /* Align the context arrays to stack to enable wide vectors
      accesses to them. Also, LLVM 3.3 seems to produce illegal
      code at least with Core i5 when aligned only at the element
      size. */
   alloca->setAlignment(CONTEXT_ARRAY_ALIGN);
 
-  contextArrays[varName] = alloca;
+  ++ContextArrays;
   return alloca;
 }
 
@@ -898,7 +1453,8 @@ WorkitemLoops::AddContextSaveRestore
         }
       llvm::Value *loadedValue = 
         AddContextRestore
-        (user, alloca, contextRestoreLocation, isa<AllocaInst>(instruction));
+        (user, alloca, contextRestoreLocation, isa<AllocaInst>(instruction),
+         instruction);
       user->replaceUsesOfWith(instruction, loadedValue);
 #ifdef DEBUG_WORK_ITEM_LOOPS
       std::cerr << "### done, the user was converted to:" << std::endl;
@@ -907,6 +1463,203 @@ WorkitemLoops::AddContextSaveRestore
     }
 }
 
+/**
+ * Returns the width to vectorize the innermost work-item loop of the region
+ * with, see NativeVectorWidth(). The loop vectorizer executes the remaining
+ * iterations in a scalar epilogue loop. Returns 0 in case the loops are not
+ * to be vectorized.
+ */
+unsigned
+WorkitemLoops::VectorWidth(ParallelRegion *region)
+{
+  llvm::Module &M = *region->entryBB()->getParent()->getParent();
+  unsigned long vectorize = 0;
+  if (!getKernelCompilerParam(M, "vectorize_wi_loops", vectorize) || 
+      !vectorize)
+    return 0;
+  return NativeVectorWidth(region);
+}
+
+/**
+ * Returns the number of work-items the device can process in parallel 
+ * with its SIMD instructions in the given region: the native vector width
+ * for the widest scalar type the region loads or stores, passed in the 
+ * 'native_vector_width_<type>' kernel compiler parameters. 
+ *
+ * The width is limited to a power of two not exceeding the local size.
+ * Returns 0 in case the widths are not known or the width is 1.
+ */
+unsigned
+WorkitemLoops::NativeVectorWidth(ParallelRegion *region)
+{
+  llvm::Module &M = *region->entryBB()->getParent()->getParent();
+  unsigned long width = 0, typeWidth;
+  for (BasicBlockVector::iterator i = region->begin();
+       i != region->end(); ++i)
+    {
+      for (llvm::BasicBlock::iterator instr = (*i)->begin();
+           instr != (*i)->end(); ++instr) 
+        {
+          llvm::Type *type;
+          llvm::Value *pointer;
+          if (LoadInst *load = dyn_cast<LoadInst>(instr))
+            {
+              type = load->getType();
+              pointer = load->getPointerOperand();
+            }
+          else if (StoreInst *store = dyn_cast<StoreInst>(instr))
+            {
+              type = store->getValueOperand()->getType();
+              pointer = store->getPointerOperand();
+            }
+          else
+            continue;
+
+          if (pointer == localIdX || pointer == localIdY || 
+              pointer == localIdZ || pointer == localIdXFirstVar)
+            continue;
+
+          /* The vectors are scalarized before the loop vectorizer. */
+          if (getNativeVectorWidth(M, type, typeWidth) &&
+              (width == 0 || typeWidth < width))
+            width = typeWidth;
+        }
+    }
+
+  if (width == 0 && 
+      !getKernelCompilerParam(M, "native_vector_width_int", width))
+    return 0;
+
+  while ((width & (width - 1)) != 0)
+    width &= width - 1;
+  if (!DynamicLocalSize)
+    {
+      while (width > LocalSizeX)
+        width /= 2;
+    }
+  return width > 1 ? width : 0;
+}
+
+/**
+ * Returns true if the memory the given pointer points to cannot change
+ * during the execution of the work-group function: the constant address 
+ * space and the globals the kernel only loads from (such as the ids of
+ * the work-group stored by the launcher).
+ */
+static bool
+isInvariantMemory(llvm::Value *pointer)
+{
+  if (pointer->getType()->getPointerAddressSpace() == 
+      POCL_ADDRESS_SPACE_CONSTANT)
+    return true;
+
+  llvm::GlobalVariable *global = 
+    dyn_cast<llvm::GlobalVariable>(pointer->stripPointerCasts());
+  if (global == NULL)
+    return false;
+  if (global->isConstant())
+    return true;
+  for (Value::use_iterator ui = global->use_begin(), ue = global->use_end();
+       ui != ue; ++ui)
+    {
+      if (!isa<LoadInst>(*ui))
+        return false;
+    }
+  return true;
+}
+
+/**
+ * Moves the uniform computations of the region out of its work-item loops
+ * to the given loop preheader, so they are executed once per work-group
+ * instead of once per work-item.
+ *
+ * Only side-effect free instructions whose operands are defined outside
+ * the loops are moved. Loads are moved only from memory that is not
+ * written during the region: invariant memory, or any memory in case the
+ * region writes no memory at all. The instructions that could trap are 
+ * moved only if they are executed on every path through the region.
+ */
+void
+WorkitemLoops::HoistUniformInstructions
+(ParallelRegion *region, llvm::BasicBlock *preheader)
+{
+  VariableUniformityAnalysis &VUA = 
+    getAnalysis<VariableUniformityAnalysis>();
+  llvm::Function *F = preheader->getParent();
+
+  bool writesMemory = false;
+  for (BasicBlockVector::iterator i = region->begin();
+       i != region->end() && !writesMemory; ++i)
+    {
+      for (llvm::BasicBlock::iterator instr = (*i)->begin();
+           instr != (*i)->end(); ++instr) 
+        {
+          if (instr->mayWriteToMemory())
+            {
+              writesMemory = true;
+              break;
+            }
+        }
+    }
+
+  bool changed;
+  do 
+    {
+      changed = false;
+      for (BasicBlockVector::iterator i = region->begin();
+           i != region->end(); ++i)
+        {
+          llvm::BasicBlock *bb = *i;
+          for (llvm::BasicBlock::iterator instr = bb->begin();
+               instr != bb->end();) 
+            {
+              llvm::Instruction *instruction = instr++;
+
+              if (isa<PHINode>(instruction) || isa<AllocaInst>(instruction) ||
+                  isa<TerminatorInst>(instruction) ||
+                  isa<LandingPadInst>(instruction) || 
+                  instruction->mayHaveSideEffects())
+                continue;
+
+              if (LoadInst *load = dyn_cast<LoadInst>(instruction))
+                {
+                  if (!load->isSimple() ||
+                      (writesMemory && 
+                       !isInvariantMemory(load->getPointerOperand())))
+                    continue;
+                }
+
+              if (!VUA.isUniform(F, instruction) ||
+                  VUA.shouldBePrivatized(F, instruction))
+                continue;
+
+              bool operandsOutside = true;
+              for (unsigned op = 0; op < instruction->getNumOperands(); ++op)
+                {
+                  llvm::Instruction *operand = 
+                    dyn_cast<Instruction>(instruction->getOperand(op));
+                  if (operand != NULL && region->HasBlock(operand->getParent()))
+                    {
+                      operandsOutside = false;
+                      break;
+                    }
+                }
+              if (!operandsOutside)
+                continue;
+
+              if (!isSafeToSpeculativelyExecute(instruction) &&
+                  !DT->dominates(bb, region->exitBB()))
+                continue;
+
+              instruction->moveBefore(preheader->getTerminator());
+              ++HoistedUniforms;
+              changed = true;
+            }
+        }
+    }
+  while (changed);
+}
+
 bool
 WorkitemLoops::ShouldNotBeContextSaved(llvm::Instruction *instr)
 {
@@ -28,6 +28,7 @@
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Transforms/Utils/ValueMapper.h"
 #include <map>
+#include <set>
 #include <vector>
 #include "WorkitemHandler.h"
 #include "ParallelRegion.h"
@@ -55,6 +56,8 @@ namespace pocl {
     typedef std::set<llvm::Instruction* > InstructionIndex;
     typedef std::vector<llvm::Instruction* > InstructionVec;
     typedef std::map<std::string, llvm::Instruction*> StrInstructionMap;
+    typedef std::map<llvm::Instruction*, llvm::Instruction*> InstructionMap;
+    typedef std::set<ParallelRegion*> ParallelRegionSet;
 
     llvm::DominatorTree *DT;
     llvm::LoopInfo *LI;
@@ -63,24 +66,45 @@ namespace pocl {
     ParallelRegion::ParallelRegionVector *original_parallel_regions;
 
     StrInstructionMap contextArrays;
+    // The shared context arrays of the values that were packed together
+    // with the values of non-overlapping live ranges.
+    InstructionMap contextSlots;
+    // The field of each value in the context record, in case the context
+    // data is laid out as an array of per work-item records.
+    std::map<llvm::Instruction*, unsigned> contextFields;
+    // The parallel regions each basic block belongs to. The diverging
+    // regions share their entry block.
+    std::map<llvm::BasicBlock*, std::vector<ParallelRegion*> > blockRegions;
 
     virtual bool ProcessFunction(llvm::Function &F);
 
-    void FixMultiRegionVariables(ParallelRegion *region);
+    void FindMultiRegionVariables
+        (ParallelRegion *region, InstructionVec &instructionsToFix,
+         InstructionIndex &found);
+    void AssignContextSlots(llvm::Function &F, InstructionVec &instructions);
+    void ContextLiveRegions
+        (llvm::Instruction *instruction, ParallelRegionSet &regions);
     void AddContextSaveRestore(llvm::Instruction *instruction);
 
     llvm::Instruction *AddContextSave(llvm::Instruction *instruction, llvm::Instruction *alloca);
     llvm::Instruction *AddContextRestore
         (llvm::Value *val, llvm::Instruction *alloca, 
          llvm::Instruction *before=NULL, 
-         bool isAlloca=false);
+         bool isAlloca=false, llvm::Instruction *savedValue=NULL);
+    void AddContextFieldIndex
+        (std::vector<llvm::Value *> &gepArgs, llvm::Instruction *instruction);
     llvm::Instruction *GetContextArray(llvm::Instruction *val);
+    llvm::AllocaInst *CreateContextArray
+        (llvm::Function &F, llvm::Type *elementType, const std::string &name);
 
     std::pair<llvm::BasicBlock *, llvm::BasicBlock *>
     CreateLoopAround
         (ParallelRegion &region, llvm::BasicBlock *entryBB, llvm::BasicBlock *exitBB, 
-         bool peeledFirst, llvm::Value *localIdVar, size_t LocalSizeForDim,
-         bool addIncBlock=true);
+         bool peeledFirst, llvm::Value *localIdVar, llvm::Value *LocalSizeForDim,
+         bool addIncBlock=true, unsigned vectorWidth=0);
+
+    unsigned VectorWidth(ParallelRegion *region);
+    unsigned NativeVectorWidth(ParallelRegion *region);
 
     llvm::BasicBlock *
       AppendIncBlock
@@ -89,6 +113,9 @@ namespace pocl {
 
     ParallelRegion* RegionOfBlock(llvm::BasicBlock *bb);
 
+    void HoistUniformInstructions
+        (ParallelRegion *region, llvm::BasicBlock *preheader);
+
     bool ShouldNotBeContextSaved(llvm::Instruction *instr);
 
     std::map<llvm::Instruction*, unsigned> tempInstructionIds;
@@ -97,6 +124,11 @@ namespace pocl {
     // in the inner (dimension 0) loop. This is set to 1 in an peeled iteration
     // to skip the 0, 0, 0 iteration in the loops.
     llvm::Value *localIdXFirstVar;
+
+    // The local size loaded in the entry block, and the number of work-items
+    // the context arrays are allocated for, in case of DynamicLocalSize.
+    llvm::Value *dynLocalSizeX, *dynLocalSizeY, *dynLocalSizeZ;
+    llvm::Instruction *dynWorkItemCount;
   };
 }
 
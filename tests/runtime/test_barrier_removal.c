@@ -0,0 +1,130 @@
+/* Tests the removal of the barriers that order no shared memory accesses.
+
+   The kernel has a barrier that orders only private data, which can be
+   removed, and one that makes the value written by the neighbour
+   work-item visible, which must be kept even though the addresses
+   differ for a single work-item.
+
+   Copyright (c) 2014 pocl developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <CL/cl.h>
+
+#define GLOBAL_SIZE 64
+#define LOCAL_SIZE 8
+
+static const char kernel_source[] =
+  "#define LOCAL_SIZE 8\n"
+  "kernel void neighbours(global int *out) {\n"
+  "  local int buf[LOCAL_SIZE];\n"
+  "  int lid = get_local_id(0);\n"
+  "  int x = get_global_id(0) * 2;\n"
+  "  barrier(CLK_LOCAL_MEM_FENCE);\n"
+  "  x += 1;\n"
+  "  buf[lid] = x;\n"
+  "  barrier(CLK_LOCAL_MEM_FENCE);\n"
+  "  out[get_global_id(0)] = lid + 1 < LOCAL_SIZE ? buf[lid + 1] : -1;\n"
+  "}\n";
+
+int
+main(void)
+{
+  cl_int err;
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;
+  cl_program program;
+  cl_kernel kernel;
+  cl_mem buffer;
+  cl_int data[GLOBAL_SIZE];
+  const char *source = kernel_source;
+  size_t global_size = GLOBAL_SIZE, local_size = LOCAL_SIZE;
+  unsigned i;
+
+  err = clGetPlatformIDs (1, &platform, NULL);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  err = clGetDeviceIDs (platform, CL_DEVICE_TYPE_ALL, 1, &device, NULL);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  context = clCreateContext (NULL, 1, &device, NULL, NULL, &err);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  queue = clCreateCommandQueue (context, device, 0, &err);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  program = clCreateProgramWithSource (context, 1, &source, NULL, &err);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  err = clBuildProgram (program, 1, &device, NULL, NULL, NULL);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  kernel = clCreateKernel (program, "neighbours", &err);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  buffer = clCreateBuffer (context, CL_MEM_WRITE_ONLY, sizeof (data), NULL,
+                           &err);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  err = clSetKernelArg (kernel, 0, sizeof (cl_mem), &buffer);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  err = clEnqueueNDRangeKernel (queue, kernel, 1, NULL, &global_size,
+                                &local_size, 0, NULL, NULL);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  err = clEnqueueReadBuffer (queue, buffer, CL_TRUE, 0, sizeof (data), data,
+                             0, NULL, NULL);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  for (i = 0; i < GLOBAL_SIZE; ++i)
+    {
+      cl_int expected = 
+        (i + 1) % LOCAL_SIZE == 0 ? -1 : (cl_int)(i + 1) * 2 + 1;
+      if (data[i] != expected)
+        {
+          printf ("wrong result at %u: %d\n", i, data[i]);
+          return EXIT_FAILURE;
+        }
+    }
+
+  clReleaseMemObject (buffer);
+  clReleaseKernel (kernel);
+  clReleaseProgram (program);
+  clReleaseCommandQueue (queue);
+  clReleaseContext (context);
+
+  return EXIT_SUCCESS;
+}
@@ -25,6 +25,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <CL/cl.h>
 
 #define MAX_PLATFORMS 32
@@ -37,6 +38,15 @@ char kernel[] =
   "#include \"test_kernel_src_in_another_dir.h\"\n"
   "#include \"test_kernel_src_in_pwd.h\"\n";
 
+static volatile int build_notified = 0;
+
+static void CL_CALLBACK
+build_notify(cl_program program, void *user_data)
+{
+  *(int*)user_data = 1;
+  build_notified = 1;
+}
+
 int
 main(void){
   cl_int err;
@@ -75,5 +85,36 @@ main(void){
   if (err != CL_SUCCESS)
     return EXIT_FAILURE;
 
+  /* An asynchronous build: returns immediately and calls the callback
+     when the builds for all the devices have finished. */
+  cl_program async_program = 
+    clCreateProgramWithSource(context, 1, (const char**)&kernel_buffer, 
+                              &kernel_size, &err);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  int user_data = 0;
+  err = clBuildProgram
+    (async_program, num_devices, devices, 
+     "-D__FUNC__=helper_func -I./test_data", 
+     build_notify, &user_data);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  for (i = 0; i < 6000 && !build_notified; ++i)
+    usleep(10000);
+  if (!build_notified || !user_data)
+    return EXIT_FAILURE;
+
+  for (i = 0; i < num_devices; ++i)
+    {
+      cl_build_status status;
+      err = clGetProgramBuildInfo(async_program, devices[i], 
+                                  CL_PROGRAM_BUILD_STATUS, 
+                                  sizeof(status), &status, NULL);
+      if (err != CL_SUCCESS || status != CL_BUILD_SUCCESS)
+        return EXIT_FAILURE;
+    }
+
   return err == CL_SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -8,6 +8,36 @@
 #define MAX_BINARIES  32
 char kernel[] = "__kernel void k() {\n    return;\n}";
 
+/* Launches the kernel k of the program once on the device. The kernel
+   is returned in *kernel, or released if kernel is NULL. */
+static cl_int
+launch_k (cl_context context, cl_device_id device, cl_program program,
+          cl_kernel *kernel)
+{
+  cl_int err;
+  size_t global_size = 1, local_size = 1;
+  cl_command_queue queue;
+  cl_kernel k;
+
+  queue = clCreateCommandQueue (context, device, 0, &err);
+  if (err != CL_SUCCESS)
+    return err;
+  k = clCreateKernel (program, "k", &err);
+  if (err != CL_SUCCESS)
+    return err;
+  err = clEnqueueNDRangeKernel (queue, k, 1, NULL, &global_size, 
+                                &local_size, 0, NULL, NULL);
+  if (err != CL_SUCCESS)
+    return err;
+  err = clFinish (queue);
+  if (kernel != NULL)
+    *kernel = k;
+  else
+    clReleaseKernel (k);
+  clReleaseCommandQueue (queue);
+  return err;
+}
+
 int
 main(void){
   cl_int err;
@@ -25,6 +55,7 @@ main(void){
   cl_int binary_statuses2[MAX_BINARIES];
   cl_program program = NULL;
   cl_program program_with_binary = NULL;
+  cl_kernel k = NULL;
   err = clGetPlatformIDs(MAX_PLATFORMS, platforms, &nplatforms);	
   if (err != CL_SUCCESS && !nplatforms)
     return EXIT_FAILURE;
@@ -49,6 +80,12 @@ main(void){
   err = clBuildProgram(program, num_devices, devices, NULL, NULL, NULL);
   if (err != CL_SUCCESS)
     return EXIT_FAILURE;
+
+  /* The work-group function compiled for the launch is included in
+     the binary while the kernel exists. */
+  err = launch_k (context, devices[0], program, &k);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
   
   err = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, 0, 0, &num_binaries);
   if (err != CL_SUCCESS)
@@ -85,7 +122,6 @@ main(void){
   if (err != CL_SUCCESS)
     goto FREE_AND_EXIT;
 
-  clReleaseProgram(program_with_binary);
   for (i = 0; i < num; i++)
     {
       if (binary_statuses[i] != CL_SUCCESS)
@@ -94,6 +130,15 @@ main(void){
 	  goto FREE_AND_EXIT;
 	}
     }
+
+  err = clBuildProgram(program_with_binary, num, devices, NULL, NULL, NULL);
+  if (err != CL_SUCCESS)
+    goto FREE_AND_EXIT;
+
+  err = launch_k (context, devices[0], program_with_binary, NULL);
+  if (err != CL_SUCCESS)
+    goto FREE_AND_EXIT;
+  clReleaseProgram(program_with_binary);
     
   // negative test1: invalid device
   device_id0 = devices[0];
@@ -158,6 +203,8 @@ main(void){
     free(binary_sizes);
   if (binaries) 
     free(binaries);
+  if (k)
+    clReleaseKernel(k);
   if (program)
     clReleaseProgram(program);  
   if (program_with_binary)
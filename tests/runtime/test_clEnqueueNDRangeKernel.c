@@ -0,0 +1,229 @@
+/* Tests and benchmarks the clEnqueueNDRangeKernel fast path. 
+
+   Once the work-group function of a kernel has been compiled for a
+   local size, launching it again must not touch the file system. The
+   file system functions are interposed to count the calls done during
+   the warm launches. The global offset is passed at run time, so tiled
+   launches over sub-ranges reuse the same work-group function, too.
+
+   Copyright (c) 2014 pocl developers
+   
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <CL/cl.h>
+
+#define WARM_LAUNCHES 1000
+#define GLOBAL_SIZE 64
+#define LOCAL_SIZE 8
+#define TILE_SIZE 16
+
+static const char kernel_source[] = 
+  "kernel void add_one(global int *data) {\n"
+  "  data[get_global_id(0)] += 1 + get_global_id(1) + get_global_id(2);\n"
+  "}\n";
+
+static volatile int counting = 0;
+static volatile unsigned fs_calls = 0;
+
+static void
+count_fs_call (const char *function, const char *path_name)
+{
+  if (!counting)
+    return;
+  __sync_fetch_and_add (&fs_calls, 1);
+  fprintf (stderr, "warm launch called %s(%s)\n", function, path_name);
+}
+
+int
+access (const char *path_name, int mode)
+{
+  static int (*real_access) (const char*, int) = NULL;
+  if (real_access == NULL)
+    real_access = (int (*) (const char*, int)) dlsym (RTLD_NEXT, "access");
+  count_fs_call ("access", path_name);
+  return real_access (path_name, mode);
+}
+
+int
+mkdir (const char *path_name, mode_t mode)
+{
+  static int (*real_mkdir) (const char*, mode_t) = NULL;
+  if (real_mkdir == NULL)
+    real_mkdir = (int (*) (const char*, mode_t)) dlsym (RTLD_NEXT, "mkdir");
+  count_fs_call ("mkdir", path_name);
+  return real_mkdir (path_name, mode);
+}
+
+int
+open (const char *path_name, int flags, ...)
+{
+  static int (*real_open) (const char*, int, ...) = NULL;
+  mode_t mode = 0;
+  va_list ap;
+  if (real_open == NULL)
+    real_open = (int (*) (const char*, int, ...)) dlsym (RTLD_NEXT, "open");
+  if (flags & O_CREAT)
+    {
+      va_start (ap, flags);
+      mode = va_arg (ap, int);
+      va_end (ap);
+    }
+  count_fs_call ("open", path_name);
+  return real_open (path_name, flags, mode);
+}
+
+FILE *
+fopen (const char *path_name, const char *mode)
+{
+  static FILE *(*real_fopen) (const char*, const char*) = NULL;
+  if (real_fopen == NULL)
+    real_fopen = (FILE *(*) (const char*, const char*)) 
+      dlsym (RTLD_NEXT, "fopen");
+  count_fs_call ("fopen", path_name);
+  return real_fopen (path_name, mode);
+}
+
+int
+main(void)
+{
+  cl_int err;
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;
+  cl_program program;
+  cl_kernel kernel;
+  cl_mem buffer;
+  cl_int data[GLOBAL_SIZE];
+  size_t global_size = GLOBAL_SIZE, local_size = LOCAL_SIZE;
+  size_t tile_size = TILE_SIZE, tile_offset;
+  const char *source = kernel_source;
+  struct timeval start, end;
+  unsigned i;
+
+  err = clGetPlatformIDs (1, &platform, NULL);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  err = clGetDeviceIDs (platform, CL_DEVICE_TYPE_ALL, 1, &device, NULL);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  context = clCreateContext (NULL, 1, &device, NULL, NULL, &err);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  queue = clCreateCommandQueue (context, device, 0, &err);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  program = clCreateProgramWithSource (context, 1, &source, NULL, &err);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  err = clBuildProgram (program, 1, &device, NULL, NULL, NULL);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  kernel = clCreateKernel (program, "add_one", &err);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  memset (data, 0, sizeof (data));
+  buffer = clCreateBuffer (context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                           sizeof (data), data, &err);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  err = clSetKernelArg (kernel, 0, sizeof (cl_mem), &buffer);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  /* The cold launch compiles the work-group function. */
+  gettimeofday (&start, NULL);
+  err = clEnqueueNDRangeKernel (queue, kernel, 1, NULL, &global_size, 
+                                &local_size, 0, NULL, NULL);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+  clFinish (queue);
+  gettimeofday (&end, NULL);
+  printf ("cold launch: %.1f us\n", 
+          (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_usec - start.tv_usec));
+
+  counting = 1;
+  gettimeofday (&start, NULL);
+  for (i = 0; i < WARM_LAUNCHES; ++i)
+    {
+      err = clEnqueueNDRangeKernel (queue, kernel, 1, NULL, &global_size, 
+                                    &local_size, 0, NULL, NULL);
+      if (err != CL_SUCCESS)
+        return EXIT_FAILURE;
+      clFinish (queue);
+    }
+  gettimeofday (&end, NULL);
+  printf ("warm launch: %.1f us, %u file system calls\n", 
+          ((end.tv_sec - start.tv_sec) * 1e6 + 
+           (end.tv_usec - start.tv_usec)) / WARM_LAUNCHES, fs_calls);
+
+  /* Tiled launches with different offsets must not recompile either. */
+  for (tile_offset = 0; tile_offset < GLOBAL_SIZE; tile_offset += TILE_SIZE)
+    {
+      err = clEnqueueNDRangeKernel (queue, kernel, 1, &tile_offset, 
+                                    &tile_size, &local_size, 0, NULL, NULL);
+      if (err != CL_SUCCESS)
+        return EXIT_FAILURE;
+    }
+  clFinish (queue);
+  counting = 0;
+  printf ("tiled launches: %u file system calls\n", fs_calls);
+
+  err = clEnqueueReadBuffer (queue, buffer, CL_TRUE, 0, sizeof (data), data,
+                             0, NULL, NULL);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  for (i = 0; i < GLOBAL_SIZE; ++i)
+    {
+      if (data[i] != WARM_LAUNCHES + 2)
+        {
+          printf ("wrong result at %u: %d\n", i, data[i]);
+          return EXIT_FAILURE;
+        }
+    }
+
+  clReleaseMemObject (buffer);
+  clReleaseKernel (kernel);
+  clReleaseProgram (program);
+  clReleaseCommandQueue (queue);
+  clReleaseContext (context);
+
+  return fs_calls == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
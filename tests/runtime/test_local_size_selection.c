@@ -0,0 +1,159 @@
+/* Tests the local size picked for the launches without one.
+
+   A 2D kernel is launched with a NULL local_work_size. Every work-item
+   has to run once per launch, and the local size it sees has to divide
+   the global size in both of the dimensions. There are enough launches
+   for POCL_LOCAL_SIZE_TUNING to measure all of its candidates.
+
+   Copyright (c) 2014 pocl developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <CL/cl.h>
+
+#define GLOBAL_X 96
+#define GLOBAL_Y 40
+#define LAUNCHES 16
+
+static const char kernel_source[] =
+  "kernel void ids(global int *data, global int *local_size) {\n"
+  "  size_t i = get_global_id(1) * get_global_size(0) + get_global_id(0);\n"
+  "  data[i] += 1;\n"
+  "  if (i == 0) {\n"
+  "    local_size[0] = get_local_size(0);\n"
+  "    local_size[1] = get_local_size(1);\n"
+  "  }\n"
+  "}\n";
+
+int
+main(void)
+{
+  cl_int err;
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;
+  cl_program program;
+  cl_kernel kernel;
+  cl_mem buffer, local_buffer;
+  cl_int data[GLOBAL_X * GLOBAL_Y];
+  cl_int local_size[2];
+  size_t global_size[2] = {GLOBAL_X, GLOBAL_Y};
+  size_t max_wg_size;
+  const char *source = kernel_source;
+  unsigned i;
+
+  err = clGetPlatformIDs (1, &platform, NULL);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  err = clGetDeviceIDs (platform, CL_DEVICE_TYPE_ALL, 1, &device, NULL);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  err = clGetDeviceInfo (device, CL_DEVICE_MAX_WORK_GROUP_SIZE, 
+                         sizeof (size_t), &max_wg_size, NULL);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  context = clCreateContext (NULL, 1, &device, NULL, NULL, &err);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  queue = clCreateCommandQueue (context, device, 0, &err);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  program = clCreateProgramWithSource (context, 1, &source, NULL, &err);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  err = clBuildProgram (program, 1, &device, NULL, NULL, NULL);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  kernel = clCreateKernel (program, "ids", &err);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  memset (data, 0, sizeof (data));
+  buffer = clCreateBuffer (context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                           sizeof (data), data, &err);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  local_buffer = clCreateBuffer (context, CL_MEM_WRITE_ONLY, 
+                                 sizeof (local_size), NULL, &err);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  err = clSetKernelArg (kernel, 0, sizeof (cl_mem), &buffer);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  err = clSetKernelArg (kernel, 1, sizeof (cl_mem), &local_buffer);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  for (i = 0; i < LAUNCHES; ++i)
+    {
+      err = clEnqueueNDRangeKernel (queue, kernel, 2, NULL, global_size, 
+                                    NULL, 0, NULL, NULL);
+      if (err != CL_SUCCESS)
+        return EXIT_FAILURE;
+    }
+
+  err = clEnqueueReadBuffer (queue, buffer, CL_TRUE, 0, sizeof (data), data,
+                             0, NULL, NULL);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  err = clEnqueueReadBuffer (queue, local_buffer, CL_TRUE, 0, 
+                             sizeof (local_size), local_size, 0, NULL, NULL);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  printf ("local size %d x %d\n", local_size[0], local_size[1]);
+  if (local_size[0] < 1 || local_size[1] < 1 ||
+      GLOBAL_X % local_size[0] != 0 || GLOBAL_Y % local_size[1] != 0 ||
+      (size_t)(local_size[0] * local_size[1]) > max_wg_size)
+    return EXIT_FAILURE;
+
+  for (i = 0; i < GLOBAL_X * GLOBAL_Y; ++i)
+    {
+      if (data[i] != LAUNCHES)
+        {
+          printf ("wrong result at %u: %d\n", i, data[i]);
+          return EXIT_FAILURE;
+        }
+    }
+
+  clReleaseMemObject (local_buffer);
+  clReleaseMemObject (buffer);
+  clReleaseKernel (kernel);
+  clReleaseProgram (program);
+  clReleaseCommandQueue (queue);
+  clReleaseContext (context);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,146 @@
+/* Tests the kernel argument value specialization.
+
+   A kernel is launched repeatedly with the same scalar argument value so
+   that a work-group function specialized for the value gets compiled,
+   then with another value which must not use the specialized one, and
+   then again with the first value.
+
+   Copyright (c) 2014 pocl developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <CL/cl.h>
+
+#define GLOBAL_SIZE 64
+#define LOCAL_SIZE 8
+
+static const char kernel_source[] =
+  "kernel void add_n(global int *data, int n) {\n"
+  "  for (int i = 0; i < n; ++i)\n"
+  "    data[get_global_id(0)] += 1;\n"
+  "}\n";
+
+static int
+launch (cl_command_queue queue, cl_kernel kernel, cl_int n, unsigned times)
+{
+  size_t global_size = GLOBAL_SIZE, local_size = LOCAL_SIZE;
+  unsigned i;
+  cl_int err;
+
+  err = clSetKernelArg (kernel, 1, sizeof (cl_int), &n);
+  if (err != CL_SUCCESS)
+    return 0;
+
+  for (i = 0; i < times; ++i)
+    {
+      err = clEnqueueNDRangeKernel (queue, kernel, 1, NULL, &global_size,
+                                    &local_size, 0, NULL, NULL);
+      if (err != CL_SUCCESS)
+        return 0;
+      clFinish (queue);
+    }
+  return 1;
+}
+
+int
+main(void)
+{
+  cl_int err;
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;
+  cl_program program;
+  cl_kernel kernel;
+  cl_mem buffer;
+  cl_int data[GLOBAL_SIZE];
+  const char *source = kernel_source;
+  unsigned i;
+
+  err = clGetPlatformIDs (1, &platform, NULL);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  err = clGetDeviceIDs (platform, CL_DEVICE_TYPE_ALL, 1, &device, NULL);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  context = clCreateContext (NULL, 1, &device, NULL, NULL, &err);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  queue = clCreateCommandQueue (context, device, 0, &err);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  program = clCreateProgramWithSource (context, 1, &source, NULL, &err);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  err = clBuildProgram (program, 1, &device, NULL, NULL, NULL);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  kernel = clCreateKernel (program, "add_n", &err);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  memset (data, 0, sizeof (data));
+  buffer = clCreateBuffer (context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                           sizeof (data), data, &err);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  err = clSetKernelArg (kernel, 0, sizeof (cl_mem), &buffer);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  /* The later launches with n = 3 use the specialized variant, the one
+     with n = 5 has to fall back to the generic one. */
+  if (!launch (queue, kernel, 3, 10) ||
+      !launch (queue, kernel, 5, 1) ||
+      !launch (queue, kernel, 3, 5))
+    return EXIT_FAILURE;
+
+  err = clEnqueueReadBuffer (queue, buffer, CL_TRUE, 0, sizeof (data), data,
+                             0, NULL, NULL);
+  if (err != CL_SUCCESS)
+    return EXIT_FAILURE;
+
+  for (i = 0; i < GLOBAL_SIZE; ++i)
+    {
+      if (data[i] != 15 * 3 + 5)
+        {
+          printf ("wrong result at %u: %d\n", i, data[i]);
+          return EXIT_FAILURE;
+        }
+    }
+
+  clReleaseMemObject (buffer);
+  clReleaseKernel (kernel);
+  clReleaseProgram (program);
+  clReleaseCommandQueue (queue);
+  clReleaseContext (context);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,45 @@
+/* private_barriers - a barrier that orders only private data is removed,
+   the one ordering the local memory accesses must be kept
+
+   Copyright (c) 2014 pocl developers
+   
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+__kernel void
+test_kernel (void)
+{
+  __local int buf[5];
+  int lid = get_local_id (0);
+  int x = lid * 2;
+
+  /* Only private data is accessed around this one. */
+  barrier (CLK_LOCAL_MEM_FENCE);
+
+  x += 1;
+  buf[lid] = x;
+  if (lid == 0)
+    buf[4] = -1;
+
+  /* The work-items read the values written by their neighbour. The
+     addresses differ for a single work-item but not across them. */
+  barrier (CLK_LOCAL_MEM_FENCE);
+
+  printf ("%d: %d %d\n", lid, buf[(lid + 1) % 4], buf[lid + 1]);
+}
@@ -0,0 +1,45 @@
+/* uniform_loops - the work-item loop is switched with the kernel loops
+   with uniform trip counts that are not simple innermost for-loops
+
+   Copyright (c) 2014 pocl developers
+   
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+__kernel void
+test_kernel (void)
+{
+  int gid = get_global_id (0);
+
+  /* A loop with two exits, both with uniform conditions, should be
+     horizontally parallelized. */
+  for (int i = 0; i < 4; ++i) {
+    if (i == 2)
+      break;
+    printf ("i: %d gid: %d\n", i, gid);
+  }
+
+  /* The inner loop has a varying trip count, but the outer loop has not,
+     thus the work-items should be parallelized per outer loop iteration. */
+  for (int i = 0; i < 2; ++i) {
+    for (int j = 0; j <= gid; ++j) {
+      printf ("i: %d j: %d gid: %d\n", i, j, gid);
+    }
+  }
+}